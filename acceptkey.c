@@ -0,0 +1,191 @@
+#include <string.h>
+#include <stdint.h>
+#include "acceptkey.h"
+#include "lib/sha1/sha1.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define ACCEPTKEY_X86
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+typedef void (*Sha1Proc)(uint32_t state[5], const unsigned char block[64]);
+
+static Sha1Proc sha1Proc;
+static const char* sha1Backend;
+
+static const char wsGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// key与GUID共60字节，填充后为两个块，第二个块只有填充和长度（480位），是固定的
+static const unsigned char paddingBlock[64] = {
+    [62] = 0x01, [63] = 0xE0
+};
+
+static const char base64Table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#ifdef ACCEPTKEY_X86
+
+// 使用SHA扩展指令处理一个块，每组4轮，消息扩展与轮函数交错进行
+__attribute__((target("sha,ssse3,sse4.1")))
+static void sha1BlockSHANI(uint32_t state[5], const unsigned char block[64]) {
+
+    const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090A0B0C0D0E0FULL);
+    __m128i abcd, abcdSave, e0, e0Save, e1;
+    __m128i msg0, msg1, msg2, msg3;
+
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1B);
+    e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+    abcdSave = abcd;
+    e0Save = e0;
+
+    // 轮0-3
+    msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 0)), byteSwap);
+    e0 = _mm_add_epi32(e0, msg0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+    // 轮4-7
+    msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 16)), byteSwap);
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+    // 轮8-11
+    msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 32)), byteSwap);
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+    msg0 = _mm_xor_si128(msg0, msg2);
+
+    // 轮12-15
+    msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(block + 48)), byteSwap);
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+    msg1 = _mm_xor_si128(msg1, msg3);
+
+    // 轮16-63，每组的结构相同，只是消息寄存器轮换，f为轮函数编号
+    #define SHA1_ROUNDS4(ecur, eother, m0, m1, m2, m3, f) \
+        ecur = _mm_sha1nexte_epu32(ecur, m0); \
+        eother = abcd; \
+        m1 = _mm_sha1msg2_epu32(m1, m0); \
+        abcd = _mm_sha1rnds4_epu32(abcd, ecur, f); \
+        m3 = _mm_sha1msg1_epu32(m3, m0); \
+        m2 = _mm_xor_si128(m2, m0);
+
+    SHA1_ROUNDS4(e0, e1, msg0, msg1, msg2, msg3, 0);    // 16-19
+    SHA1_ROUNDS4(e1, e0, msg1, msg2, msg3, msg0, 1);    // 20-23
+    SHA1_ROUNDS4(e0, e1, msg2, msg3, msg0, msg1, 1);    // 24-27
+    SHA1_ROUNDS4(e1, e0, msg3, msg0, msg1, msg2, 1);    // 28-31
+    SHA1_ROUNDS4(e0, e1, msg0, msg1, msg2, msg3, 1);    // 32-35
+    SHA1_ROUNDS4(e1, e0, msg1, msg2, msg3, msg0, 1);    // 36-39
+    SHA1_ROUNDS4(e0, e1, msg2, msg3, msg0, msg1, 2);    // 40-43
+    SHA1_ROUNDS4(e1, e0, msg3, msg0, msg1, msg2, 2);    // 44-47
+    SHA1_ROUNDS4(e0, e1, msg0, msg1, msg2, msg3, 2);    // 48-51
+    SHA1_ROUNDS4(e1, e0, msg1, msg2, msg3, msg0, 2);    // 52-55
+    SHA1_ROUNDS4(e0, e1, msg2, msg3, msg0, msg1, 2);    // 56-59
+    SHA1_ROUNDS4(e1, e0, msg3, msg0, msg1, msg2, 3);    // 60-63
+
+    #undef SHA1_ROUNDS4
+
+    // 轮64-67
+    e0 = _mm_sha1nexte_epu32(e0, msg0);
+    e1 = abcd;
+    msg1 = _mm_sha1msg2_epu32(msg1, msg0);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+    msg3 = _mm_sha1msg1_epu32(msg3, msg0);
+    msg2 = _mm_xor_si128(msg2, msg0);
+
+    // 轮68-71
+    e1 = _mm_sha1nexte_epu32(e1, msg1);
+    e0 = abcd;
+    msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+    msg3 = _mm_xor_si128(msg3, msg1);
+
+    // 轮72-75
+    e0 = _mm_sha1nexte_epu32(e0, msg2);
+    e1 = abcd;
+    msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+    // 轮76-79
+    e1 = _mm_sha1nexte_epu32(e1, msg3);
+    e0 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+    e0 = _mm_sha1nexte_epu32(e0, e0Save);
+    abcd = _mm_add_epi32(abcd, abcdSave);
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+#endif
+
+void wsAcceptKeyInit(void) {
+
+    sha1Proc = SHA1Transform;
+    sha1Backend = "portable";
+
+#ifdef ACCEPTKEY_X86
+    // __builtin_cpu_supports不能检查SHA扩展，需要直接读取CPUID（EAX=7, ECX=0时EBX的第29位）
+    unsigned int eax, ebx, ecx, edx;
+    __builtin_cpu_init();
+    if(__get_cpuid_max(0, NULL) >= 7 && __builtin_cpu_supports("sse4.1")) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        if(ebx & (1u << 29)) {
+            sha1Proc = sha1BlockSHANI;
+            sha1Backend = "sha-ni";
+        }
+    }
+#endif
+}
+
+const char* wsAcceptKeyBackendName(void) {
+    return sha1Backend;
+}
+
+bool wsAcceptKey(const char* key, size_t keyLen, char* out) {
+
+    uint32_t state[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    unsigned char block[64];
+    unsigned char digest[21];
+
+    if(keyLen != WS_KEY_LEN) {
+        return false;
+    }
+
+    memcpy(block, key, WS_KEY_LEN);
+    memcpy(block + WS_KEY_LEN, wsGuid, sizeof(wsGuid) - 1);
+    block[60] = 0x80;
+    block[61] = block[62] = block[63] = 0;
+
+    sha1Proc(state, block);
+    sha1Proc(state, paddingBlock);
+
+    for(int i = 0; i < 5; i++) {
+        digest[i * 4 + 0] = (unsigned char)(state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)state[i];
+    }
+    digest[20] = 0;
+
+    // 20字节编码为27个字符，末尾补一个'='
+    for(int i = 0; i < 7; i++) {
+        uint32_t v = (uint32_t)digest[i * 3] << 16 | (uint32_t)digest[i * 3 + 1] << 8 | digest[i * 3 + 2];
+        out[i * 4 + 0] = base64Table[v >> 18];
+        out[i * 4 + 1] = base64Table[(v >> 12) & 0x3F];
+        out[i * 4 + 2] = base64Table[(v >> 6) & 0x3F];
+        out[i * 4 + 3] = base64Table[v & 0x3F];
+    }
+    out[27] = '=';
+
+    return true;
+}
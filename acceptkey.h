@@ -0,0 +1,24 @@
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifndef QLWS_ACCEPTKEY_H
+
+#define QLWS_ACCEPTKEY_H
+
+// Sec-WebSocket-Accept的计算，x86下CPU支持SHA扩展指令时使用硬件SHA-1，否则使用lib/sha1的实现
+
+// Sec-WebSocket-Key为16字节随机数的base64编码，固定24个字符
+#define WS_KEY_LEN 24
+
+// Sec-WebSocket-Accept为20字节SHA-1摘要的base64编码，固定28个字符
+#define WS_ACCEPT_KEY_LEN 28
+
+// 选择实现，需要在第一次调用wsAcceptKey前调用
+void wsAcceptKeyInit(void);
+const char* wsAcceptKeyBackendName(void);
+
+// 由key计算Sec-WebSocket-Accept，将28个字符直接写入out，不写入结尾的'\0'
+// key不是24个字符时返回false
+bool wsAcceptKey(const char* key, size_t keyLen, char* out);
+
+#endif
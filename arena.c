@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "arena.h"
+
+// 额外块的最小大小
+#define MIN_BLOCK_SIZE 4096
+
+// 分配的对齐单位，满足指针、int64及double的对齐要求
+#define ARENA_ALIGN 8
+
+struct ArenaBlock {
+    ArenaBlock* next;
+    double data[];          // 保证块内数据从对齐的位置开始
+};
+
+static inline size_t alignUp(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+void arenaInit(Arena* arena, void* buffer, size_t size) {
+
+    // 初始缓冲区的起始位置不一定对齐
+    char* begin = buffer;
+    char* aligned = buffer ? (char*)alignUp((uintptr_t)begin) : NULL;
+
+    if(aligned == NULL || aligned - begin >= (ptrdiff_t)size) {
+        arena->cursor = arena->end = NULL;
+    } else {
+        arena->cursor = aligned;
+        arena->end = begin + size;
+    }
+
+    arena->blocks = NULL;
+    arena->nextSize = size * 2 > MIN_BLOCK_SIZE ? size * 2 : MIN_BLOCK_SIZE;
+}
+
+void* arenaAlloc(Arena* arena, size_t size) {
+
+    size = alignUp(size);
+
+    if(arena->cursor && (size_t)(arena->end - arena->cursor) >= size) {
+        void* p = arena->cursor;
+        arena->cursor += size;
+        return p;
+    }
+
+    size_t blockSize = arena->nextSize;
+    while(blockSize < size) blockSize *= 2;
+
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + blockSize);
+    if(block == NULL) {
+        return NULL;
+    }
+
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->nextSize = blockSize * 2;
+
+    arena->cursor = (char*)block->data + size;
+    arena->end = (char*)block->data + blockSize;
+
+    return block->data;
+}
+
+void arenaRelease(Arena* arena) {
+
+    while(arena->blocks) {
+        ArenaBlock* next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+
+    arena->cursor = arena->end = NULL;
+}
@@ -0,0 +1,29 @@
+#include <stddef.h>
+
+#ifndef QLWS_ARENA_H
+
+#define QLWS_ARENA_H
+
+// 请求级的内存区，从调用者提供的初始缓冲区（通常在栈上）开始顺序分配，用完后再申请更大的块
+// 分配的内存不能单独释放，arenaRelease一次性释放所有额外申请的块
+// 不加锁，只能在一个线程中使用
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct Arena {
+    char* cursor;           // 当前块中下一次分配的位置
+    char* end;
+    ArenaBlock* blocks;     // 额外申请的块，最新的在前
+    size_t nextSize;        // 下一个额外块的大小，每次翻倍
+} Arena;
+
+// buffer为初始缓冲区，可以为NULL
+void arenaInit(Arena* arena, void* buffer, size_t size);
+
+// 返回按指针及double对齐的内存，内存不足时返回NULL
+void* arenaAlloc(Arena* arena, size_t size);
+
+// 释放所有额外申请的块，之后arena不能再使用，除非重新arenaInit
+void arenaRelease(Arena* arena);
+
+#endif
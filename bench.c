@@ -0,0 +1,1134 @@
+#include "platform.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// 性能测试工具，不属于插件，通过make bench构建运行
+// 被测模块的源文件直接包含进来，以便统计其中的内存申请次数
+// 用法：bench [测试名...]，不带参数时运行所有测试，其中stream是检查MessageStream回调的测试，失败时以非0退出
+
+static uint64_t allocations;
+
+static void* countedMalloc(size_t size) {
+    allocations++;
+    return malloc(size);
+}
+
+static void* countedRealloc(void* p, size_t size) {
+    allocations++;
+    return realloc(p, size);
+}
+
+#define malloc countedMalloc
+#define realloc countedRealloc
+
+#include "ws.c"
+#include "unmask.c"
+
+// 参数绑定测试中名称比较的次数，即按名称查找时实际比较字符串的次数
+static uint64_t comparisons;
+
+static int countedMemcmp(const void* a, const void* b, size_t len) {
+    comparisons++;
+    return memcmp(a, b, len);
+}
+
+static int countedStrcmp(const char* a, const char* b) {
+    comparisons++;
+    return strcmp(a, b);
+}
+
+#define memcmp countedMemcmp
+#include "methods.c"
+// jsontape.c与ws.c中都有静态函数hexValue
+#define hexValue tapeHexValue
+#include "jsontape.c"
+#undef hexValue
+#undef memcmp
+
+// cJSON.c会重新定义true和false，包含之后恢复为stdbool.h中的定义
+#undef true
+#undef false
+#define strcmp countedStrcmp
+#include "lib/cjson/cJSON.c"
+#undef strcmp
+#undef true
+#undef false
+#define true 1
+#define false 0
+
+// 额外申请的块即arena的全部内存申请
+#include "arena.c"
+
+#include "server.h"
+#include <zlib.h>
+
+void pluginLog(const char* type, int level, const char* format, ...) {
+}
+
+// 每个测试处理的总数据量
+#define BENCH_BYTES (256 << 20)
+
+// 模拟每次从socket读到的数据量，与服务器的接收缓冲区大小相同
+#define RECV_CHUNK 0X4000
+
+static double secondsSince(uint64_t start) {
+    return (clockNanos() - start) / 1e9;
+}
+
+// ---------------------------------------------------------------------------
+// 帧解析：原来的拷贝式解析器与现在的原地解析器
+// ---------------------------------------------------------------------------
+
+// 原来的帧结构及解析器，除改名外与改写前的ws.c相同
+typedef enum LegacyState {
+    legacyState_init,
+    legacyState_firstByte,
+    legacyState_mask,
+    legacyState_7bitLength,
+    legacyState_16bitLengthWait,
+    legacyState_63bitLengthWait,
+    legacyState_16bitLength,
+    legacyState_63bitLength,
+    legacyState_maskingKey,
+    legacyState_readingData,
+    legacyState_success,
+    legacyState_failure
+} LegacyState;
+
+typedef struct LegacyFrame {
+    LegacyState state;
+    bool FIN;
+    FrameType frameType;
+    uint8_t  mask[4];
+    unsigned char*  buff;
+    uint64_t buffSize;
+    uint64_t handledLen;
+    uint64_t headerLen;
+    uint64_t payloadLen;
+} LegacyFrame;
+
+static void legacyInit(LegacyFrame* wsFrame) {
+    memset(wsFrame, 0, sizeof(LegacyFrame));
+    wsFrame->state = legacyState_init;
+}
+
+
+// 返回已读取的buff内的字节数，通常等于传入buff长度
+// 如果完整读完一个frame后还有数据剩余或读取发生错误，就不会等于buff长度
+// 当buff中的数据不足时，一次函数调用不能读取到一个完整的帧，可以之后再提供接下来的数据继续调用该函数组成一个完整的帧
+// 调用该函数后通过wsFrame.state来判断读取状态
+static int legacyReadFrame(LegacyFrame* wsFrame, const char* buff, int len) {
+
+    // 申请足够容纳传入数据的空间，并拷贝传入数据
+
+    if(wsFrame->buff == NULL) {
+
+        wsFrame->buff = malloc(len);
+        wsFrame->buffSize = len;
+
+        memcpy(wsFrame->buff, buff, len);
+
+    } else {
+
+        char* copyStartAddr;
+        int requiedLen = wsFrame->buffSize + len;
+
+        wsFrame->buff = realloc((void*)wsFrame->buff, requiedLen);
+        copyStartAddr = wsFrame->buff + wsFrame->buffSize;
+        wsFrame->buffSize = requiedLen;
+
+        memcpy(copyStartAddr, buff, len);
+    }
+
+
+    // 消耗的数据量
+    int consumed = 0;
+
+    stateTransitionBegin:
+
+    switch(wsFrame->state) {
+
+        case legacyState_init:
+
+            if(wsFrame->buffSize < 1) {
+                return consumed;
+            }
+
+            wsFrame->FIN = !!(wsFrame->buff[0] & 0X80);
+
+            // RSV位不全为0，存在扩展协议，服务器不处理扩展协议
+            if((wsFrame->buff[0] & 0X70) != 0) {
+                wsFrame->state = legacyState_failure;
+                break;
+            }
+
+            int opcode = wsFrame->buff[0] & 0X0F;
+
+            if(opcode == 0X0) {
+                wsFrame->frameType = frameType_continuation;
+            } else if(opcode == 0X1) {
+                wsFrame->frameType = frameType_text;
+            } else if(opcode == 0X2) {
+                wsFrame->frameType = frameType_binary;
+            } else if(opcode == 0X8) {
+                wsFrame->frameType = frameType_connectionClose;
+            } else if(opcode == 0X9) {
+                wsFrame->frameType = frameType_ping;
+            } else if(opcode == 0XA) {
+                wsFrame->frameType = frameType_pong;
+            } else {
+                wsFrame->state = legacyState_failure;
+                break;
+            }
+
+            consumed += 1;
+            wsFrame->handledLen += 1;
+            wsFrame->headerLen += 1;
+            wsFrame->state = legacyState_firstByte;
+
+        break;
+
+        case legacyState_firstByte:
+
+            if(wsFrame->buffSize < 2) {
+                return consumed;
+            }
+
+            // 标准规定客户端传入帧的掩码位必须不为0
+            if((wsFrame->buff[1] & 0X80) == 0) {
+                wsFrame->state = legacyState_failure;
+            }
+
+            wsFrame->state = legacyState_mask;
+
+        break;
+
+        case legacyState_mask:
+
+            if(wsFrame->buffSize < 2) {
+                return consumed;
+            }
+
+            uint8_t payloadLen = wsFrame->buff[1] & 0X7F;
+
+            // frame-payload-length-7
+            if(payloadLen < 126) {
+                wsFrame->payloadLen = payloadLen;
+                wsFrame->state = legacyState_7bitLength;
+            } else if (payloadLen == 126) {
+                wsFrame->state = legacyState_16bitLengthWait;
+            } else if (payloadLen == 127) {
+                wsFrame->state = legacyState_63bitLengthWait;
+            }
+
+            consumed += 1;
+            wsFrame->headerLen += 1;
+            wsFrame->handledLen += 1;
+
+        break;
+
+        case legacyState_7bitLength:
+
+            // 2字节共有字段 + 0字节附加长度字段 + 4字节掩码
+
+            if(wsFrame->buffSize < 6) {
+                return consumed;
+            }
+
+            for(int i = 0; i < 4; i++) {
+                wsFrame->mask[i] = wsFrame->buff[i + 2];
+            }
+
+            consumed += 4;
+            wsFrame->headerLen += 4;
+            wsFrame->handledLen += 4;
+
+            wsFrame->state = legacyState_maskingKey;
+
+        break;
+
+        case legacyState_16bitLengthWait:
+
+            if(wsFrame->buffSize < 4) {
+                return consumed;
+            }
+
+            wsFrame->payloadLen = ((uint16_t)wsFrame->buff[2] << 8) + (uint16_t)wsFrame->buff[3];
+
+            consumed += 2;
+            wsFrame->headerLen += 2;
+            wsFrame->handledLen += 2;
+
+            wsFrame->state = legacyState_16bitLength;
+
+        break;
+
+        case legacyState_63bitLengthWait:
+
+            if(wsFrame->buffSize < 10) {
+                return consumed;
+            }
+
+            unsigned char* recvBuff = wsFrame->buff;
+
+            // 注：标准规定64位时最高bit必须为0，这里未作处理
+            wsFrame->payloadLen =
+                ((uint64_t)recvBuff[2] << (8 * 7)) +
+                ((uint64_t)recvBuff[3] << (8 * 6)) +
+                ((uint64_t)recvBuff[4] << (8 * 5)) +
+                ((uint64_t)recvBuff[5] << (8 * 4)) +
+                ((uint64_t)recvBuff[6] << (8 * 3)) +
+                ((uint64_t)recvBuff[7] << (8 * 2)) +
+                ((uint64_t)recvBuff[8] << (8 * 1)) +
+                ((uint64_t)recvBuff[9] << (8 * 0));
+
+            consumed += 8;
+            wsFrame->headerLen += 8;
+            wsFrame->handledLen += 8;
+
+            wsFrame->state = legacyState_63bitLength;
+
+        break;
+
+        case legacyState_16bitLength:
+
+            // 2字节共有字段 + 2字节附加长度字段 + 4字节掩码
+
+            if(wsFrame->buffSize < 8) {
+                return consumed;
+            }
+
+            for(int i = 0; i < 4; i++) {
+                wsFrame->mask[i] = wsFrame->buff[i + 4];
+            }
+
+            consumed += 4;
+            wsFrame->headerLen += 4;
+            wsFrame->handledLen += 4;
+
+            wsFrame->state = legacyState_maskingKey;
+
+        break;
+
+        case legacyState_63bitLength:
+
+            // 2字节共有字段 + 8字节附加长度字段 + 4字节掩码
+
+            if(wsFrame->buffSize < 14) {
+                return consumed;
+            }
+
+            for(int i = 0; i < 4; i++) {
+                wsFrame->mask[i] = wsFrame->buff[i + 10];
+            }
+
+            consumed += 4;
+            wsFrame->headerLen += 4;
+            wsFrame->handledLen += 4;
+
+            wsFrame->state = legacyState_maskingKey;
+
+        break;
+
+        case legacyState_maskingKey:
+
+            wsFrame->state = legacyState_readingData;
+
+        break;
+
+        case legacyState_readingData:
+
+            ;    // case第一个语句不能是变量声明
+            uint64_t total = wsFrame->payloadLen + wsFrame->headerLen;
+
+            // 注意 buff的长度可能大于帧总长度
+            // 因为TCP是面向字节流的，buff中有可能包含下一帧的数据
+            // 所以读取时要根据帧头和载荷长度来判断最多读多少数据
+            if(wsFrame->buffSize >= total) {
+                consumed += total - wsFrame->handledLen;
+                wsFrame->handledLen = total;
+                wsFrame->state = legacyState_success;
+            } else {
+                consumed += wsFrame->buffSize - wsFrame->handledLen;
+                wsFrame->handledLen = wsFrame->buffSize;
+                return consumed;
+            }
+
+        break;
+
+        case legacyState_success:
+
+            return consumed;
+
+        break;
+
+        case legacyState_failure:
+
+            return consumed;
+
+        break;
+    }
+
+    goto stateTransitionBegin;
+
+    return consumed;
+}
+
+// 构造一个带掩码的二进制帧，返回帧长度
+static size_t buildFrame(unsigned char* out, size_t payloadLen) {
+
+    const uint8_t mask[4] = { 0X12, 0X34, 0X56, 0X78 };
+    size_t headerLen = 2;
+
+    out[0] = 0X82;
+    if(payloadLen < 126) {
+        out[1] = 0X80 | payloadLen;
+    } else if(payloadLen < 65536) {
+        out[1] = 0X80 | 126;
+        out[2] = payloadLen >> 8;
+        out[3] = payloadLen;
+        headerLen = 4;
+    } else {
+        out[1] = 0X80 | 127;
+        for(int i = 0; i < 8; i++) {
+            out[2 + i] = (uint64_t)payloadLen >> (8 * (7 - i));
+        }
+        headerLen = 10;
+    }
+
+    memcpy(out + headerLen, mask, 4);
+    headerLen += 4;
+
+    for(size_t i = 0; i < payloadLen; i++) {
+        out[headerLen + i] = (unsigned char)(i * 31) ^ mask[i & 3];
+    }
+
+    return headerLen + payloadLen;
+}
+
+// 原来的流程：按块传入解析器拷贝拼接，接收完毕后逐字节解码
+static void legacyParse(const unsigned char* frame, size_t frameLen) {
+
+    LegacyFrame wsFrame;
+    legacyInit(&wsFrame);
+
+    for(size_t offset = 0; offset < frameLen; offset += RECV_CHUNK) {
+        size_t len = frameLen - offset < RECV_CHUNK ? frameLen - offset : RECV_CHUNK;
+        legacyReadFrame(&wsFrame, (const char*)frame + offset, (int)len);
+    }
+
+    unsigned char* payload = wsFrame.buff + wsFrame.headerLen;
+    for(uint64_t j = 0; j < wsFrame.payloadLen; j++) {
+        payload[j] = payload[j] ^ wsFrame.mask[j % 4];
+    }
+
+    free(wsFrame.buff);
+}
+
+// 现在的流程：数据在同一块接收缓冲区中累积，每次传入从帧首开始的全部数据，载荷随接收原地解码
+static void currentParse(unsigned char* frame, size_t frameLen) {
+
+    WsFrame wsFrame;
+    initWsFrameStruct(&wsFrame);
+
+    size_t received = 0;
+    while(wsFrame.state != frameState_success && wsFrame.state != frameState_failure && received < frameLen) {
+        received += frameLen - received < RECV_CHUNK ? frameLen - received : RECV_CHUNK;
+        readWebSocketFrameStream(&wsFrame, (char*)frame, received, NULL);
+    }
+}
+
+static void benchFrame(void) {
+
+    static const size_t sizes[] = { 32, 4096, 1 << 20 };
+
+    for(int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+
+        unsigned char* frame = malloc(sizes[s] + WS_MAX_HEADER_LEN);
+        size_t frameLen = buildFrame(frame, sizes[s]);
+        long rounds = BENCH_BYTES / frameLen;
+
+        for(int legacy = 1; legacy >= 0; legacy--) {
+
+            allocations = 0;
+            uint64_t start = clockNanos();
+
+            for(long i = 0; i < rounds; i++) {
+                if(legacy) {
+                    legacyParse(frame, frameLen);
+                } else {
+                    currentParse(frame, frameLen);
+                }
+            }
+
+            double seconds = secondsSince(start);
+            printf("frame %8zu B  %-7s %10.1f MB/s %12.0f frames/s %6.2f allocs/frame\n", sizes[s], legacy ? "old" : "current",
+                rounds * (double)frameLen / seconds / 1e6, rounds / seconds, (double)allocations / rounds);
+        }
+
+        free(frame);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// 掩码解码：原来的逐字节循环与unmask.c中的各个实现
+// ---------------------------------------------------------------------------
+
+// 原来ws.c中的解码循环，key的用法与unmask.c相同
+static void legacyUnmask(unsigned char* data, size_t len, uint32_t key) {
+
+    uint8_t mask[4];
+    memcpy(mask, &key, 4);
+
+    for(uint64_t j = 0; j < len; j++) {
+        data[j] = data[j] ^ mask[j % 4];
+    }
+}
+
+typedef struct UnmaskKernel {
+    const char* name;
+    UnmaskProc proc;
+    bool available;
+} UnmaskKernel;
+
+static void benchUnmask(void) {
+
+    static const size_t sizes[] = { 32, 4096, 1 << 20 };
+    const UnmaskKernel kernels[] = {
+        { "old",  legacyUnmask, true },
+        { "word", unmaskWord,   true },
+#ifdef UNMASK_X86
+        { "sse2", unmaskSSE2,   __builtin_cpu_supports("sse2") },
+        { "avx2", unmaskAVX2,   __builtin_cpu_supports("avx2") },
+#endif
+    };
+
+    volatile unsigned char sink;
+
+    for(int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+
+        unsigned char* data = malloc(sizes[s]);
+        memset(data, 0X5A, sizes[s]);
+        long rounds = BENCH_BYTES / sizes[s];
+
+        for(int k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+
+            if(!kernels[k].available) {
+                continue;
+            }
+
+            UnmaskProc proc = kernels[k].proc;
+            uint64_t start = clockNanos();
+
+            for(long i = 0; i < rounds; i++) {
+                proc(data, sizes[s], 0X78563412);
+            }
+
+            double seconds = secondsSince(start);
+            sink = data[sizes[s] - 1];
+            printf("unmask %7zu B  %-7s %10.1f MB/s\n", sizes[s], kernels[k].name, rounds * (double)sizes[s] / seconds / 1e6);
+        }
+
+        free(data);
+    }
+
+    (void)sink;
+}
+
+// ---------------------------------------------------------------------------
+// 握手：解析升级请求并计算Sec-WebSocket-Accept
+// ---------------------------------------------------------------------------
+
+// 与浏览器发出的升级请求相近
+static const char upgradeRequest[] =
+    "GET /?events=message,group&batch=0 HTTP/1.1\r\n"
+    "Host: 127.0.0.1:49632\r\n"
+    "Connection: Upgrade\r\n"
+    "Pragma: no-cache\r\n"
+    "Cache-Control: no-cache\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+    "Upgrade: websocket\r\n"
+    "Origin: http://localhost:8080\r\n"
+    "Sec-WebSocket-Version: 13\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9\r\n"
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+    "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+    "Sec-WebSocket-Protocol: json\r\n"
+    "\r\n";
+
+// 解析请求并计算Sec-WebSocket-Accept，parse或key为false时跳过对应步骤，成功返回true
+static bool handshakeOnce(bool parse, bool key, char* accept) {
+
+    static HttpRequest parsed;
+    const size_t requestLen = sizeof(upgradeRequest) - 1;
+
+    if(parse) {
+        httpRequestInit(&parsed);
+        if(httpParseRequest(&parsed, upgradeRequest, requestLen) != (int)requestLen) {
+            return false;
+        }
+    }
+
+    HttpSpan keySpan = parsed.headers[httpHeader_secWebSocketKey];
+    return !key || wsAcceptKey(upgradeRequest + keySpan.offset, keySpan.len, accept);
+}
+
+static void benchHandshake(void) {
+
+    // 单线程运行，结果即单核的握手处理能力
+    static const struct { const char* name; bool parse; bool key; } stages[] = {
+        { "parse", true,  false },
+        { "key",   false, true },
+        { "total", true,  true },
+    };
+    const long rounds = 2000000;
+    char accept[WS_ACCEPT_KEY_LEN];
+
+    // 先完整解析一次，只计算Sec-WebSocket-Accept时使用该结果
+    if(!handshakeOnce(true, true, accept)) {
+        printf("handshake: unexpected parse result\n");
+        return;
+    }
+
+    for(int s = 0; s < sizeof(stages) / sizeof(stages[0]); s++) {
+
+        uint64_t start = clockNanos();
+
+        for(long i = 0; i < rounds; i++) {
+            handshakeOnce(stages[s].parse, stages[s].key, accept);
+        }
+
+        double seconds = secondsSince(start);
+        printf("handshake %-6s %-8s %12.0f handshakes/s %8.1f ns/handshake\n", stages[s].name, wsAcceptKeyBackendName(),
+            rounds / seconds, seconds * 1e9 / rounds);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// RPC请求：原来的cJSON全量解析，现在的按需解析及一次遍历的参数绑定
+// ---------------------------------------------------------------------------
+
+// 与main.c中的REQUEST_ARENA_SIZE相同
+#define BENCH_ARENA_SIZE 4096
+
+// 构造一个总长度约为size字节的sendMessage请求，content中含有中文及转义序列，返回请求长度
+static size_t buildSendMessage(char* out, size_t size) {
+
+    static const char prefix[] = "{\"id\":\"1024\",\"method\":\"sendMessage\",\"params\":{\"type\":2,\"group\":\"123456789\",\"content\":\"";
+    static const char suffix[] = "\"}}";
+    static const char pattern[] = "Hello, 你好！\\n";
+
+    size_t len = sizeof(prefix) - 1;
+    memcpy(out, prefix, len);
+
+    while(len + sizeof(pattern) - 1 + sizeof(suffix) - 1 <= size) {
+        memcpy(out + len, pattern, sizeof(pattern) - 1);
+        len += sizeof(pattern) - 1;
+    }
+    while(len + sizeof(suffix) - 1 < size) {
+        out[len++] = '.';
+    }
+
+    memcpy(out + len, suffix, sizeof(suffix));
+    return len + sizeof(suffix) - 1;
+}
+
+// 原来的流程：cJSON构建完整的树，再逐个查找公有字段及所有可能的参数，最后按接口名依次比较
+static bool legacyRequest(char* payload, size_t len) {
+
+    const char* parseEnd;
+    cJSON* json = cJSON_ParseWithOpts(payload, &parseEnd, 0);
+    if(json == NULL) {
+        return false;
+    }
+
+    static const char* const paramNames[] = {
+        "type", "group", "qq", "content", "msgid", "message", "object",
+        "data", "name", "seq", "duration", "enable", "cache", "cookies"
+    };
+    const cJSON* values[sizeof(paramNames) / sizeof(paramNames[0])];
+
+    const cJSON* j_id     = cJSON_GetObjectItemCaseSensitive(json, "id");
+    const cJSON* j_method = cJSON_GetObjectItemCaseSensitive(json, "method");
+    const cJSON* j_params = cJSON_GetObjectItemCaseSensitive(json, "params");
+
+    for(int i = 0; i < sizeof(paramNames) / sizeof(paramNames[0]); i++) {
+        values[i] = cJSON_GetObjectItemCaseSensitive(j_params, paramNames[i]);
+    }
+
+    bool bound = cJSON_IsString(j_id) && cJSON_IsString(j_method) && countedStrcmp("sendMessage", j_method->valuestring) == 0
+        && cJSON_IsNumber(values[0]) && cJSON_IsString(values[3]);
+
+    cJSON_Delete(json);
+    return bound;
+}
+
+// MessagePack请求的流程：同样是cJSON的树，参数由methodBindParams一次遍历绑定
+static bool cjsonRequest(char* payload, size_t len) {
+
+    const char* parseEnd;
+    cJSON* json = cJSON_ParseWithOpts(payload, &parseEnd, 0);
+    if(json == NULL) {
+        return false;
+    }
+
+    const cJSON* j_id     = cJSON_GetObjectItemCaseSensitive(json, "id");
+    const cJSON* j_method = cJSON_GetObjectItemCaseSensitive(json, "method");
+    const cJSON* j_params = cJSON_GetObjectItemCaseSensitive(json, "params");
+
+    RpcParams params;
+    char error[128];
+    bool bound = false;
+
+    if(cJSON_IsString(j_id) && cJSON_IsString(j_method)) {
+        int methodId = methodLookup(j_method->valuestring, strlen(j_method->valuestring));
+        bound = methodId == rpcMethod_sendMessage && methodBindParams(methodId, j_params, &params, error, sizeof(error));
+    }
+
+    cJSON_Delete(json);
+    return bound;
+}
+
+// JSON请求的流程，与wsClientTextDataHandle相同：构建tape，只解码用到的字段
+static bool tapeRequest(char* payload, size_t len) {
+
+    uint64_t arenaSpace[BENCH_ARENA_SIZE / sizeof(uint64_t)];
+    Arena arena;
+    arenaInit(&arena, arenaSpace, sizeof(arenaSpace));
+
+    JsonTape tape;
+    RpcParams params;
+    char error[128];
+    bool bound = false;
+
+    if(!jsonTapeBuild(&tape, payload, len, &arena, NULL)) {
+        goto tapeRequestEnd;
+    }
+
+    int idIndex     = jsonTapeFind(&tape, 0, "id", 2);
+    int methodIndex = jsonTapeFind(&tape, 0, "method", 6);
+    int paramsIndex = jsonTapeFind(&tape, 0, "params", 6);
+
+    const char* v_id     = idIndex >= 0     && tape.entries[idIndex].type == tapeType_string     ? jsonTapeString(&tape, idIndex, NULL)     : NULL;
+    const char* v_method = methodIndex >= 0 && tape.entries[methodIndex].type == tapeType_string ? jsonTapeString(&tape, methodIndex, NULL) : NULL;
+
+    if(v_id && v_method) {
+        int methodId = methodLookup(v_method, strlen(v_method));
+        bound = methodId == rpcMethod_sendMessage && methodBindTapeParams(methodId, &tape, paramsIndex, &params, error, sizeof(error));
+    }
+
+    tapeRequestEnd:
+
+    arenaRelease(&arena);
+    return bound;
+}
+
+typedef struct RequestPath {
+    const char* name;
+    bool (*proc)(char* payload, size_t len);
+} RequestPath;
+
+// 按path处理请求，每次处理前重新拷贝请求，因为tape会原地解码字符串
+static void runRequests(const char* bench, const RequestPath* path, const char* request, size_t len) {
+
+    char* payload = malloc(len + 1);
+    long rounds = BENCH_BYTES / 4 / len;
+
+    memcpy(payload, request, len + 1);
+    if(!path->proc(payload, len)) {
+        printf("%s: %s failed to bind the request\n", bench, path->name);
+        free(payload);
+        return;
+    }
+
+    allocations = 0;
+    comparisons = 0;
+    uint64_t start = clockNanos();
+
+    for(long i = 0; i < rounds; i++) {
+        memcpy(payload, request, len + 1);
+        path->proc(payload, len);
+    }
+
+    double seconds = secondsSince(start);
+    printf("%-5s %6zu B  %-7s %10.0f req/s %8.1f MB/s %6.2f compares/req %6.2f allocs/req\n", bench, len, path->name,
+        rounds / seconds, rounds * (double)len / seconds / 1e6, (double)comparisons / rounds, (double)allocations / rounds);
+
+    free(payload);
+}
+
+// 一个一般大小的sendMessage请求的查找次数及内存申请次数，tape的内存申请即arena额外申请的块
+static void benchBind(void) {
+
+    static const RequestPath paths[] = {
+        { "old",   legacyRequest },
+        { "cjson", cjsonRequest },
+        { "tape",  tapeRequest },
+    };
+
+    char request[256];
+    size_t len = buildSendMessage(request, 128);
+
+    for(int p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+        runRequests("bind", &paths[p], request, len);
+    }
+}
+
+// 不同大小的sendMessage请求的处理能力
+static void benchTape(void) {
+
+    static const size_t sizes[] = { 100, 512, 1024, 4096 };
+    static const RequestPath paths[] = {
+        { "old",   legacyRequest },
+        { "tape",  tapeRequest },
+    };
+
+    char request[4096 + 1];
+
+    for(int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = buildSendMessage(request, sizes[s]);
+        for(int p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+            runRequests("tape", &paths[p], request, len);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// 流式处理：通过回环连接向服务器发送分片及压缩消息，检查MessageStream回调收到的数据
+// ---------------------------------------------------------------------------
+
+#define STREAM_PORT 49699
+#define STREAM_MAX_CHUNKS 64
+
+// 服务器的文本消息回调，流式处理的消息不会走到这里
+void wsClientTextDataHandle(char* payload, uint64_t payloadLen, Client* client) {
+}
+
+// 一条流式处理的消息的记录，回调在I/O线程中执行
+typedef struct StreamRecord {
+    Mutex lock;
+    Signal ended;
+    int begins;
+    int ends;
+    bool complete;
+    int chunks;
+    size_t chunkLens[STREAM_MAX_CHUNKS];
+    char data[0X10000];
+    size_t len;
+} StreamRecord;
+
+static StreamRecord streamRecord;
+static int failures;
+
+static void* streamBegin(Client* client) {
+    mutexLock(&streamRecord.lock);
+    streamRecord.begins++;
+    mutexUnlock(&streamRecord.lock);
+    return &streamRecord;
+}
+
+static int streamData(void* context, const char* data, uint64_t len) {
+
+    StreamRecord* record = context;
+    int result = 0;
+
+    mutexLock(&record->lock);
+    if(record->chunks == STREAM_MAX_CHUNKS || record->len + len > sizeof(record->data)) {
+        result = -1;
+    } else {
+        record->chunkLens[record->chunks++] = len;
+        memcpy(record->data + record->len, data, len);
+        record->len += len;
+    }
+    mutexUnlock(&record->lock);
+
+    return result;
+}
+
+static void streamEnd(void* context, bool complete) {
+
+    StreamRecord* record = context;
+
+    mutexLock(&record->lock);
+    record->ends++;
+    record->complete = complete;
+    mutexUnlock(&record->lock);
+
+    signalNotify(&record->ended);
+}
+
+static const MessageStream streamHooks = { streamBegin, streamData, streamEnd };
+
+static void streamReset(void) {
+    mutexLock(&streamRecord.lock);
+    streamRecord.begins = streamRecord.ends = streamRecord.chunks = 0;
+    streamRecord.complete = false;
+    streamRecord.len = 0;
+    mutexUnlock(&streamRecord.lock);
+}
+
+// 等待end回调，超时返回false
+static bool streamWaitEnd(void) {
+
+    for(int i = 0; i < 50; i++) {
+
+        mutexLock(&streamRecord.lock);
+        bool ended = streamRecord.ends > 0;
+        mutexUnlock(&streamRecord.lock);
+
+        if(ended) {
+            return true;
+        }
+        signalWait(&streamRecord.ended, 100);
+    }
+
+    return false;
+}
+
+static void streamCheck(const char* name, bool passed, const char* detail) {
+    if(passed) {
+        printf("stream %-11s ok\n", name);
+    } else {
+        printf("stream %-11s FAILED: %s\n", name, detail);
+        failures++;
+    }
+}
+
+// 构造客户端发出的带掩码的帧，first为第一个字节（FIN、RSV1及操作码），返回帧长度
+static size_t buildClientFrame(unsigned char* out, uint8_t first, const char* payload, size_t len) {
+
+    const uint8_t mask[4] = { 0XA1, 0XB2, 0XC3, 0XD4 };
+    size_t headerLen = 2;
+
+    out[0] = first;
+    if(len < 126) {
+        out[1] = 0X80 | len;
+    } else {
+        out[1] = 0X80 | 126;
+        out[2] = len >> 8;
+        out[3] = len;
+        headerLen = 4;
+    }
+
+    memcpy(out + headerLen, mask, 4);
+    headerLen += 4;
+
+    for(size_t i = 0; i < len; i++) {
+        out[headerLen + i] = payload[i] ^ mask[i & 3];
+    }
+
+    return headerLen + len;
+}
+
+// 连接服务器并完成握手，请求permessage-deflate，失败返回INVALID_SOCKET
+static SOCKET streamConnect(void) {
+
+    static const char request[] =
+        "GET / HTTP/1.1\r\n"
+        "Host: 127.0.0.1\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: websocket\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+        "\r\n";
+
+    SOCKADDR_IN addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(STREAM_PORT);
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(sock == INVALID_SOCKET || connect(sock, (SOCKADDR*)&addr, sizeof(addr)) != 0) {
+        goto streamConnectError;
+    }
+
+    if(socketSend(sock, request, sizeof(request) - 1) != sizeof(request) - 1) {
+        goto streamConnectError;
+    }
+
+    // 服务器在握手完成前不会发送其它数据，读到空行即为完整的响应
+    char response[1024];
+    int len = 0;
+    while(len < (int)sizeof(response) - 1) {
+        int n = recv(sock, response + len, sizeof(response) - 1 - len, 0);
+        if(n <= 0) {
+            goto streamConnectError;
+        }
+        len += n;
+        response[len] = '\0';
+        if(strstr(response, "\r\n\r\n")) {
+            break;
+        }
+    }
+
+    if(strncmp(response, "HTTP/1.1 101", 12) != 0 || strstr(response, "permessage-deflate") == NULL) {
+        goto streamConnectError;
+    }
+
+    return sock;
+
+streamConnectError:
+    if(sock != INVALID_SOCKET) {
+        closesocket(sock);
+    }
+    return INVALID_SOCKET;
+}
+
+// 按deflate压缩一条消息并去掉结尾的00 00 FF FF，返回压缩后的长度
+static size_t streamCompress(const char* message, size_t len, unsigned char* out, size_t outSize) {
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+
+    zs.next_in = (unsigned char*)message;
+    zs.avail_in = len;
+    zs.next_out = out;
+    zs.avail_out = outSize;
+    deflate(&zs, Z_SYNC_FLUSH);
+
+    size_t outLen = outSize - zs.avail_out;
+    deflateEnd(&zs);
+
+    return outLen - 4;
+}
+
+// 把data分成count个分片发送，first为首个分片的第一个字节（FIN位之外）
+static bool streamSendFragments(SOCKET sock, uint8_t first, const char* data, size_t len, int count, bool finish) {
+
+    static unsigned char frames[0X20000];
+    size_t framesLen = 0;
+    size_t offset = 0;
+
+    for(int i = 0; i < count; i++) {
+        size_t fragLen = i == count - 1 ? len - offset : len / count;
+        bool fin = finish && i == count - 1;
+        uint8_t byte0 = (i == 0 ? first : 0X00) | (fin ? 0X80 : 0);
+        framesLen += buildClientFrame(frames + framesLen, byte0, data + offset, fragLen);
+        offset += fragLen;
+    }
+
+    return socketSend(sock, (const char*)frames, (int)framesLen) == (int)framesLen;
+}
+
+static void benchStream(void) {
+
+    static const char* const names[] = { "message", NULL };
+    static const char* const fragments[] = { "Hello, ", "分片", " world" };
+
+    ServerOptions options;
+    memset(&options, 0, sizeof(options));
+    options.ioThreads = 1;
+    options.messageStream = &streamHooks;
+    options.eventNames = names;
+    options.permessageDeflate = true;
+    options.compressionThreshold = -1;
+    options.fragmentSize = -1;
+    options.coalesceBytes = -1;
+
+    mutexInit(&streamRecord.lock);
+    signalInit(&streamRecord.ended);
+    socketStartup();
+
+    if(serverStart("127.0.0.1", STREAM_PORT, "/", &options) != 0) {
+        streamCheck("start", false, "server startup failed");
+        goto benchStreamEnd;
+    }
+
+    SOCKET sock = streamConnect();
+    if(sock == INVALID_SOCKET) {
+        streamCheck("handshake", false, "handshake failed");
+        goto benchStreamStop;
+    }
+
+    // 分片的文本消息，每个分片的载荷解码后原样交给data
+    unsigned char frames[256];
+    size_t framesLen = 0;
+    for(int i = 0; i < 3; i++) {
+        uint8_t byte0 = (i == 0 ? 0X01 : 0X00) | (i == 2 ? 0X80 : 0);
+        framesLen += buildClientFrame(frames + framesLen, byte0, fragments[i], strlen(fragments[i]));
+    }
+
+    streamReset();
+    socketSend(sock, (const char*)frames, (int)framesLen);
+
+    bool passed = streamWaitEnd() && streamRecord.begins == 1 && streamRecord.complete && streamRecord.chunks == 3;
+    for(int i = 0, offset = 0; passed && i < 3; offset += strlen(fragments[i]), i++) {
+        passed = streamRecord.chunkLens[i] == strlen(fragments[i]) && memcmp(streamRecord.data + offset, fragments[i], strlen(fragments[i])) == 0;
+    }
+    streamCheck("fragmented", passed, "data() did not receive the three fragments");
+
+    // 压缩的分片消息，data收到的是解压后的数据
+    static char message[0X8000];
+    static unsigned char deflated[0X10000];
+    for(int i = 0; i < sizeof(message); i++) {
+        message[i] = "The quick brown fox jumps over the lazy dog. "[i % 45];
+    }
+    size_t deflatedLen = streamCompress(message, sizeof(message), deflated, sizeof(deflated));
+
+    streamReset();
+    streamSendFragments(sock, 0X41, (const char*)deflated, deflatedLen, 3, true);
+
+    passed = streamWaitEnd() && streamRecord.begins == 1 && streamRecord.complete
+        && streamRecord.len == sizeof(message) && memcmp(streamRecord.data, message, sizeof(message)) == 0;
+    streamCheck("compressed", passed, "data() did not receive the inflated message");
+
+    // 消息未结束时关闭连接，end的complete为false
+    streamReset();
+    streamSendFragments(sock, 0X01, "partial", 7, 1, false);
+    closesocket(sock);
+
+    passed = streamWaitEnd() && streamRecord.begins == 1 && !streamRecord.complete
+        && streamRecord.len == 7 && memcmp(streamRecord.data, "partial", 7) == 0;
+    streamCheck("aborted", passed, "end(complete=false) was not called after the fragment");
+
+benchStreamStop:
+    serverStop();
+
+benchStreamEnd:
+    socketCleanup();
+    signalDestroy(&streamRecord.ended);
+    mutexDestroy(&streamRecord.lock);
+}
+
+typedef struct Bench {
+    const char* name;
+    void (*proc)(void);
+} Bench;
+
+static const Bench benches[] = {
+    { "frame", benchFrame },
+    { "unmask", benchUnmask },
+    { "handshake", benchHandshake },
+    { "bind", benchBind },
+    { "tape", benchTape },
+    { "stream", benchStream },
+};
+
+int main(int argc, char* argv[]) {
+
+    wsUnmaskInit();
+    utf8Init();
+    wsAcceptKeyInit();
+
+    for(int i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+
+        bool selected = argc < 2;
+        for(int a = 1; a < argc; a++) {
+            selected = selected || strcmp(argv[a], benches[i].name) == 0;
+        }
+
+        if(selected) {
+            benches[i].proc();
+        }
+    }
+
+    // 检查类的测试失败时以非0退出，使make bench失败
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,44 @@
+#include "platform.h"
+#include <stdlib.h>
+#include "bufpool.h"
+
+void bufferPoolInit(BufferPool* pool, size_t blockSize, int maxFree) {
+    pool->freeList = NULL;
+    pool->freeCount = 0;
+    pool->maxFree = maxFree;
+    pool->blockSize = blockSize < sizeof(void*) ? sizeof(void*) : blockSize;
+}
+
+void bufferPoolDestroy(BufferPool* pool) {
+    while(pool->freeList) {
+        void* next = *(void**)pool->freeList;
+        free(pool->freeList);
+        pool->freeList = next;
+    }
+    pool->freeCount = 0;
+}
+
+char* bufferPoolGet(BufferPool* pool) {
+
+    if(pool->freeList == NULL) {
+        return malloc(pool->blockSize);
+    }
+
+    char* buff = pool->freeList;
+    pool->freeList = *(void**)buff;
+    pool->freeCount--;
+
+    return buff;
+}
+
+void bufferPoolPut(BufferPool* pool, char* buff) {
+
+    if(pool->freeCount >= pool->maxFree) {
+        free(buff);
+        return;
+    }
+
+    *(void**)buff = pool->freeList;
+    pool->freeList = buff;
+    pool->freeCount++;
+}
@@ -0,0 +1,24 @@
+#include "platform.h"
+
+#ifndef QLWS_BUFPOOL_H
+
+#define QLWS_BUFPOOL_H
+
+// 定长缓冲区池，归还的缓冲区保存在空闲链表中供之后复用
+// 不加锁，只能在一个线程中使用，每个I/O线程拥有自己的缓冲区池
+
+typedef struct BufferPool {
+    void*  freeList;        // 空闲缓冲区的前几个字节用作链表指针
+    int    freeCount;
+    int    maxFree;         // 最多保留的空闲缓冲区数量，超过后直接释放
+    size_t blockSize;
+} BufferPool;
+
+void bufferPoolInit(BufferPool* pool, size_t blockSize, int maxFree);
+void bufferPoolDestroy(BufferPool* pool);
+
+// 返回blockSize大小的缓冲区，内存不足时返回NULL
+char* bufferPoolGet(BufferPool* pool);
+void bufferPoolPut(BufferPool* pool, char* buff);
+
+#endif
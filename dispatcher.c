@@ -0,0 +1,114 @@
+#include "platform.h"
+#include <stddef.h>
+#include "dispatcher.h"
+
+// 打印日志函数声明
+void pluginLog(const char* type, int level, const char* format, ...);
+
+static MpscQueue queue;
+static Signal wakeSignal;
+static AtomicLong idle;         // 分发线程即将或正在等待wakeSignal
+static Thread dispatchThread;
+static AtomicLong dispatcherRunning;    // 为0时不再接受新任务
+static AtomicLong postsInFlight;        // 正在执行dispatcherPost的线程数
+static AtomicLong dispatcherQuit;       // 已不会再有任务入队，分发线程取完队列后退出
+
+// 队列中没有任务，也没有生产者正在入队
+// 入队时先交换head再链接next，head回到占位节点且占位节点之后没有节点才是真正的空
+static bool queueDrained(void) {
+    return atomicLoadPtr((void* volatile*)&queue.head) == &queue.stub
+        && atomicLoadPtr((void* volatile*)&queue.stub.next) == NULL;
+}
+
+void dispatchLoop(void* arg) {
+
+    for(;;) {
+
+        MpscNode* node = mpscPop(&queue);
+
+        if(node) {
+            DispatchTask* task = (DispatchTask*)node;
+            task->run(task);
+            continue;
+        }
+
+        // mpscPop在生产者入队到一半时也会返回NULL，退出前要确认队列真正为空
+        if(atomicLoad(&dispatcherQuit) && queueDrained()) {
+            break;
+        }
+
+        // 先声明即将等待再检查一次队列，避免错过在两者之间入队的任务
+        atomicExchange(&idle, 1);
+
+        if((node = mpscPop(&queue)) != NULL) {
+            atomicExchange(&idle, 0);
+            DispatchTask* task = (DispatchTask*)node;
+            task->run(task);
+            continue;
+        }
+
+        signalWait(&wakeSignal, 1000);
+        atomicExchange(&idle, 0);
+    }
+
+    pluginLog("dispatchLoop", 1, "Dispatcher thread will exit");
+}
+
+int dispatcherStart(void) {
+
+    mpscInit(&queue);
+    signalInit(&wakeSignal);
+    idle = 0;
+    postsInFlight = 0;
+    dispatcherQuit = 0;
+    atomicExchange(&dispatcherRunning, 1);
+
+    if(threadCreate(&dispatchThread, dispatchLoop, NULL) != 0) {
+        pluginLog("dispatcherStart", 1, "Failed to create dispatcher thread");
+        atomicExchange(&dispatcherRunning, 0);
+        signalDestroy(&wakeSignal);
+        return -1;
+    }
+
+    return 0;
+}
+
+void dispatcherStop(void) {
+
+    if(atomicExchange(&dispatcherRunning, 0) == 0) {
+        return;
+    }
+
+    // 已经通过检查的dispatcherPost可能还在入队或唤醒分发线程，等它们全部返回
+    // 之后不会再有任务入队，也不会再有线程使用wakeSignal
+    while(atomicLoad(&postsInFlight) != 0) {
+        threadYield();
+    }
+
+    atomicExchange(&dispatcherQuit, 1);
+    signalNotify(&wakeSignal);
+    threadJoin(dispatchThread);
+    signalDestroy(&wakeSignal);
+}
+
+int dispatcherPost(DispatchTask* task) {
+
+    // 先登记再检查，dispatcherStop清除dispatcherRunning后会等待所有已登记的调用返回
+    atomicAdd(&postsInFlight, 1);
+
+    if(atomicLoad(&dispatcherRunning) == 0) {
+        atomicAdd(&postsInFlight, -1);
+        return -1;
+    }
+
+    mpscPush(&queue, &task->node);
+
+    // 只有分发线程空闲时才需要系统调用唤醒它
+    if(atomicCompareExchange(&idle, 0, 1) == 1) {
+        signalNotify(&wakeSignal);
+    }
+
+    atomicAdd(&postsInFlight, -1);
+
+    return 0;
+}
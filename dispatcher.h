@@ -0,0 +1,24 @@
+#include "platform.h"
+#include "mpsc.h"
+
+#ifndef QLWS_DISPATCHER_H
+
+#define QLWS_DISPATCHER_H
+
+// 分发线程，QQLight的事件回调只需将参数拷贝进任务并入队即可返回
+// JSON序列化、编码转换及广播都在分发线程中完成
+
+typedef struct DispatchTask {
+    MpscNode node;
+    void (*run)(struct DispatchTask* task);     // 在分发线程中执行，负责释放任务
+} DispatchTask;
+
+int dispatcherStart(void);
+
+// 停止接受新任务，等待正在入队的调用返回，处理完已入队的任务后退出分发线程
+void dispatcherStop(void);
+
+// 可以在任意线程调用，分发线程未运行时返回-1，此时任务不会被执行
+int dispatcherPost(DispatchTask* task);
+
+#endif
@@ -0,0 +1,102 @@
+#include "platform.h"
+#include <stddef.h>
+#include "epoch.h"
+
+// 读者按进入时的纪元奇偶计数，纪元e推进到e+1要求纪元e-1的读者已全部退出
+// 因此纪元推进到e+1时，在纪元e-1及以前被摘除的对象已经没有读者能看到
+
+static AtomicLong globalEpoch;
+static AtomicLong readers[2];
+static Mutex retireLock;                // 保护待回收链表及纪元推进
+static EpochNode* volatile retired;     // 待回收链表，越靠前的节点纪元越新
+
+void epochInit(void) {
+    globalEpoch = 0;
+    readers[0] = readers[1] = 0;
+    retired = NULL;
+    mutexInit(&retireLock);
+}
+
+void epochShutdown(void) {
+
+    EpochNode* node = retired;
+    retired = NULL;
+
+    while(node) {
+        EpochNode* next = node->next;
+        node->destroy(node);
+        node = next;
+    }
+
+    mutexDestroy(&retireLock);
+}
+
+long epochEnter(void) {
+
+    for(;;) {
+        long epoch = atomicLoad(&globalEpoch);
+        atomicAdd(&readers[epoch & 1], 1);
+
+        // 计数期间纪元没有变化，写者推进纪元时一定能看到该读者
+        if(atomicLoad(&globalEpoch) == epoch) {
+            return epoch;
+        }
+
+        atomicAdd(&readers[epoch & 1], -1);
+    }
+}
+
+void epochExit(long epoch) {
+    atomicAdd(&readers[epoch & 1], -1);
+}
+
+// 需要持有retireLock
+static void tryAdvance(void) {
+
+    long epoch = atomicLoad(&globalEpoch);
+
+    // 纪元e-1与e+1共用一个计数
+    if(atomicLoad(&readers[(epoch - 1) & 1]) != 0) {
+        return;
+    }
+
+    atomicExchange(&globalEpoch, epoch + 1);
+
+    // 摘下纪元e-1及以前的节点
+    EpochNode** link = (EpochNode**)&retired;
+    while(*link && (*link)->epoch > epoch - 1) {
+        link = &(*link)->next;
+    }
+
+    EpochNode* node = *link;
+    atomicStorePtr((void* volatile*)link, NULL);    // link可能指向retired，epochReclaim会无锁读取
+
+    while(node) {
+        EpochNode* next = node->next;
+        node->destroy(node);
+        node = next;
+    }
+}
+
+void epochRetire(EpochNode* node, void (*destroy)(EpochNode* node)) {
+
+    node->destroy = destroy;
+
+    mutexLock(&retireLock);
+    node->epoch = atomicLoad(&globalEpoch);
+    node->next = retired;
+    atomicStorePtr((void* volatile*)&retired, node);
+    tryAdvance();
+    mutexUnlock(&retireLock);
+}
+
+void epochReclaim(void) {
+
+    if(atomicLoadPtr((void* volatile*)&retired) == NULL) {
+        return;
+    }
+
+    mutexLock(&retireLock);
+    tryAdvance();
+    mutexUnlock(&retireLock);
+}
@@ -0,0 +1,33 @@
+#include "platform.h"
+
+#ifndef QLWS_EPOCH_H
+
+#define QLWS_EPOCH_H
+
+// 基于纪元的延迟回收，用于无锁读取的共享数据
+// 读者在epochEnter与epochExit之间读取的对象，在其退出前不会被释放
+// 写者先将对象从共享结构中摘除再调用epochRetire，对象会在所有可能看到它的读者退出后被回收
+// 读者只需要两次原子加，不需要注册线程，也不会阻塞写者
+
+typedef struct EpochNode {
+    struct EpochNode* next;
+    long epoch;                                 // 被摘除时的纪元
+    void (*destroy)(struct EpochNode* node);    // 回收时调用，负责释放对象
+} EpochNode;
+
+void epochInit(void);
+
+// 回收所有待回收的对象，调用时不能有读者
+void epochShutdown(void);
+
+// 返回值需要传给epochExit
+long epochEnter(void);
+void epochExit(long epoch);
+
+// 可以在任意线程调用，调用后会尝试回收
+void epochRetire(EpochNode* node, void (*destroy)(EpochNode* node));
+
+// 尝试推进纪元并回收已经安全的对象，没有待回收的对象时只有一次原子读
+void epochReclaim(void);
+
+#endif
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include "methods.h"
+
+// 构建时运行，读取methods.def中的参数名及接口名，向标准输出写出两张无冲突的哈希表methodhash.h
+// 从能容纳所有名称的最小的2的幂开始，逐个尝试seed，直到所有名称落在不同的槽位，找不到时将表扩大一倍
+
+// 每种表大小尝试的seed数
+#define MAX_SEED_TRIES 0X100000
+
+// 槽位保存名称在表中的编号，类型为signed char
+#define MAX_NAMES 127
+
+static const char* const methodNames[] = {
+#define RPC_PARAM(name, kind)
+#define RPC_METHOD(name, ...) #name,
+#include "methods.def"
+#undef RPC_PARAM
+#undef RPC_METHOD
+};
+
+static const char* const paramNames[] = {
+#define RPC_PARAM(name, kind) #name,
+#define RPC_METHOD(name, ...)
+#include "methods.def"
+#undef RPC_PARAM
+#undef RPC_METHOD
+};
+
+// 所有名称在bits位的表中互不冲突时返回true，并填写slots
+static bool tryPlace(const char* const* names, int count, uint32_t seed, int bits, signed char* slots) {
+
+    memset(slots, -1, 1 << bits);
+
+    for(int i = 0; i < count; i++) {
+        uint32_t slot = methodHash(names[i], strlen(names[i]), seed) & ((1u << bits) - 1);
+        if(slots[slot] != -1) {
+            return false;
+        }
+        slots[slot] = (signed char)i;
+    }
+
+    return true;
+}
+
+// 为names生成一张表，宏以prefix开头，槽位数组名为slotsName，失败返回-1
+static int generate(const char* const* names, int count, const char* prefix, const char* slotsName) {
+
+    static signed char slots[1 << 16];
+
+    if(count > MAX_NAMES) {
+        fprintf(stderr, "genmethods: too many names for %s\n", slotsName);
+        return -1;
+    }
+
+    for(int i = 0; i < count; i++) {
+        for(int j = 0; j < i; j++) {
+            if(strcmp(names[i], names[j]) == 0) {
+                fprintf(stderr, "genmethods: duplicate name '%s'\n", names[i]);
+                return -1;
+            }
+        }
+    }
+
+    int bits = 0;
+    while((1 << bits) < count) bits++;
+
+    for(; bits <= 16; bits++) {
+
+        for(uint32_t seed = 0; seed < MAX_SEED_TRIES; seed++) {
+
+            if(!tryPlace(names, count, seed, bits, slots)) {
+                continue;
+            }
+
+            printf("#define %s_HASH_COUNT %d\n", prefix, count);
+            printf("#define %s_HASH_SEED 0X%X\n", prefix, seed);
+            printf("#define %s_HASH_BITS %d\n\n", prefix, bits);
+            printf("static const signed char %s[1 << %s_HASH_BITS] = {", slotsName, prefix);
+
+            for(int i = 0; i < (1 << bits); i++) {
+                printf("%s%3d,", i % 16 == 0 ? "\n    " : " ", slots[i]);
+            }
+
+            printf("\n};\n\n");
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "genmethods: no collision-free seed found for %s\n", slotsName);
+    return -1;
+}
+
+int main(void) {
+
+    printf("// 由genmethods根据methods.def生成，不要手动修改\n\n");
+
+    if(generate(methodNames, rpcMethod_count, "METHOD", "methodSlots") != 0 ||
+       generate(paramNames, rpcParam_count, "PARAM", "paramSlots") != 0) {
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,203 @@
+#include <string.h>
+#include "http.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// 请求头名称表，名称已转为小写，匹配时先比较长度
+typedef struct HeaderToken {
+    const char* name;
+    size_t len;
+    int id;         // HttpHeader，-1代表Sec-WebSocket-Extensions
+} HeaderToken;
+
+#define HEADER_EXTENSIONS -1
+
+static const HeaderToken headerTokens[] = {
+    { "connection",                 10, httpHeader_connection },
+    { "upgrade",                     7, httpHeader_upgrade },
+    { "sec-websocket-version",      21, httpHeader_secWebSocketVersion },
+    { "sec-websocket-key",          17, httpHeader_secWebSocketKey },
+    { "sec-websocket-protocol",     22, httpHeader_secWebSocketProtocol },
+    { "sec-websocket-extensions",   24, HEADER_EXTENSIONS },
+};
+
+static inline char lowerChar(char c) {
+    return (unsigned char)(c - 'A') < 26 ? c + ('a' - 'A') : c;
+}
+
+static bool lowerEquals(const char* s, const char* token, size_t len) {
+    for(size_t i = 0; i < len; i++) {
+        if(lowerChar(s[i]) != token[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 查找from之后的第一个'\n'，没有时返回len
+static size_t findLineEnd(const char* buff, size_t from, size_t len) {
+
+    size_t i = from;
+
+#ifdef __SSE2__
+    const __m128i lf = _mm_set1_epi8('\n');
+    for(; i + 16 <= len; i += 16) {
+        int bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(buff + i)), lf));
+        if(bits != 0) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+#endif
+
+    const char* p = memchr(buff + i, '\n', len - i);
+    return p ? (size_t)(p - buff) : len;
+}
+
+static inline bool isSpace(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static HttpSpan makeSpan(size_t begin, size_t end) {
+    HttpSpan span = { (uint16_t)begin, (uint16_t)(end - begin) };
+    return span;
+}
+
+// 请求行：方法 SP 请求目标 SP 版本
+static bool parseRequestLine(HttpRequest* req, const char* buff, size_t begin, size_t end) {
+
+    const char* line = buff + begin;
+    const char* lineEnd = buff + end;
+    const char* sp1 = memchr(line, ' ', end - begin);
+    const char* sp2 = sp1 ? memchr(sp1 + 1, ' ', lineEnd - sp1 - 1) : NULL;
+
+    if(sp2 == NULL || sp1 == line || sp2 == sp1 + 1 || sp2 + 1 == lineEnd) {
+        req->error = "Malformed request line";
+        return false;
+    }
+
+    req->method = makeSpan(begin, sp1 - buff);
+    req->target = makeSpan(sp1 + 1 - buff, sp2 - buff);
+    req->version = makeSpan(sp2 + 1 - buff, end);
+
+    return true;
+}
+
+// 请求头：名称 ":" OWS 值 OWS，只记录握手需要的请求头
+static bool parseHeaderLine(HttpRequest* req, const char* buff, size_t begin, size_t end) {
+
+    const char* line = buff + begin;
+    const char* colon = memchr(line, ':', end - begin);
+
+    // 不支持以空白开头的折行，名称与冒号之间也不能有空白
+    if(colon == NULL || colon == line || isSpace(line[0]) || isSpace(colon[-1])) {
+        req->error = "Malformed header line";
+        return false;
+    }
+
+    size_t nameLen = colon - line;
+    size_t valueBegin = colon + 1 - buff;
+    size_t valueEnd = end;
+
+    while(valueBegin < valueEnd && isSpace(buff[valueBegin])) valueBegin++;
+    while(valueEnd > valueBegin && isSpace(buff[valueEnd - 1])) valueEnd--;
+
+    for(size_t i = 0; i < sizeof(headerTokens) / sizeof(headerTokens[0]); i++) {
+
+        const HeaderToken* token = &headerTokens[i];
+        if(token->len != nameLen || !lowerEquals(line, token->name, nameLen)) {
+            continue;
+        }
+
+        if(token->id == HEADER_EXTENSIONS) {
+            if(req->extensionCount < HTTP_MAX_EXTENSION_LINES) {
+                req->extensions[req->extensionCount++] = makeSpan(valueBegin, valueEnd);
+            }
+        } else if(req->headers[token->id].len == 0) {
+            req->headers[token->id] = makeSpan(valueBegin, valueEnd);
+        }
+        break;
+    }
+
+    return true;
+}
+
+void httpRequestInit(HttpRequest* req) {
+    memset(req, 0, sizeof(HttpRequest));
+    req->state = httpParse_requestLine;
+}
+
+int httpParseRequest(HttpRequest* req, const char* buff, size_t len) {
+
+    if(req->state == httpParse_error) {
+        return -1;
+    }
+
+    // 请求行和请求头之外的数据不计入长度限制
+    size_t limit = len < HTTP_MAX_REQUEST_LEN ? len : HTTP_MAX_REQUEST_LEN;
+
+    for(;;) {
+
+        size_t lf = findLineEnd(buff, req->scanned, limit);
+
+        if(lf == limit) {
+            req->scanned = limit;
+            if(limit == HTTP_MAX_REQUEST_LEN) {
+                req->error = "Request too long";
+                goto httpParseRequestError;
+            }
+            return 0;
+        }
+
+        // 行以CRLF结尾，也接受单独的LF
+        size_t begin = req->lineStart;
+        size_t end = lf > begin && buff[lf - 1] == '\r' ? lf - 1 : lf;
+
+        req->scanned = req->lineStart = lf + 1;
+
+        if(req->state == httpParse_requestLine) {
+            if(!parseRequestLine(req, buff, begin, end)) {
+                goto httpParseRequestError;
+            }
+            req->state = httpParse_headers;
+        } else if(begin == end) {
+            req->state = httpParse_done;
+            return (int)(lf + 1);
+        } else if(!parseHeaderLine(req, buff, begin, end)) {
+            goto httpParseRequestError;
+        }
+    }
+
+httpParseRequestError:
+    req->state = httpParse_error;
+    return -1;
+}
+
+bool httpSpanEquals(const char* buff, HttpSpan span, const char* token, size_t tokenLen) {
+    return span.len == tokenLen && lowerEquals(buff + span.offset, token, tokenLen);
+}
+
+bool httpSpanHasToken(const char* buff, HttpSpan span, const char* token, size_t tokenLen) {
+
+    const char* p = buff + span.offset;
+    const char* end = p + span.len;
+
+    while(p < end) {
+
+        const char* comma = memchr(p, ',', end - p);
+        const char* itemEnd = comma ? comma : end;
+
+        while(p < itemEnd && isSpace(*p)) p++;
+        const char* e = itemEnd;
+        while(e > p && isSpace(e[-1])) e--;
+
+        if((size_t)(e - p) == tokenLen && lowerEquals(p, token, tokenLen)) {
+            return true;
+        }
+
+        p = itemEnd + 1;
+    }
+
+    return false;
+}
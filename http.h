@@ -0,0 +1,67 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef QLWS_HTTP_H
+
+#define QLWS_HTTP_H
+
+// WebSocket握手请求的增量解析器
+// 请求可以分多次到达，每次传入从请求开头起已接收的全部数据，已扫描过的部分不会重复扫描
+// 解析结果以相对请求开头的偏移量保存，两次调用之间缓冲区可以被移动，解析过程中不申请内存
+
+// 请求（包括请求行和所有请求头）的最大长度，超过时视为错误
+#define HTTP_MAX_REQUEST_LEN 8192
+
+// 最多记录的Sec-WebSocket-Extensions请求头行数
+#define HTTP_MAX_EXTENSION_LINES 4
+
+typedef enum HttpParseState {
+    httpParse_requestLine,      // 请求行尚未接收完
+    httpParse_headers,          // 正在接收请求头
+    httpParse_done,             // 遇到空行，请求接收完毕
+    httpParse_error             // 请求格式错误
+} HttpParseState;
+
+// 握手需要的请求头，其它请求头被忽略
+typedef enum HttpHeader {
+    httpHeader_connection,
+    httpHeader_upgrade,
+    httpHeader_secWebSocketVersion,
+    httpHeader_secWebSocketKey,
+    httpHeader_secWebSocketProtocol,
+    httpHeader_count
+} HttpHeader;
+
+// 请求中的一段文本，offset为相对请求开头的偏移量
+typedef struct HttpSpan {
+    uint16_t offset;
+    uint16_t len;
+} HttpSpan;
+
+typedef struct HttpRequest {
+    HttpParseState state;
+    size_t scanned;                 // 已扫描的字节数，下次从这里继续查找行尾
+    size_t lineStart;               // 当前行的起始位置
+    HttpSpan method;
+    HttpSpan target;
+    HttpSpan version;
+    HttpSpan headers[httpHeader_count];     // 同名请求头只记录第一个，len为0代表没有该请求头
+    HttpSpan extensions[HTTP_MAX_EXTENSION_LINES];
+    int extensionCount;
+    const char* error;              // 格式错误的原因，用于日志
+} HttpRequest;
+
+void httpRequestInit(HttpRequest* req);
+
+// 继续解析buff中的请求，len为从请求开头起已接收的字节数
+// 返回请求的总长度（之后的数据属于WebSocket帧），未接收完返回0，格式错误返回-1
+int httpParseRequest(HttpRequest* req, const char* buff, size_t len);
+
+// 不区分大小写地比较span与全小写的token
+bool httpSpanEquals(const char* buff, HttpSpan span, const char* token, size_t tokenLen);
+
+// span为逗号分隔的列表时，判断其中是否有与token相同的项（不区分大小写）
+bool httpSpanHasToken(const char* buff, HttpSpan span, const char* token, size_t tokenLen);
+
+#endif
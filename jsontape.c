@@ -0,0 +1,594 @@
+#include <stdlib.h>
+#include <string.h>
+#include "jsontape.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// 允许的最大嵌套深度，与cJSON相同
+#define TAPE_MAX_DEPTH 1000
+
+// 数字的最大长度，数字需要拷贝出来以'\0'结尾后才能交给strtod
+#define MAX_NUMBER_LEN 63
+
+// tape的初始项数，不够时从arena申请两倍大小的空间
+#define INITIAL_ENTRIES 64
+
+// 每块32字节，各种分类结果正好是一个uint32_t
+#define BLOCK_SIZE 32
+
+// 构建tape时期待的下一个记号
+typedef enum TapeState {
+    tapeState_value,            // 值，根节点、':'及数组中的','之后
+    tapeState_valueOrClose,     // 值或']'，'['之后
+    tapeState_key,              // 键，对象中的','之后
+    tapeState_keyOrClose,       // 键或'}'，'{'之后
+    tapeState_colon,            // 键之后
+    tapeState_commaOrClose,     // 容器中的值之后
+    tapeState_end               // 根节点结束，之后只允许有空白
+} TapeState;
+
+typedef struct Builder {
+    JsonTape* tape;
+    Arena* arena;
+    size_t len;
+    TapeState state;
+    int pendingString;          // 左引号已出现而右引号尚未出现的字符串项，没有时为-1
+    bool pendingKey;            // pendingString是对象的键
+    int depth;
+    int stack[TAPE_MAX_DEPTH];  // 尚未结束的容器项
+} Builder;
+
+// 一块数据的分类结果，第i位对应第i个字节
+typedef struct BlockMasks {
+    uint32_t quote;
+    uint32_t backslash;
+    uint32_t structural;        // {}[]:,
+    uint32_t space;
+} BlockMasks;
+
+static inline void classifyBlock(const char* p, BlockMasks* masks) {
+
+#ifdef __SSE2__
+    masks->quote = masks->backslash = masks->structural = masks->space = 0;
+
+    // 两个16字节的向量，结果分别放在低16位和高16位
+    for(int half = 0; half < 2; half++) {
+
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + half * 16));
+
+        // '['与'{'、']'与'}'只差0X20这一位
+        __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0X20));
+        __m128i structural = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')), _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')), _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+        __m128i space = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+
+        int shift = half * 16;
+        masks->quote |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << shift;
+        masks->backslash |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << shift;
+        masks->structural |= (uint32_t)_mm_movemask_epi8(structural) << shift;
+        masks->space |= (uint32_t)_mm_movemask_epi8(space) << shift;
+    }
+#else
+    masks->quote = masks->backslash = masks->structural = masks->space = 0;
+
+    for(int i = 0; i < BLOCK_SIZE; i++) {
+        switch(p[i]) {
+            case '"':  masks->quote |= 1u << i; break;
+            case '\\': masks->backslash |= 1u << i; break;
+            case '{': case '}': case '[': case ']': case ':': case ',':
+                masks->structural |= 1u << i; break;
+            case ' ': case '\t': case '\n': case '\r':
+                masks->space |= 1u << i; break;
+        }
+    }
+#endif
+}
+
+// 被反斜杠转义的字符，carry为上一块末尾是否有未配对的反斜杠
+// 连续的反斜杠从奇数位开始时，其后的字符在长度为奇数时落在偶数位，从偶数位开始时相反，
+// 对每段连续反斜杠的起始位加上整段，进位停在段后的字符上，由此无分支地得到段长的奇偶
+static uint32_t escapedMask(uint32_t backslash, uint32_t* carry) {
+
+    const uint32_t evenBits = 0X55555555;
+
+    if(backslash == 0 && *carry == 0) {
+        return 0;
+    }
+
+    // 被上一块转义的反斜杠不开始新的转义
+    backslash &= ~*carry;
+
+    uint32_t followsEscape = backslash << 1 | *carry;
+    uint32_t oddStarts = backslash & ~evenBits & ~followsEscape;
+    uint64_t sum = (uint64_t)oddStarts + backslash;
+    uint32_t evenSequences = (uint32_t)sum;
+
+    *carry = (uint32_t)(sum >> 32);
+    return (evenBits ^ (evenSequences << 1)) & followsEscape;
+}
+
+// 前缀异或，第i位为第0到i位的异或，引号之间（包括左引号）的位为1
+static inline uint32_t prefixXor(uint32_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    return bits;
+}
+
+static int addEntry(Builder* builder, TapeType type, size_t begin) {
+
+    JsonTape* tape = builder->tape;
+
+    if(tape->count == tape->capacity) {
+        int capacity = tape->capacity ? tape->capacity * 2 : INITIAL_ENTRIES;
+        TapeEntry* entries = arenaAlloc(builder->arena, sizeof(TapeEntry) * capacity);
+        if(entries == NULL) {
+            return -1;
+        }
+        if(tape->count) {
+            memcpy(entries, tape->entries, sizeof(TapeEntry) * tape->count);
+        }
+        tape->entries = entries;
+        tape->capacity = capacity;
+    }
+
+    TapeEntry* entry = &tape->entries[tape->count];
+    entry->type = type;
+    entry->decoded = 0;
+    entry->begin = (uint32_t)begin;
+    entry->end = (uint32_t)begin;
+
+    return tape->count++;
+}
+
+static inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static inline bool isDelimiter(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == ',' || c == ':' ||
+           c == '{' || c == '}' || c == '[' || c == ']' || c == '"';
+}
+
+// 检查从begin开始的数字或字面量，返回结束位置，格式错误返回0
+static size_t scanScalar(const char* data, size_t begin, size_t len, TapeType* type) {
+
+    size_t p = begin;
+
+    switch(data[p]) {
+
+        case 't':
+            if(len - p < 4 || memcmp(data + p, "true", 4) != 0) return 0;
+            *type = tapeType_true;
+            p += 4;
+            break;
+
+        case 'f':
+            if(len - p < 5 || memcmp(data + p, "false", 5) != 0) return 0;
+            *type = tapeType_false;
+            p += 5;
+            break;
+
+        case 'n':
+            if(len - p < 4 || memcmp(data + p, "null", 4) != 0) return 0;
+            *type = tapeType_null;
+            p += 4;
+            break;
+
+        default:
+            *type = tapeType_number;
+
+            if(data[p] == '-') p++;
+
+            if(p < len && data[p] == '0') {
+                p++;
+            } else if(p < len && isDigit(data[p])) {
+                while(p < len && isDigit(data[p])) p++;
+            } else {
+                return 0;
+            }
+
+            if(p < len && data[p] == '.') {
+                if(++p >= len || !isDigit(data[p])) return 0;
+                while(p < len && isDigit(data[p])) p++;
+            }
+
+            if(p < len && (data[p] == 'e' || data[p] == 'E')) {
+                if(++p < len && (data[p] == '+' || data[p] == '-')) p++;
+                if(p >= len || !isDigit(data[p])) return 0;
+                while(p < len && isDigit(data[p])) p++;
+            }
+
+            if(p - begin > MAX_NUMBER_LEN) return 0;
+            break;
+    }
+
+    // 记号必须在这里结束，例如trueX、12a是错误的
+    if(p < len && !isDelimiter(data[p])) {
+        return 0;
+    }
+
+    return p;
+}
+
+// 一个值结束后的状态
+static inline void valueDone(Builder* builder) {
+    builder->state = builder->depth ? tapeState_commaOrClose : tapeState_end;
+}
+
+static inline bool expectingValue(const Builder* builder) {
+    return builder->state == tapeState_value || builder->state == tapeState_valueOrClose;
+}
+
+// 处理pos处的一个记号：结构字符、字符串外的引号或数字及字面量的第一个字符
+static bool handleToken(Builder* builder, size_t pos) {
+
+    JsonTape* tape = builder->tape;
+    char c = tape->data[pos];
+    int index;
+
+    switch(c) {
+
+        case '"':
+
+            // 右引号
+            if(builder->pendingString >= 0) {
+                tape->entries[builder->pendingString].end = (uint32_t)pos;
+                builder->pendingString = -1;
+                if(builder->pendingKey) {
+                    builder->state = tapeState_colon;
+                } else {
+                    valueDone(builder);
+                }
+                return true;
+            }
+
+            builder->pendingKey = builder->state == tapeState_key || builder->state == tapeState_keyOrClose;
+
+            if(!builder->pendingKey && !expectingValue(builder)) {
+                return false;
+            }
+
+            if((builder->pendingString = addEntry(builder, tapeType_string, pos)) < 0) {
+                return false;
+            }
+            return true;
+
+        case '{':
+        case '[':
+
+            if(!expectingValue(builder) || builder->depth == TAPE_MAX_DEPTH) {
+                return false;
+            }
+
+            if((index = addEntry(builder, c == '{' ? tapeType_object : tapeType_array, pos)) < 0) {
+                return false;
+            }
+
+            builder->stack[builder->depth++] = index;
+            builder->state = c == '{' ? tapeState_keyOrClose : tapeState_valueOrClose;
+            return true;
+
+        case '}':
+        case ']': {
+
+            if(builder->depth == 0) {
+                return false;
+            }
+
+            TapeEntry* container = &tape->entries[builder->stack[builder->depth - 1]];
+            bool object = container->type == tapeType_object;
+
+            if(object != (c == '}')) {
+                return false;
+            }
+
+            if(builder->state != tapeState_commaOrClose &&
+               builder->state != (object ? tapeState_keyOrClose : tapeState_valueOrClose)) {
+                return false;
+            }
+
+            container->end = (uint32_t)tape->count;
+            builder->depth--;
+            valueDone(builder);
+            return true;
+        }
+
+        case ':':
+
+            if(builder->state != tapeState_colon) {
+                return false;
+            }
+
+            builder->state = tapeState_value;
+            return true;
+
+        case ',':
+
+            if(builder->state != tapeState_commaOrClose) {
+                return false;
+            }
+
+            builder->state = tape->entries[builder->stack[builder->depth - 1]].type == tapeType_object ? tapeState_key : tapeState_value;
+            return true;
+
+        default: {
+
+            TapeType type;
+            size_t end;
+
+            if(!expectingValue(builder) || (end = scanScalar(tape->data, pos, builder->len, &type)) == 0) {
+                return false;
+            }
+
+            if((index = addEntry(builder, type, pos)) < 0) {
+                return false;
+            }
+
+            tape->entries[index].end = (uint32_t)end;
+            valueDone(builder);
+            return true;
+        }
+    }
+}
+
+bool jsonTapeBuild(JsonTape* tape, char* data, size_t len, Arena* arena, size_t* errorOffset) {
+
+    Builder builder;
+    builder.tape = tape;
+    builder.arena = arena;
+    builder.len = len;
+    builder.state = tapeState_value;
+    builder.pendingString = -1;
+    builder.pendingKey = false;
+    builder.depth = 0;
+
+    tape->data = data;
+    tape->entries = NULL;
+    tape->count = 0;
+    tape->capacity = 0;
+
+    uint32_t escapeCarry = 0;       // 上一块末尾有未配对的反斜杠
+    uint32_t stringCarry = 0;       // 上一块在字符串中结束，为0XFFFFFFFF或0
+    uint32_t otherCarry = 0;        // 上一块的最后一个字节属于数字或字面量
+
+    size_t pos = 0;
+
+    if(len >= UINT32_MAX) {
+        goto jsonTapeBuildError;
+    }
+
+    for(; pos < len; pos += BLOCK_SIZE) {
+
+        // 最后不满一块的部分拷贝出来用空白补齐，不读取len之外的数据
+        const char* block = data + pos;
+        char tail[BLOCK_SIZE];
+
+        if(len - pos < BLOCK_SIZE) {
+            memset(tail, ' ', BLOCK_SIZE);
+            memcpy(tail, block, len - pos);
+            block = tail;
+        }
+
+        BlockMasks masks;
+        classifyBlock(block, &masks);
+
+        uint32_t quotes = masks.quote & ~escapedMask(masks.backslash, &escapeCarry);
+        uint32_t inString = prefixXor(quotes) ^ stringCarry;
+        stringCarry = inString & 0X80000000 ? 0XFFFFFFFF : 0;
+
+        // 字符串之外既不是空白、结构字符也不是引号的字节属于数字或字面量，只取每段的第一个字节
+        uint32_t other = ~(masks.space | masks.structural | masks.quote | inString);
+        uint32_t scalarStart = other & ~((other << 1) | otherCarry);
+        otherCarry = other >> 31;
+
+        uint32_t tokens = (masks.structural & ~inString) | quotes | scalarStart;
+
+        while(tokens) {
+            size_t at = pos + __builtin_ctz(tokens);
+            tokens &= tokens - 1;
+            if(!handleToken(&builder, at)) {
+                pos = at;
+                goto jsonTapeBuildError;
+            }
+        }
+    }
+
+    if(builder.state == tapeState_end && builder.pendingString < 0) {
+        return true;
+    }
+
+    pos = len;
+
+jsonTapeBuildError:
+    if(errorOffset) {
+        *errorOffset = pos;
+    }
+    return false;
+}
+
+static int hexValue(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// 读取r开始的4个十六进制数字，end为字符串的右引号
+static bool parseHex4(const char* r, const char* end, uint32_t* value) {
+
+    if(end - r < 4) {
+        return false;
+    }
+
+    *value = 0;
+    for(int i = 0; i < 4; i++) {
+        int h = hexValue(r[i]);
+        if(h < 0) {
+            return false;
+        }
+        *value = (*value << 4) | h;
+    }
+
+    return true;
+}
+
+// 以UTF-8写入码点，返回写入的字节数
+static int putUtf8(char* w, uint32_t cp) {
+
+    if(cp < 0X80) {
+        w[0] = (char)cp;
+        return 1;
+    }
+    if(cp < 0X800) {
+        w[0] = (char)(0XC0 | (cp >> 6));
+        w[1] = (char)(0X80 | (cp & 0X3F));
+        return 2;
+    }
+    if(cp < 0X10000) {
+        w[0] = (char)(0XE0 | (cp >> 12));
+        w[1] = (char)(0X80 | ((cp >> 6) & 0X3F));
+        w[2] = (char)(0X80 | (cp & 0X3F));
+        return 3;
+    }
+    w[0] = (char)(0XF0 | (cp >> 18));
+    w[1] = (char)(0X80 | ((cp >> 12) & 0X3F));
+    w[2] = (char)(0X80 | ((cp >> 6) & 0X3F));
+    w[3] = (char)(0X80 | (cp & 0X3F));
+    return 4;
+}
+
+// 返回[r, end)中第一个反斜杠或控制字符的位置，没有时返回end
+static char* skipPlain(char* r, char* end) {
+
+#ifdef __SSE2__
+    for(; end - r >= 16; r += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)r);
+        // 无符号比较v <= 0X1F，即max(v, 0X1F) == 0X1F
+        __m128i control = _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(0X1F)), _mm_set1_epi8(0X1F));
+        int stop = _mm_movemask_epi8(_mm_or_si128(control, _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+        if(stop) {
+            return r + __builtin_ctz(stop);
+        }
+    }
+#endif
+
+    while(r < end && *r != '\\' && (unsigned char)*r >= 0X20) r++;
+    return r;
+}
+
+// 写位置总是不超过读位置：转义序列至少2字节，\uXXXX为6字节而解码后最多3字节，代理对为12字节解码后4字节
+// 因此结尾的'\0'最远写在右引号的位置上
+const char* jsonTapeString(JsonTape* tape, int index, size_t* len) {
+
+    TapeEntry* entry = &tape->entries[index];
+    char* str = tape->data + entry->begin + 1;
+
+    if(entry->decoded) {
+        if(len) *len = entry->end - entry->begin - 1;
+        return str;
+    }
+
+    char* r = str;
+    char* w = str;
+    char* end = tape->data + entry->end;
+
+    while(r < end) {
+
+        // 不需要转义的部分整段移动
+        char* run = r;
+        r = skipPlain(r, end);
+
+        if(w != run) {
+            memmove(w, run, r - run);
+        }
+        w += r - run;
+
+        if(r == end) {
+            break;
+        }
+
+        // 控制字符，或反斜杠是最后一个字符（右引号被转义的情况已在构建时排除，这里只是防御）
+        if((unsigned char)*r < 0X20 || end - r < 2) {
+            return NULL;
+        }
+
+        switch(r[1]) {
+            case '"':  *w++ = '"';  r += 2; break;
+            case '\\': *w++ = '\\'; r += 2; break;
+            case '/':  *w++ = '/';  r += 2; break;
+            case 'b':  *w++ = '\b'; r += 2; break;
+            case 'f':  *w++ = '\f'; r += 2; break;
+            case 'n':  *w++ = '\n'; r += 2; break;
+            case 'r':  *w++ = '\r'; r += 2; break;
+            case 't':  *w++ = '\t'; r += 2; break;
+
+            case 'u': {
+                uint32_t cp, low;
+                if(!parseHex4(r + 2, end, &cp) || (cp >= 0XDC00 && cp <= 0XDFFF)) {
+                    return NULL;
+                }
+                r += 6;
+                // 高代理项之后必须紧跟低代理项
+                if(cp >= 0XD800 && cp <= 0XDBFF) {
+                    if(end - r < 6 || r[0] != '\\' || r[1] != 'u' || !parseHex4(r + 2, end, &low) || low < 0XDC00 || low > 0XDFFF) {
+                        return NULL;
+                    }
+                    cp = 0X10000 + ((cp - 0XD800) << 10) + (low - 0XDC00);
+                    r += 6;
+                }
+                w += putUtf8(w, cp);
+                break;
+            }
+
+            default:
+                return NULL;
+        }
+    }
+
+    *w = '\0';
+    entry->end = (uint32_t)(w - tape->data);
+    entry->decoded = 1;
+
+    if(len) *len = w - str;
+    return str;
+}
+
+double jsonTapeNumber(const JsonTape* tape, int index) {
+
+    const TapeEntry* entry = &tape->entries[index];
+    char text[MAX_NUMBER_LEN + 1];
+    size_t len = entry->end - entry->begin;
+
+    // 构建时已检查过格式及长度
+    memcpy(text, tape->data + entry->begin, len);
+    text[len] = '\0';
+
+    return strtod(text, NULL);
+}
+
+int jsonTapeFind(JsonTape* tape, int object, const char* key, size_t len) {
+
+    if(tape->entries[object].type != tapeType_object) {
+        return -1;
+    }
+
+    int end = (int)tape->entries[object].end;
+
+    for(int i = object + 1; i < end; i = jsonTapeNext(tape, i + 1)) {
+        size_t keyLen;
+        const char* name = jsonTapeString(tape, i, &keyLen);
+        if(name && keyLen == len && memcmp(name, key, len) == 0) {
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
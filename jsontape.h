@@ -0,0 +1,61 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "arena.h"
+
+#ifndef QLWS_JSONTAPE_H
+
+#define QLWS_JSONTAPE_H
+
+// RPC请求的按需JSON解析
+// 构建tape时用SIMD按32字节一块找出字符串之外的结构字符、字符串的引号及数字和字面量的起始位置，
+// 逐个检查语法并为每个值（包括对象的键）记录一项，容器项记录其结束位置，查找时可以整体跳过
+// 字符串只记录位置，用到时才在原数据中原地解码，没有用到的字符串不会被解码，其中的转义序列也不会被检查
+// 不要求数据以'\0'结尾，也不会读取len之外的数据
+
+typedef enum TapeType {
+    tapeType_object,
+    tapeType_array,
+    tapeType_string,
+    tapeType_number,
+    tapeType_true,
+    tapeType_false,
+    tapeType_null
+} TapeType;
+
+typedef struct TapeEntry {
+    uint8_t  type;          // TapeType
+    uint8_t  decoded;       // 字符串已原地解码
+    uint32_t begin;         // 值在数据中的起始位置，字符串为左引号的位置
+    uint32_t end;           // 容器为其后第一项的下标，字符串为右引号（解码后为结尾'\0'）的位置，其它为值的结束位置
+} TapeEntry;
+
+// 第0项为根节点，对象的成员按键、值的顺序排列
+typedef struct JsonTape {
+    char* data;
+    TapeEntry* entries;
+    int count;
+    int capacity;
+} JsonTape;
+
+// 为data中的一个完整的JSON值构建tape，末尾只允许有空白，entries从arena申请
+// 失败时返回false，errorOffset（可以为NULL）为出错的位置
+bool jsonTapeBuild(JsonTape* tape, char* data, size_t len, Arena* arena, size_t* errorOffset);
+
+// index之后的下一个兄弟项
+static inline int jsonTapeNext(const JsonTape* tape, int index) {
+    const TapeEntry* entry = &tape->entries[index];
+    return entry->type == tapeType_object || entry->type == tapeType_array ? (int)entry->end : index + 1;
+}
+
+// 原地解码字符串项，返回以'\0'结尾的UTF-8字符串，len（可以为NULL）为解码后的长度
+// 重复调用直接返回解码结果，转义序列错误或含有控制字符时返回NULL
+const char* jsonTapeString(JsonTape* tape, int index, size_t* len);
+
+double jsonTapeNumber(const JsonTape* tape, int index);
+
+// 在对象项中查找键，返回对应值的下标，没有时返回-1，同名的键只取第一个
+// 遍历时经过的键会被解码
+int jsonTapeFind(JsonTape* tape, int object, const char* key, size_t len);
+
+#endif
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <string.h>
+#include "jsonwriter.h"
+
+// 第一次改用堆内存时的最小容量
+#define MIN_HEAP_SIZE 1024
+
+void jsonWriterInit(JsonWriter* writer, char* buffer, size_t size) {
+    writer->buff = buffer;
+    writer->len = 0;
+    writer->capacity = buffer ? size : 0;
+    writer->heap = false;
+    writer->failed = false;
+}
+
+// 确保还能写入len字节，失败时设置failed
+static bool reserve(JsonWriter* writer, size_t len) {
+
+    if(writer->failed) {
+        return false;
+    }
+
+    if(writer->capacity - writer->len >= len) {
+        return true;
+    }
+
+    size_t capacity = writer->capacity > MIN_HEAP_SIZE / 2 ? writer->capacity * 2 : MIN_HEAP_SIZE;
+    while(capacity - writer->len < len) {
+        capacity *= 2;
+    }
+
+    // 初始缓冲区不能realloc，先申请再拷贝
+    char* buff = writer->heap ? realloc(writer->buff, capacity) : malloc(capacity);
+    if(buff == NULL) {
+        writer->failed = true;
+        return false;
+    }
+
+    if(!writer->heap && writer->len > 0) {
+        memcpy(buff, writer->buff, writer->len);
+    }
+
+    writer->buff = buff;
+    writer->capacity = capacity;
+    writer->heap = true;
+    return true;
+}
+
+void jsonWriterRaw(JsonWriter* writer, const char* data, size_t len) {
+    if(reserve(writer, len)) {
+        memcpy(writer->buff + writer->len, data, len);
+        writer->len += len;
+    }
+}
+
+void jsonWriterString(JsonWriter* writer, const char* str) {
+
+    if(str == NULL) {
+        jsonWriterRaw(writer, "null", 4);
+        return;
+    }
+
+    static const char hex[] = "0123456789abcdef";
+
+    jsonWriterRaw(writer, "\"", 1);
+
+    const unsigned char* p = (const unsigned char*)str;
+
+    while(*p) {
+
+        // 不需要转义的部分整段拷贝，非ASCII字符原样输出
+        const unsigned char* run = p;
+        while(*p >= 0X20 && *p != '"' && *p != '\\') p++;
+        jsonWriterRaw(writer, (const char*)run, p - run);
+
+        if(*p == '\0') {
+            break;
+        }
+
+        char escape[6] = { '\\', 0 };
+        size_t len = 2;
+
+        switch(*p) {
+            case '"':  escape[1] = '"';  break;
+            case '\\': escape[1] = '\\'; break;
+            case '\b': escape[1] = 'b';  break;
+            case '\f': escape[1] = 'f';  break;
+            case '\n': escape[1] = 'n';  break;
+            case '\r': escape[1] = 'r';  break;
+            case '\t': escape[1] = 't';  break;
+            default:
+                escape[1] = 'u';
+                escape[2] = '0';
+                escape[3] = '0';
+                escape[4] = hex[*p >> 4];
+                escape[5] = hex[*p & 0XF];
+                len = 6;
+                break;
+        }
+
+        jsonWriterRaw(writer, escape, len);
+        p++;
+    }
+
+    jsonWriterRaw(writer, "\"", 1);
+}
+
+void jsonWriterRelease(JsonWriter* writer) {
+    if(writer->heap) {
+        free(writer->buff);
+    }
+    writer->buff = NULL;
+    writer->len = writer->capacity = 0;
+    writer->heap = false;
+}
@@ -0,0 +1,32 @@
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifndef QLWS_JSONWRITER_H
+
+#define QLWS_JSONWRITER_H
+
+// 直接向缓冲区追加JSON文本，用于回复等结构固定的小消息，不需要先构建cJSON树再打印
+// 从调用者提供的初始缓冲区（通常在栈上）开始写，写不下时改用堆内存并按倍数扩大
+// 结构由调用者用jsonWriterRaw写出，writer只负责字符串的转义
+// 不加锁，只能在一个线程中使用
+
+typedef struct JsonWriter {
+    char*  buff;
+    size_t len;
+    size_t capacity;
+    bool   heap;            // buff为额外申请的内存
+    bool   failed;          // 内存不足，之后的写入都被忽略
+} JsonWriter;
+
+// buffer为初始缓冲区，可以为NULL
+void jsonWriterInit(JsonWriter* writer, char* buffer, size_t size);
+
+void jsonWriterRaw(JsonWriter* writer, const char* data, size_t len);
+
+// 写出带引号的字符串，按cJSON的规则转义，str为NULL时写出null
+void jsonWriterString(JsonWriter* writer, const char* str);
+
+// 释放额外申请的内存，之后writer不能再使用，除非重新jsonWriterInit
+void jsonWriterRelease(JsonWriter* writer);
+
+#endif
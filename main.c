@@ -6,9 +6,15 @@
 #include <winsock2.h>
 #include <unistd.h>
 #include "lib/cjson/cJSON.h"
+#include "msgpack.h"
+#include "methods.h"
+#include "arena.h"
+#include "jsontape.h"
+#include "jsonwriter.h"
 #include "api.h"
 #include "ws.h"
 #include "server.h"
+#include "dispatcher.h"
 
 #define DllExport(returnType) __declspec(dllexport) returnType __stdcall
 
@@ -27,14 +33,65 @@ const char* PLUGIN_INFO = "{"
 int authCode;
 char pluginPath[1024];
 
+// QQLight的接口不保证线程安全，部分接口返回的字符串由QQLight持有，会被下一次调用覆盖
+// 请求在多个I/O线程中处理，所有QQLight接口的调用（包括pluginLog中的QL_printLog）都要持有hostMutex，
+// 返回的字符串在释放hostMutex之前拷贝出来。Windows下Mutex为CRITICAL_SECTION，同一线程可以重复进入，
+// 持有hostMutex的处理函数中再调用pluginLog不会死锁
+Mutex hostMutex;
+
 struct {
     char address[64];
     u_short port;
     char path[256];
+    int ioThreads;
+    int clientSoftLimit;
+    int clientHardLimit;
+    int maxFrameSize;
+    int maxMessageSize;
+    bool permessageDeflate;
+    int compressionThreshold;
+    int fragmentSize;
+    int coalesceDelay;
+    int coalesceBytes;
 } config = {
     address: "127.0.0.1",
     port: 49632,
-    path: "/"
+    path: "/",
+    ioThreads: 2,
+    clientSoftLimit: 1000,
+    clientHardLimit: 10000,
+    maxFrameSize: 16777216,
+    maxMessageSize: 16777216,
+    permessageDeflate: true,
+    compressionThreshold: 1024,
+    fragmentSize: 65536,
+    coalesceDelay: 0,
+    coalesceBytes: 16384
+};
+
+// 事件编号，即事件名在eventNames中的下标
+enum {
+    event_message,
+    event_friendRequest,
+    event_friendChange,
+    event_groupMemberIncrease,
+    event_groupMemberDecrease,
+    event_adminChange,
+    event_groupRequest,
+    event_receiveMoney
+};
+
+// 客户端握手时可以通过查询参数events按名称订阅事件，例如ws://localhost:49632/?events=message,groupRequest
+const char* const eventNames[] = {
+    "message",
+    "friendRequest",
+    "friendChange",
+    "groupMemberIncrease",
+    "groupMemberDecrease",
+    "adminChange",
+    "groupRequest",
+    "receiveMoney",
+    NULL
 };
 
 void pluginLog(const char* type, int level, const char* format, ...) {
@@ -47,7 +104,9 @@ void pluginLog(const char* type, int level, const char* format, ...) {
 	vsnprintf(buff, sizeof(buff) - 1, format, arg);
 	va_end(arg);
 
+	mutexLock(&hostMutex);
 	QL_printLog(type, buff, 0, authCode);
+	mutexUnlock(&hostMutex);
 }
 
 // 返回转换后数据地址，记得free
@@ -84,433 +143,581 @@ char* UTF8ToGBK(const char* str) {
     return gbstr;
 }
 
-void sendAcceptJSON(SOCKET socket, const char* idField) {
-    cJSON* root = cJSON_CreateObject();
-    cJSON_AddItemToObject(root, "id", cJSON_CreateString(idField));
-
-    const char* jsonStr = cJSON_PrintUnformatted(root);
-    wsFrameSend(socket, jsonStr, strlen(jsonStr), frameType_text);
+// 在两个代码页之间转换长度为len的数据，返回以'\0'结尾的结果，outLen为不含'\0'的长度，记得free
+// 中间结果在堆上申请，用于整条消息这样可能很大的数据，内存不足时返回NULL
+char* convertCodePage(UINT from, UINT to, const char* str, int len, int* outLen) {
+
+    char* out = NULL;
+    int n = len > 0 ? MultiByteToWideChar(from, 0, str, len, NULL, 0) : 0;
+    wchar_t* u16str = malloc(sizeof(wchar_t) * (n + 1));
+
+    if(u16str) {
+        MultiByteToWideChar(from, 0, str, len, u16str, n);
+        int m = n > 0 ? WideCharToMultiByte(to, 0, u16str, n, NULL, 0, NULL, NULL) : 0;
+        if((out = malloc(m + 1)) != NULL) {
+            WideCharToMultiByte(to, 0, u16str, n, out, m, NULL, NULL);
+            out[m] = '\0';
+            *outLen = m;
+        }
+        free(u16str);
+    }
 
-    cJSON_Delete(root);
-    free((void*)jsonStr);
+    return out;
 }
 
-void sendErrorJSON(SOCKET socket, const char* idField, const char* errorField) {
-    cJSON* root = cJSON_CreateObject();
-    cJSON_AddItemToObject(root, "id", cJSON_CreateString(idField));
-    cJSON_AddItemToObject(root, "error", cJSON_CreateString(errorField));
-
-    const char* jsonStr = cJSON_PrintUnformatted(root);
-    wsFrameSend(socket, jsonStr, strlen(jsonStr), frameType_text);
+// 按客户端握手时协商的编码序列化回复并发送，会释放root
+// GBK编码的连接先序列化为UTF-8 JSON再整体转换，避免GBK第二字节与JSON转义字符冲突
+void sendReply(Client* client, cJSON* root) {
 
-    cJSON_Delete(root);
-    free((void*)jsonStr);
-}
+    // GB18030代码页
+    const int CODE_PAGE = 54936;
 
-void sendSuccessJSON(SOCKET socket, const char* idField, cJSON* resultField) {
-    cJSON* root = cJSON_CreateObject();
-    cJSON_AddItemToObject(root, "id", cJSON_CreateString(idField));
-    cJSON_AddItemToObject(root, "result", resultField);
+    WsEncoding encoding = wsClientEncoding(client);
+    char* payload;
+    int len = 0;
+
+    if(encoding == wsEncoding_msgpack) {
+        payload = msgpackEncode(root, &len);
+    } else if((payload = cJSON_PrintUnformatted(root)) != NULL) {
+        len = strlen(payload);
+        if(encoding == wsEncoding_jsonGbk) {
+            char* gbk = convertCodePage(CP_UTF8, CODE_PAGE, payload, len, &len);
+            free(payload);
+            payload = gbk;
+        }
+    }
 
-    const char* jsonStr = cJSON_PrintUnformatted(root);
-    wsFrameSend(socket, jsonStr, strlen(jsonStr), frameType_text);
+    // 序列化结果直接作为帧的载荷，由服务器在发送后释放
+    if(payload) {
+        wsFrameSendOwned(client, payload, len, wsEncodingFrameType(encoding));
+    }
 
     cJSON_Delete(root);
-    free((void*)jsonStr);
 }
 
-void wsClientTextDataHandle(const char* payload, uint64_t payloadLen, SOCKET socket) {
-    
-    // 注意，payload的文本数据不是以\0结尾
-    pluginLog("wsClientDataHandle", 0, "Payload data is %.*s", payloadLen > 128 ? 128 : (unsigned int)payloadLen, payload);
+// 回复的序列化缓冲区，放在栈上，确认、错误及字符串结果一般不需要申请内存
+#define REPLY_BUFFER_SIZE 512
 
-    const char* parseEnd;
+// 发送只有id及一个字符串字段的回复，key为NULL时只有id
+// JSON编码直接写出文本，不构建cJSON树，MessagePack编码仍由cJSON树编码
+static void sendStringReply(Client* client, const char* idField, const char* key, const char* value) {
 
-    cJSON *json = cJSON_ParseWithOpts(payload, &parseEnd, 0);
+    // GB18030代码页
+    const int CODE_PAGE = 54936;
 
-    if(json == NULL) {
-        const char *error_ptr = cJSON_GetErrorPtr();
-        if (error_ptr != NULL) {
-            pluginLog("jsonParse", 1, "Error before: %d", error_ptr - payload);
+    WsEncoding encoding = wsClientEncoding(client);
+
+    if(encoding == wsEncoding_msgpack) {
+        cJSON* root = cJSON_CreateObject();
+        cJSON_AddItemToObject(root, "id", cJSON_CreateString(idField));
+        if(key) {
+            cJSON_AddItemToObject(root, key, value ? cJSON_CreateString(value) : cJSON_CreateNull());
         }
+        sendReply(client, root);
         return;
     }
 
-    // 公有字段
-    const cJSON* j_id     = cJSON_GetObjectItemCaseSensitive(json, "id");        // cJSON_GetObjectItemCaseSensitive获取不存在的字段时会返回NULL
-    const cJSON* j_method = cJSON_GetObjectItemCaseSensitive(json, "method");
-    const cJSON* j_params = cJSON_GetObjectItemCaseSensitive(json, "params");
-
-    const cJSON_bool e_id     = cJSON_IsString(j_id);        // 如果j_xx的值为NULL的时候也会返回FALSE，所以e_xx为TRUE时可以保证字段存在且类型正确
-    const cJSON_bool e_method = cJSON_IsString(j_method);
-    const cJSON_bool e_params = cJSON_IsString(j_params);
+    char buffer[REPLY_BUFFER_SIZE];
+    JsonWriter writer;
+    jsonWriterInit(&writer, buffer, sizeof(buffer));
+
+    jsonWriterRaw(&writer, "{\"id\":", 6);
+    jsonWriterString(&writer, idField);
+    if(key) {
+        jsonWriterRaw(&writer, ",", 1);
+        jsonWriterString(&writer, key);
+        jsonWriterRaw(&writer, ":", 1);
+        jsonWriterString(&writer, value);
+    }
+    jsonWriterRaw(&writer, "}", 1);
 
-    const char* v_id     = e_id     ?  j_id->valuestring      : NULL;
-    const char* v_method = e_method ?  j_method->valuestring  : NULL;
-    const char* v_params = e_params ?  j_params->valuestring  : NULL;
+    if(writer.failed) {
+        goto sendStringReplyEnd;
+    }
 
-    if(!e_id) {
-        sendErrorJSON(socket, "", "Missing 'id' Field");
-        cJSON_Delete(json);
-        return;
+    // 只含ASCII字符时GBK与UTF-8相同，不需要转换
+    bool ascii = true;
+    for(size_t i = 0; i < writer.len && ascii; i++) {
+        ascii = (unsigned char)writer.buff[i] < 0X80;
     }
-    
-    if(!e_method) {
-        sendErrorJSON(socket, v_id, "Missing 'method' Field");
-        cJSON_Delete(json);
-        return;
+
+    if(encoding == wsEncoding_jsonGbk && !ascii) {
+        int len;
+        char* gbk = convertCodePage(CP_UTF8, CODE_PAGE, writer.buff, (int)writer.len, &len);
+        if(gbk) {
+            wsFrameSendOwned(client, gbk, len, wsEncodingFrameType(encoding));
+        }
+    } else {
+        wsFrameSend(client, writer.buff, (int)writer.len, wsEncodingFrameType(encoding));
     }
 
-    // 参数字段
-    const cJSON* j_type     = cJSON_GetObjectItemCaseSensitive(j_params, "type");        // 即使j_params为NULL也是安全的，返回的结果也是NULL
-    const cJSON* j_group    = cJSON_GetObjectItemCaseSensitive(j_params, "group");
-    const cJSON* j_qq       = cJSON_GetObjectItemCaseSensitive(j_params, "qq");
-    const cJSON* j_content  = cJSON_GetObjectItemCaseSensitive(j_params, "content");
-    const cJSON* j_msgid    = cJSON_GetObjectItemCaseSensitive(j_params, "msgid");
-    const cJSON* j_message  = cJSON_GetObjectItemCaseSensitive(j_params, "message");
-    const cJSON* j_object   = cJSON_GetObjectItemCaseSensitive(j_params, "object");
-    const cJSON* j_data     = cJSON_GetObjectItemCaseSensitive(j_params, "data");
-    const cJSON* j_name     = cJSON_GetObjectItemCaseSensitive(j_params, "name");
-    const cJSON* j_seq      = cJSON_GetObjectItemCaseSensitive(j_params, "seq");
-    const cJSON* j_duration = cJSON_GetObjectItemCaseSensitive(j_params, "duration");
-    const cJSON* j_enable   = cJSON_GetObjectItemCaseSensitive(j_params, "enable");
-    const cJSON* j_cache    = cJSON_GetObjectItemCaseSensitive(j_params, "cache");
-    const cJSON* j_cookies  = cJSON_GetObjectItemCaseSensitive(j_params, "cookies");
-
-    const cJSON_bool e_type     = cJSON_IsNumber(j_type);
-    const cJSON_bool e_group    = cJSON_IsString(j_group);
-    const cJSON_bool e_qq       = cJSON_IsString(j_qq);
-    const cJSON_bool e_content  = cJSON_IsString(j_content);
-    const cJSON_bool e_msgid    = cJSON_IsString(j_msgid);
-    const cJSON_bool e_message  = cJSON_IsString(j_message);
-    const cJSON_bool e_object   = cJSON_IsString(j_object);
-    const cJSON_bool e_data     = cJSON_IsString(j_data);
-    const cJSON_bool e_name     = cJSON_IsString(j_name);
-    const cJSON_bool e_seq      = cJSON_IsString(j_seq);
-    const cJSON_bool e_cookies  = cJSON_IsString(j_cookies);
-    const cJSON_bool e_duration = cJSON_IsNumber(j_duration);
-    const cJSON_bool e_enable   = cJSON_IsBool(j_enable);
-    const cJSON_bool e_cache    = cJSON_IsBool(j_cache);
-
-    int         v_type     = e_type     ?  j_type->valueint        :  -1;
-    const char* v_group    = e_group    ?  j_group->valuestring    :  NULL;
-    const char* v_qq       = e_qq       ?  j_qq->valuestring       :  NULL;
-    const char* v_content  = e_content  ?  j_content->valuestring  :  NULL;
-    const char* v_msgid    = e_msgid    ?  j_msgid->valuestring    :  NULL;
-    const char* v_message  = e_message  ?  j_message->valuestring  :  NULL;
-    const char* v_object   = e_object   ?  j_object->valuestring   :  NULL;
-    const char* v_data     = e_data     ?  j_data->valuestring     :  NULL;
-    const char* v_name     = e_name     ?  j_name->valuestring     :  NULL;
-    const char* v_seq      = e_seq      ?  j_seq->valuestring      :  NULL;
-    const char* v_cookies  = e_cookies  ?  j_cookies->valuestring  :  NULL;
-    int         v_duration = e_duration ?  j_duration->valueint    :  -1;
-    bool        v_enable   = e_enable   ?  cJSON_IsTrue(j_enable)  :  false;
-    bool        v_cache    = e_cache    ?  cJSON_IsTrue(j_cache)   :  false;
- 
-    pluginLog("jsonRPC", 0, "Client call '%s' method", v_method);
+sendStringReplyEnd:
+    jsonWriterRelease(&writer);
+}
 
-    #define PARAMS_CHECK(condition) if(!(condition)) {sendErrorJSON(socket, v_id, "Invalid Parameters"); goto RPCParseEnd;}
-    #define METHOD_IS(name) (strcmp(name, v_method) == 0)
-    
-    if(METHOD_IS("sendMessage")) {
+void sendAcceptJSON(Client* client, const char* idField) {
+    sendStringReply(client, idField, NULL, NULL);
+}
 
-        PARAMS_CHECK(e_type && e_content && (e_qq || e_group));
+void sendErrorJSON(Client* client, const char* idField, const char* errorField) {
+    sendStringReply(client, idField, "error", errorField);
+}
 
-        char* gbkText = UTF8ToGBK(v_content);
-        QL_sendMessage(v_type, e_content ? v_group : "", e_qq ? v_qq : "", gbkText, authCode);
-        free((void*)gbkText);
+void sendSuccessJSON(Client* client, const char* idField, cJSON* resultField) {
+    cJSON* root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "id", cJSON_CreateString(idField));
+    cJSON_AddItemToObject(root, "result", resultField);
+    sendReply(client, root);
+}
 
-        sendAcceptJSON(socket, v_id);
+// 结果为字符串的回复，不经过cJSON，resultField为NULL时结果为null
+void sendSuccessStringJSON(Client* client, const char* idField, const char* resultField) {
+    sendStringReply(client, idField, "result", resultField);
+}
 
-    }  else if (METHOD_IS("sendQzone")) {
+// 接口处理函数，调用前已按methods.def中的声明绑定并检查过参数
+// 在I/O线程中调用，调用期间持有hostMutex，同一时刻只有一个处理函数在运行
+typedef void (*RpcHandler)(Client* client, const char* id, const RpcParams* params);
 
-        PARAMS_CHECK(e_content);
+void rpc_sendMessage(Client* client, const char* id, const RpcParams* params) {
 
-        const char* result = GBKToUTF8(QL_sendQzone(UTF8ToGBK(v_content), authCode));
+    char* gbkText = UTF8ToGBK(params->content);
+    QL_sendMessage(params->type, params->group ? params->group : "", params->qq ? params->qq : "", gbkText, authCode);
+    free((void*)gbkText);
 
-        sendSuccessJSON(socket, v_id, cJSON_CreateString(result));
+    sendAcceptJSON(client, id);
+}
 
-        free((void*)result);
+void rpc_sendQzone(Client* client, const char* id, const RpcParams* params) {
 
-    } else if (METHOD_IS("withdrawMessage")) {
+    const char* result = GBKToUTF8(QL_sendQzone(UTF8ToGBK(params->content), authCode));
 
-        PARAMS_CHECK(e_group && e_msgid);
+    sendSuccessStringJSON(client, id, result);
 
-        QL_withdrawMessage(v_group, v_msgid, authCode);
+    free((void*)result);
+}
 
-        sendAcceptJSON(socket, v_id);
+void rpc_withdrawMessage(Client* client, const char* id, const RpcParams* params) {
 
-    } else if (METHOD_IS("getFriendList")) {
+    QL_withdrawMessage(params->group, params->msgid, authCode);
 
-        const char* friendList = GBKToUTF8(QL_getFriendList(v_cache, authCode));
+    sendAcceptJSON(client, id);
+}
 
-        sendSuccessJSON(socket, v_id, cJSON_Parse(friendList));
+void rpc_getFriendList(Client* client, const char* id, const RpcParams* params) {
 
-        free((void*)friendList);
+    const char* friendList = GBKToUTF8(QL_getFriendList(params->cache, authCode));
 
-    } else if (METHOD_IS("addFriend")) {
+    sendSuccessJSON(client, id, cJSON_Parse(friendList));
 
-        PARAMS_CHECK(e_qq);
+    free((void*)friendList);
+}
 
-        if(!e_message) {
-            QL_addFriend(v_qq, "", authCode);
-        } else {
-            const char* text = UTF8ToGBK(v_message);
-            QL_addFriend(v_qq, text, authCode);
-            free((void*)text);
-        }
+void rpc_addFriend(Client* client, const char* id, const RpcParams* params) {
 
-        sendAcceptJSON(socket, v_id);
+    if(params->message == NULL) {
+        QL_addFriend(params->qq, "", authCode);
+    } else {
+        const char* text = UTF8ToGBK(params->message);
+        QL_addFriend(params->qq, text, authCode);
+        free((void*)text);
+    }
 
-    } else if (METHOD_IS("deleteFriend")) {
+    sendAcceptJSON(client, id);
+}
 
-        PARAMS_CHECK(e_qq);
+void rpc_deleteFriend(Client* client, const char* id, const RpcParams* params) {
 
-        QL_deleteFriend(v_qq, authCode);
+    QL_deleteFriend(params->qq, authCode);
 
-        sendAcceptJSON(socket, v_id);
+    sendAcceptJSON(client, id);
+}
 
-    } else if (METHOD_IS("getGroupList")) {
+void rpc_getGroupList(Client* client, const char* id, const RpcParams* params) {
 
-        const char* groupList = GBKToUTF8(QL_getGroupList(v_cache, authCode));
+    const char* groupList = GBKToUTF8(QL_getGroupList(params->cache, authCode));
 
-        sendSuccessJSON(socket, v_id, cJSON_Parse(groupList));
+    sendSuccessJSON(client, id, cJSON_Parse(groupList));
 
-        free((void*)groupList);
+    free((void*)groupList);
+}
 
-    } else if (METHOD_IS("getGroupMemberList")) {
+void rpc_getGroupMemberList(Client* client, const char* id, const RpcParams* params) {
 
-        PARAMS_CHECK(e_group);
+    const char* groupMemberList = GBKToUTF8(QL_getGroupMemberList(params->group, params->cache, authCode));
 
-        const char* groupMemberList = GBKToUTF8(QL_getGroupMemberList(v_group, v_cache, authCode));
+    sendSuccessJSON(client, id, cJSON_Parse(groupMemberList));
 
-        sendSuccessJSON(socket, v_id, cJSON_Parse(groupMemberList));
+    free((void*)groupMemberList);
+}
 
-        free((void*)groupMemberList);
+void rpc_addGroup(Client* client, const char* id, const RpcParams* params) {
 
-    } else if (METHOD_IS("addGroup")) {
+    if(params->message == NULL) {
+        QL_addGroup(params->group, "", authCode);
+    } else {
+        const char* text = UTF8ToGBK(params->message);
+        QL_addGroup(params->group, text, authCode);
+        free((void*)text);
+    }
 
-        PARAMS_CHECK(e_group);
+    sendAcceptJSON(client, id);
+}
 
-        if(!e_message) {
-            QL_addGroup(v_group, "", authCode);
-        } else {
-            const char* text = UTF8ToGBK(v_message);
-            QL_addGroup(v_group, text, authCode);
-            free((void*)text);
-        }
+void rpc_quitGroup(Client* client, const char* id, const RpcParams* params) {
 
-        sendAcceptJSON(socket, v_id);
+    QL_quitGroup(params->group, authCode);
 
-    } else if (METHOD_IS("quitGroup")) {
+    sendAcceptJSON(client, id);
+}
 
-        PARAMS_CHECK(e_group);
+void rpc_getGroupCard(Client* client, const char* id, const RpcParams* params) {
 
-        QL_quitGroup(v_group, authCode);
+    const char* groupCard = GBKToUTF8(QL_getGroupCard(params->group, params->qq, authCode));
 
-        sendAcceptJSON(socket, v_id);
+    sendSuccessStringJSON(client, id, groupCard);
 
-    } else if (METHOD_IS("getGroupCard")) {
+    free((void*)groupCard);
+}
 
-        PARAMS_CHECK(e_group && e_qq);
+void rpc_uploadImage(Client* client, const char* id, const RpcParams* params) {
 
-        const char* groupCard = GBKToUTF8(QL_getGroupCard(v_group, v_qq, authCode));
+    const char* text = QL_uploadImage(params->type, params->object, params->data, authCode);
+    int textLen = strlen(text);
 
-        sendSuccessJSON(socket, v_id, cJSON_CreateString(groupCard));
+    if(textLen > 9 && textLen < 100 && strstr(text, "[QQ:pic=") == text) {
+        char guid[textLen + 1];
+        strcpy(guid, text);
+        guid[textLen - 1] = '\0';   // 去除末尾的']'
+        sendSuccessStringJSON(client, id, guid + 8);    // 去除开头的'[QQ:pic='
+    } else {
+        sendSuccessStringJSON(client, id, "");
+    }
+}
 
-        free((void*)groupCard);
+void rpc_getQQInfo(Client* client, const char* id, const RpcParams* params) {
 
-    } else if (METHOD_IS("uploadImage")) {
+    const char* info = GBKToUTF8(QL_getQQInfo(params->qq, authCode));
 
-        PARAMS_CHECK(e_type && e_object && e_data);
+    sendSuccessJSON(client, id, cJSON_Parse(info));
 
-        const char* text = QL_uploadImage(v_type, v_object, v_data, authCode);
-        int textLen = strlen(text);
+    free((void*)info);
+}
 
-        if(textLen > 9 && textLen < 100 && strstr(text, "[QQ:pic=") == text) {
-            char guid[textLen + 1];
-            strcpy(guid, text);
-            guid[textLen - 1] = '\0';   // 去除末尾的']'
-            sendSuccessJSON(socket, v_id, cJSON_CreateString(guid + 8));    // 去除开头的'[QQ:pic='
-        } else {
-            sendSuccessJSON(socket, v_id, cJSON_CreateString(""));
-        }
+void rpc_getGroupInfo(Client* client, const char* id, const RpcParams* params) {
 
-    } else if (METHOD_IS("getQQInfo")) {
+    const char* info = GBKToUTF8(QL_getGroupInfo(params->group, authCode));
 
-        PARAMS_CHECK(e_qq);
+    sendSuccessJSON(client, id, cJSON_Parse(info));
 
-        const char* info = GBKToUTF8(QL_getQQInfo(v_qq, authCode));
+    free((void*)info);
+}
 
-        sendSuccessJSON(socket, v_id, cJSON_Parse(info));
+void rpc_inviteIntoGroup(Client* client, const char* id, const RpcParams* params) {
 
-        free((void*)info);
+    QL_inviteIntoGroup(params->group, params->qq, authCode);
 
-    } else if (METHOD_IS("getGroupInfo")) {
+    sendAcceptJSON(client, id);
+}
 
-        PARAMS_CHECK(e_group);
+void rpc_setGroupCard(Client* client, const char* id, const RpcParams* params) {
 
-        const char* info = GBKToUTF8(QL_getGroupInfo(v_group, authCode));
+    const char* name = UTF8ToGBK(params->name);
 
-        sendSuccessJSON(socket, v_id, cJSON_Parse(info));
+    QL_setGroupCard(params->group, params->qq, name, authCode);
 
-        free((void*)info);
+    sendAcceptJSON(client, id);
 
-    } else if (METHOD_IS("inviteIntoGroup")) {
+    free((void*)name);
+}
 
-        PARAMS_CHECK(e_qq && e_group);
+void rpc_getLoginAccount(Client* client, const char* id, const RpcParams* params) {
 
-        QL_inviteIntoGroup(v_group, v_qq, authCode);
+    const char* account = GBKToUTF8(QL_getLoginAccount(authCode));
 
-        sendAcceptJSON(socket, v_id);
+    sendSuccessStringJSON(client, id, account);
 
-    } else if (METHOD_IS("setGroupCard")) {
+    free((void*)account);
+}
 
-        PARAMS_CHECK(e_qq && e_group && e_name);
+void rpc_setSignature(Client* client, const char* id, const RpcParams* params) {
 
-        const char* name = UTF8ToGBK(v_name);
+    const char* content = UTF8ToGBK(params->content);
 
-        QL_setGroupCard(v_group, v_qq, name, authCode);
+    QL_setSignature(content, authCode);
 
-        sendAcceptJSON(socket, v_id);
+    sendAcceptJSON(client, id);
 
-        free((void*)name);
+    free((void*)content);
+}
 
-    } else if (METHOD_IS("getLoginAccount")) {
+void rpc_getNickname(Client* client, const char* id, const RpcParams* params) {
 
-        const char* account = GBKToUTF8(QL_getLoginAccount(authCode));
+    const char* nickname = GBKToUTF8(QL_getNickname(params->qq, authCode));
 
-        sendSuccessJSON(socket, v_id, cJSON_CreateString(account));
+    sendSuccessStringJSON(client, id, nickname);
 
-        free((void*)account);
+    free((void*)nickname);
+}
 
-    } else if (METHOD_IS("setSignature")) {
+void rpc_setNickname(Client* client, const char* id, const RpcParams* params) {
 
-        PARAMS_CHECK(e_content);
+    const char* nickname = UTF8ToGBK(params->name);
 
-        const char* content = UTF8ToGBK(v_content);
+    QL_setNickname(nickname, authCode);
 
-        QL_setSignature(content, authCode);
+    sendAcceptJSON(client, id);
 
-        sendAcceptJSON(socket, v_id);
+    free((void*)nickname);
+}
 
-        free((void*)content);
+void rpc_getPraiseCount(Client* client, const char* id, const RpcParams* params) {
 
-    } else if (METHOD_IS("getNickname")) {
+    const char* count = GBKToUTF8(QL_getPraiseCount(params->qq, authCode));
 
-        PARAMS_CHECK(e_qq);
+    sendSuccessStringJSON(client, id, count);
 
-        const char* nickname = GBKToUTF8(QL_getNickname(v_qq, authCode));
+    free((void*)count);
+}
 
-        sendSuccessJSON(socket, v_id, cJSON_CreateString(nickname));
+void rpc_givePraise(Client* client, const char* id, const RpcParams* params) {
 
-        free((void*)nickname);
+    QL_givePraise(params->qq, authCode);
 
-    } else if (METHOD_IS("setNickname")) {
+    sendAcceptJSON(client, id);
+}
 
-        PARAMS_CHECK(e_name);
+void rpc_handleFriendRequest(Client* client, const char* id, const RpcParams* params) {
 
-        const char* nickname = UTF8ToGBK(v_name);
+    if(params->message) {
+        const char* message = UTF8ToGBK(params->message);
+        QL_handleFriendRequest(params->qq, params->type, message, authCode);
+        free((void*)message);
+    } else {
+        QL_handleFriendRequest(params->qq, params->type, "", authCode);
+    }
 
-        QL_setNickname(nickname, authCode);
+    sendAcceptJSON(client, id);
+}
 
-        sendAcceptJSON(socket, v_id);
+void rpc_setState(Client* client, const char* id, const RpcParams* params) {
 
-        free((void*)nickname);
+    QL_setState(params->type, authCode);
 
-    } else if (METHOD_IS("getPraiseCount")) {
+    sendAcceptJSON(client, id);
+}
 
-        PARAMS_CHECK(e_qq);
+void rpc_handleGroupRequest(Client* client, const char* id, const RpcParams* params) {
 
-        const char* count = GBKToUTF8(QL_getPraiseCount(v_qq, authCode));
+    const char* message = params->message ? params->message : "";
 
-        sendSuccessJSON(socket, v_id, cJSON_CreateString(count));
+    QL_handleGroupRequest(params->group, params->qq, params->seq, params->type, message, authCode);
 
-        free((void*)count);
+    sendAcceptJSON(client, id);
+}
 
-    } else if (METHOD_IS("givePraise")) {
+void rpc_kickGroupMember(Client* client, const char* id, const RpcParams* params) {
 
-        PARAMS_CHECK(e_qq);
+    QL_kickGroupMember(params->group, params->qq, false, authCode);
 
-        QL_givePraise(v_qq, authCode);
+    sendAcceptJSON(client, id);
+}
 
-        sendAcceptJSON(socket, v_id);
+void rpc_silence(Client* client, const char* id, const RpcParams* params) {
 
-    } else if (METHOD_IS("handleFriendRequest")) {
+    QL_silence(params->group, params->qq, params->duration, authCode);
 
-        PARAMS_CHECK(e_qq && e_type);
+    sendAcceptJSON(client, id);
+}
 
-        if(e_message) {
-            const char* message = UTF8ToGBK(v_message);
-            QL_handleFriendRequest(v_qq, v_type, message, authCode);
-            free((void*)message);
-        } else {
-            QL_handleFriendRequest(v_qq, v_type, "", authCode);
-        }
+void rpc_globalSilence(Client* client, const char* id, const RpcParams* params) {
 
-        sendAcceptJSON(socket, v_id);
+    QL_globalSilence(params->group, params->enable, authCode);
 
-    } else if (METHOD_IS("setState")) {
+    sendAcceptJSON(client, id);
+}
 
-        PARAMS_CHECK(e_type);
+void rpc_getCookies(Client* client, const char* id, const RpcParams* params) {
+    sendSuccessStringJSON(client, id, QL_getCookies(authCode));
+}
 
-        QL_setState(v_type, authCode);
+void rpc_getBkn(Client* client, const char* id, const RpcParams* params) {
+    sendSuccessStringJSON(client, id, QL_getBkn(params->cookies, authCode));
+}
 
-        sendAcceptJSON(socket, v_id);
+void rpc_getBknLong(Client* client, const char* id, const RpcParams* params) {
+    sendSuccessStringJSON(client, id, QL_getBkn_Long(params->cookies, authCode));
+}
 
-    } else if (METHOD_IS("handleGroupRequest")) {
+void rpc_getServerStats(Client* client, const char* id, const RpcParams* params) {
 
-        PARAMS_CHECK(e_group && e_qq && e_seq && e_type);
+    ServerStats stats;
+    serverGetStats(&stats);
 
-        const char* message = e_message ? v_message : "";
+    cJSON* result = cJSON_CreateObject();
+    cJSON_AddItemToObject(result, "broadcasts", cJSON_CreateNumber(stats.broadcasts));
+    cJSON_AddItemToObject(result, "broadcastBytesCopied", cJSON_CreateNumber(stats.broadcastBytesCopied));
+    cJSON_AddItemToObject(result, "deflateBytesIn", cJSON_CreateNumber(stats.deflateBytesIn));
+    cJSON_AddItemToObject(result, "deflateBytesOut", cJSON_CreateNumber(stats.deflateBytesOut));
+    cJSON_AddItemToObject(result, "bufferedBytes", cJSON_CreateNumber(stats.bufferedBytes));
+    cJSON_AddItemToObject(result, "queuedBytes", cJSON_CreateNumber(stats.queuedBytes));
+    cJSON_AddItemToObject(result, "sendCalls", cJSON_CreateNumber(stats.sendCalls));
+    cJSON_AddItemToObject(result, "framesSent", cJSON_CreateNumber(stats.framesSent));
+    cJSON_AddItemToObject(result, "clients", cJSON_CreateNumber(stats.clients));
+    cJSON_AddItemToObject(result, "clientCapacity", cJSON_CreateNumber(stats.clientCapacity));
 
-        QL_handleGroupRequest(v_group, v_qq, v_seq, v_type, message, authCode);
+    // 只列出调用过的接口，不存在的接口合计在unknownMethods中
+    cJSON* methods = cJSON_CreateObject();
+    for(int i = -1; i < rpcMethod_count; i++) {
 
-        sendAcceptJSON(socket, v_id);
+        MethodStats methodStats;
+        methodGetStats(i, &methodStats);
 
-    } else if (METHOD_IS("kickGroupMember")) {
+        if(i >= 0 && methodStats.calls == 0) {
+            continue;
+        }
 
-        PARAMS_CHECK(e_group && e_qq);
+        cJSON* item = cJSON_CreateObject();
+        cJSON_AddItemToObject(item, "calls", cJSON_CreateNumber(methodStats.calls));
+        cJSON_AddItemToObject(item, "lookupNanos", cJSON_CreateNumber(methodStats.lookupNanos));
+        if(i >= 0) {
+            cJSON_AddItemToObject(item, "handleNanos", cJSON_CreateNumber(methodStats.handleNanos));
+            cJSON_AddItemToObject(methods, methodName(i), item);
+        } else {
+            cJSON_AddItemToObject(result, "unknownMethods", item);
+        }
+    }
+    cJSON_AddItemToObject(result, "methods", methods);
 
-        QL_kickGroupMember(v_group, v_qq, false, authCode);
+    sendSuccessJSON(client, id, result);
+}
 
-        sendAcceptJSON(socket, v_id);
+// 按接口编号排列，与methods.def一一对应
+const RpcHandler rpcHandlers[] = {
+#define RPC_PARAM(name, kind)
+#define RPC_METHOD(name, ...) rpc_##name,
+#include "methods.def"
+#undef RPC_PARAM
+#undef RPC_METHOD
+};
 
-    } else if (METHOD_IS("silence")) {
+// 请求tape的初始内存，放在栈上，一般的请求不需要额外申请内存
+#define REQUEST_ARENA_SIZE 4096
 
-        PARAMS_CHECK(e_group && e_qq && e_duration);
+void wsClientTextDataHandle(char* payload, uint64_t payloadLen, Client* client) {
+    
+    // 注意，payload的文本数据不是以\0结尾
+    pluginLog("wsClientDataHandle", 0, "Payload data is %.*s", payloadLen > 128 ? 128 : (unsigned int)payloadLen, payload);
 
-        QL_silence(v_group, v_qq, v_duration, authCode);
+    cJSON* json = NULL;
+    char* u8Payload = NULL;
 
-        sendAcceptJSON(socket, v_id);
+    uint64_t arenaSpace[REQUEST_ARENA_SIZE / sizeof(uint64_t)];
+    Arena arena;
+    arenaInit(&arena, arenaSpace, sizeof(arenaSpace));
 
-    } else if (METHOD_IS("globalSilence")) {
+    // 公有字段，字符串都是UTF-8编码，之后的处理与编码无关
+    const char* v_id     = NULL;
+    const char* v_method = NULL;
 
-        PARAMS_CHECK(e_group && e_enable);
+    // params字段，MessagePack请求为cJSON节点，JSON请求为tape中的下标，不存在时分别为NULL和-1
+    const cJSON* j_params = NULL;
+    JsonTape tape;
+    int paramsIndex = -1;
 
-        QL_globalSilence(v_group, v_enable, authCode);
+    // 请求按握手时协商的编码解析
+    WsEncoding encoding = wsClientEncoding(client);
 
-        sendAcceptJSON(socket, v_id);
+    if(encoding == wsEncoding_msgpack) {
 
-    } else if (METHOD_IS("getCookies")) {
+        if((json = msgpackDecode(payload, payloadLen)) == NULL) {
+            pluginLog("msgpackDecode", 1, "Malformed MessagePack request");
+            goto wsClientTextDataHandleEnd;
+        }
 
-        sendSuccessJSON(socket, v_id, cJSON_CreateString(QL_getCookies(authCode)));
+        const cJSON* j_id     = cJSON_GetObjectItemCaseSensitive(json, "id");        // cJSON_GetObjectItemCaseSensitive获取不存在的字段时会返回NULL
+        const cJSON* j_method = cJSON_GetObjectItemCaseSensitive(json, "method");
+        j_params              = cJSON_GetObjectItemCaseSensitive(json, "params");
 
-    } else if (METHOD_IS("getBkn")) {
-        
-        sendSuccessJSON(socket, v_id, cJSON_CreateString(QL_getBkn(v_cookies, authCode)));
+        v_id     = cJSON_IsString(j_id)     ? j_id->valuestring     : NULL;        // 如果j_xx的值为NULL的时候cJSON_IsString也会返回FALSE
+        v_method = cJSON_IsString(j_method) ? j_method->valuestring : NULL;
+
+    } else {
+
+        // GBK编码的请求先整体转换为UTF-8，GB18030代码页
+        const int CODE_PAGE = 54936;
+        if(encoding == wsEncoding_jsonGbk) {
+            int u8Len;
+            if((u8Payload = convertCodePage(CODE_PAGE, CP_UTF8, payload, (int)payloadLen, &u8Len)) == NULL) {
+                goto wsClientTextDataHandleEnd;
+            }
+            payload = u8Payload;
+            payloadLen = u8Len;
+        }
+
+        // 只构建tape，用到的字符串才在payload中原地解码，在处理结束前payload不能释放
+        size_t errorOffset;
+        if(!jsonTapeBuild(&tape, payload, payloadLen, &arena, &errorOffset)) {
+            pluginLog("jsonParse", 1, "Error before: %d", (int)errorOffset);
+            goto wsClientTextDataHandleEnd;
+        }
 
-    } else if (METHOD_IS("getBknLong")) {
+        // 根节点不是对象时查找结果都是-1，转义序列错误的字符串按字段不存在处理
+        int idIndex     = jsonTapeFind(&tape, 0, "id", 2);
+        int methodIndex = jsonTapeFind(&tape, 0, "method", 6);
+        paramsIndex     = jsonTapeFind(&tape, 0, "params", 6);
 
-        sendSuccessJSON(socket, v_id, cJSON_CreateString(QL_getBkn_Long(v_cookies, authCode)));
+        v_id     = idIndex >= 0     && tape.entries[idIndex].type == tapeType_string     ? jsonTapeString(&tape, idIndex, NULL)     : NULL;
+        v_method = methodIndex >= 0 && tape.entries[methodIndex].type == tapeType_string ? jsonTapeString(&tape, methodIndex, NULL) : NULL;
+    }
+
+    if(v_id == NULL) {
+        sendErrorJSON(client, "", "Missing 'id' Field");
+        goto wsClientTextDataHandleEnd;
+    }
+    
+    if(v_method == NULL) {
+        sendErrorJSON(client, v_id, "Missing 'method' Field");
+        goto wsClientTextDataHandleEnd;
+    }
 
+    pluginLog("jsonRPC", 0, "Client call '%s' method", v_method);
+
+    // 查找及处理的耗时计入接口的调用统计
+    uint64_t lookupStart = clockNanos();
+    int methodId = methodLookup(v_method, strlen(v_method));
+    uint64_t handleStart = clockNanos();
+
+    if(methodId < 0) {
+        methodRecord(-1, handleStart - lookupStart, 0);
+        sendErrorJSON(client, v_id, "Unknown Method");
+        goto wsClientTextDataHandleEnd;
+    }
+
+    RpcParams params;
+    char error[128];
+
+    bool bound = encoding == wsEncoding_msgpack ?
+        methodBindParams(methodId, j_params, &params, error, sizeof(error)) :
+        methodBindTapeParams(methodId, &tape, paramsIndex, &params, error, sizeof(error));
+
+    if(bound) {
+        mutexLock(&hostMutex);
+        rpcHandlers[methodId](client, v_id, &params);
+        mutexUnlock(&hostMutex);
     } else {
-        sendErrorJSON(socket, v_id, "Unknown Method");
+        sendErrorJSON(client, v_id, error);
     }
 
-    RPCParseEnd:
+    methodRecord(methodId, handleStart - lookupStart, clockNanos() - handleStart);
 
+wsClientTextDataHandleEnd:
+
+    // MessagePack请求由cJSON创建，JSON请求的tape随arena一起释放
     cJSON_Delete(json);
+
+    arenaRelease(&arena);
+    free(u8Payload);
 }
 
 // 不存在配置文件时创建配置文件并写入全局变量config的默认配置
@@ -534,6 +741,16 @@ void createConfigFile(void) {
         cJSON_AddItemToObject(root, "address", cJSON_CreateString(config.address));
         cJSON_AddItemToObject(root, "port", cJSON_CreateNumber(config.port));
         cJSON_AddItemToObject(root, "path", cJSON_CreateString(config.path));
+        cJSON_AddItemToObject(root, "ioThreads", cJSON_CreateNumber(config.ioThreads));
+        cJSON_AddItemToObject(root, "clientSoftLimit", cJSON_CreateNumber(config.clientSoftLimit));
+        cJSON_AddItemToObject(root, "clientHardLimit", cJSON_CreateNumber(config.clientHardLimit));
+        cJSON_AddItemToObject(root, "maxFrameSize", cJSON_CreateNumber(config.maxFrameSize));
+        cJSON_AddItemToObject(root, "maxMessageSize", cJSON_CreateNumber(config.maxMessageSize));
+        cJSON_AddItemToObject(root, "permessageDeflate", cJSON_CreateBool(config.permessageDeflate));
+        cJSON_AddItemToObject(root, "compressionThreshold", cJSON_CreateNumber(config.compressionThreshold));
+        cJSON_AddItemToObject(root, "fragmentSize", cJSON_CreateNumber(config.fragmentSize));
+        cJSON_AddItemToObject(root, "coalesceDelay", cJSON_CreateNumber(config.coalesceDelay));
+        cJSON_AddItemToObject(root, "coalesceBytes", cJSON_CreateNumber(config.coalesceBytes));
 
         const char* json = cJSON_Print(root);
         fwrite(json, strlen(json), 1, fp);
@@ -581,6 +798,16 @@ void readConfigFile(void) {
     cJSON* j_address = cJSON_GetObjectItem(json, "address");
     cJSON* j_port = cJSON_GetObjectItem(json, "port");
     cJSON* j_path = cJSON_GetObjectItem(json, "path");
+    cJSON* j_ioThreads = cJSON_GetObjectItem(json, "ioThreads");
+    cJSON* j_clientSoftLimit = cJSON_GetObjectItem(json, "clientSoftLimit");
+    cJSON* j_clientHardLimit = cJSON_GetObjectItem(json, "clientHardLimit");
+    cJSON* j_maxFrameSize = cJSON_GetObjectItem(json, "maxFrameSize");
+    cJSON* j_maxMessageSize = cJSON_GetObjectItem(json, "maxMessageSize");
+    cJSON* j_permessageDeflate = cJSON_GetObjectItem(json, "permessageDeflate");
+    cJSON* j_compressionThreshold = cJSON_GetObjectItem(json, "compressionThreshold");
+    cJSON* j_fragmentSize = cJSON_GetObjectItem(json, "fragmentSize");
+    cJSON* j_coalesceDelay = cJSON_GetObjectItem(json, "coalesceDelay");
+    cJSON* j_coalesceBytes = cJSON_GetObjectItem(json, "coalesceBytes");
     
     if(cJSON_IsNumber(j_port)) {
         config.port = (u_short)j_port->valueint;
@@ -596,6 +823,46 @@ void readConfigFile(void) {
         config.address[sizeof(config.address) - 1] = '\0';
     }
 
+    if(cJSON_IsNumber(j_ioThreads)) {
+        config.ioThreads = j_ioThreads->valueint;
+    }
+
+    if(cJSON_IsNumber(j_clientSoftLimit)) {
+        config.clientSoftLimit = j_clientSoftLimit->valueint;
+    }
+
+    if(cJSON_IsNumber(j_clientHardLimit)) {
+        config.clientHardLimit = j_clientHardLimit->valueint;
+    }
+
+    if(cJSON_IsNumber(j_maxFrameSize)) {
+        config.maxFrameSize = j_maxFrameSize->valueint;
+    }
+
+    if(cJSON_IsNumber(j_maxMessageSize)) {
+        config.maxMessageSize = j_maxMessageSize->valueint;
+    }
+
+    if(cJSON_IsBool(j_permessageDeflate)) {
+        config.permessageDeflate = cJSON_IsTrue(j_permessageDeflate);
+    }
+
+    if(cJSON_IsNumber(j_compressionThreshold)) {
+        config.compressionThreshold = j_compressionThreshold->valueint;
+    }
+
+    if(cJSON_IsNumber(j_fragmentSize)) {
+        config.fragmentSize = j_fragmentSize->valueint;
+    }
+
+    if(cJSON_IsNumber(j_coalesceDelay)) {
+        config.coalesceDelay = j_coalesceDelay->valueint;
+    }
+
+    if(cJSON_IsNumber(j_coalesceBytes)) {
+        config.coalesceBytes = j_coalesceBytes->valueint;
+    }
+
     cJSON_Delete(json);
     fclose(fp);
 }
@@ -611,6 +878,7 @@ DllExport(const char*) Information(const char* _authCode) {
 DllExport(int) Event_Initialization(void) {
     
     // 获取插件目录
+    mutexLock(&hostMutex);
     const char* path = QL_getPluginPath(authCode);
 
     if(strlen(path) > sizeof(pluginPath) - 1) {
@@ -619,6 +887,7 @@ DllExport(int) Event_Initialization(void) {
     } else {
         strcpy(pluginPath, path);
     }
+    mutexUnlock(&hostMutex);
 
     pluginLog("Event_Initialization", 0, "Plugin directory is %s", pluginPath);
 
@@ -630,7 +899,28 @@ DllExport(int) Event_pluginStart(void) {
     createConfigFile();
     readConfigFile();
 
-    int result = serverStart(config.address, config.port, config.path);
+    ServerOptions options;
+    options.ioThreads = config.ioThreads;
+    options.clientSoftLimit = config.clientSoftLimit;
+    options.clientHardLimit = config.clientHardLimit;
+    options.maxFrameSize = config.maxFrameSize > 0 ? config.maxFrameSize : 0;
+    options.maxMessageSize = config.maxMessageSize > 0 ? config.maxMessageSize : 0;
+    options.messageStream = NULL;
+    options.eventNames = eventNames;
+    options.permessageDeflate = config.permessageDeflate;
+    options.compressionThreshold = config.compressionThreshold;
+    options.fragmentSize = config.fragmentSize >= 0 ? config.fragmentSize : 0;
+    options.coalesceDelay = config.coalesceDelay > 0 ? config.coalesceDelay : 0;
+    options.coalesceBytes = config.coalesceBytes;
+
+    int result = dispatcherStart();
+
+    if(result == 0) {
+        result = serverStart(config.address, config.port, config.path, &options);
+        if(result != 0) {
+            dispatcherStop();
+        }
+    }
     
     if(result != 0) {
         pluginLog("Event_pluginStart", 1, "WebSocket server startup failed");
@@ -646,6 +936,7 @@ DllExport(int) Event_pluginStart(void) {
 
 DllExport(int) Event_pluginStop(void) {
     
+    dispatcherStop();       // 先处理完已入队的事件再关闭服务器
     serverStop();
     
     pluginLog("Event_pluginStop", 1, "WebSocket server stopped"); 
@@ -653,17 +944,96 @@ DllExport(int) Event_pluginStop(void) {
     return 0;
 }
 
-DllExport(int) Event_GetNewMsg (
-    int type,              // 1=好友消息 2=群消息 3=群临时消息 4=讨论组消息 5=讨论组临时消息 6=QQ临时消息
-    const char* group,     // 类型为1或6的时候，此参数为空字符串，其余情况下为群号或讨论组号
-    const char* qq,        // 消息来源QQ号 "10000"都是来自系统的消息(比如某人被禁言或某人撤回消息等)
-    const char* msg,       // 消息内容
-    const char* msgid      // 消息id，撤回消息的时候会用到，群消息会存在，其余情况下为空  
-) {
+// 事件任务，事件回调只将参数拷贝进任务，序列化与广播在分发线程中进行
+#define EVENT_MAX_ARGS 6
+typedef struct EventTask {
+    DispatchTask task;
+    int type;
+    const char* args[EVENT_MAX_ARGS];   // 指向strings中的拷贝，为NULL的参数被替换为空字符串
+    char strings[];
+} EventTask;
+
+// 将字符串参数拷贝进一次申请的内存中并交给分发线程，返回后不再引用调用者的数据
+void postEvent(void (*run)(DispatchTask*), int type, int argc, ...) {
+
+    const char* strs[EVENT_MAX_ARGS];
+    size_t lens[EVENT_MAX_ARGS];
+    size_t total = 0;
+
+    va_list arg;
+    va_start(arg, argc);
+    for(int i = 0; i < argc; i++) {
+        strs[i] = va_arg(arg, const char*);
+        strs[i] = strs[i] ? strs[i] : "";
+        lens[i] = strlen(strs[i]) + 1;
+        total += lens[i];
+    }
+    va_end(arg);
 
-    // 将可能为NULL的字符串指针参数修改为空字符串
-    group = group ? group : "";
-    msgid = msgid ? msgid : "";
+    EventTask* event = malloc(sizeof(EventTask) + total);
+    if(event == NULL) {
+        pluginLog("postEvent", 1, "Out of memory, event dropped");
+        return;
+    }
+
+    event->task.run = run;
+    event->type = type;
+
+    char* cur = event->strings;
+    for(int i = 0; i < argc; i++) {
+        memcpy(cur, strs[i], lens[i]);
+        event->args[i] = cur;
+        cur += lens[i];
+    }
+
+    if(dispatcherPost(&event->task) != 0) {
+        free(event);
+    }
+}
+
+// 按当前有客户端使用的编码各序列化一次事件，发送给订阅了该事件的客户端，会释放root
+void broadcastEvent(int eventId, cJSON* root) {
+
+    // GB18030代码页
+    const int CODE_PAGE = 54936;
+
+    char* payloads[wsEncoding_count] = {NULL};
+    int lens[wsEncoding_count] = {0};
+    uint32_t encodings = wsEncodingsInUse();
+
+    if(encodings & (1 << wsEncoding_json | 1 << wsEncoding_jsonGbk)) {
+
+        char* jsonStr = cJSON_PrintUnformatted(root);
+
+        if(jsonStr && (encodings & 1 << wsEncoding_jsonGbk)) {
+            payloads[wsEncoding_jsonGbk] = convertCodePage(CP_UTF8, CODE_PAGE, jsonStr, strlen(jsonStr), &lens[wsEncoding_jsonGbk]);
+        }
+
+        if(jsonStr && (encodings & 1 << wsEncoding_json)) {
+            payloads[wsEncoding_json] = jsonStr;
+            lens[wsEncoding_json] = strlen(jsonStr);
+        } else {
+            free(jsonStr);
+        }
+    }
+
+    if(encodings & 1 << wsEncoding_msgpack) {
+        payloads[wsEncoding_msgpack] = msgpackEncode(root, &lens[wsEncoding_msgpack]);
+    }
+
+    // 序列化结果直接作为帧的载荷，由服务器在发送后释放
+    wsEventSendToAllOwned(eventId, payloads, lens);
+
+    cJSON_Delete(root);
+}
+
+void newMessageEventRun(DispatchTask* task) {
+
+    EventTask* event = (EventTask*)task;
+    const char* group = event->args[0];
+    const char* qq    = event->args[1];
+    const char* msg   = event->args[2];
+    const char* msgid = event->args[3];
 
     const char* u8Content = GBKToUTF8(msg);
 
@@ -671,7 +1041,7 @@ DllExport(int) Event_GetNewMsg (
     cJSON_AddItemToObject(root, "event", cJSON_CreateString("message"));
 
     cJSON* params = cJSON_CreateObject();
-    cJSON_AddItemToObject(params, "type", cJSON_CreateNumber(type));
+    cJSON_AddItemToObject(params, "type", cJSON_CreateNumber(event->type));
     cJSON_AddItemToObject(params, "msgid", cJSON_CreateString(msgid));
     cJSON_AddItemToObject(params, "group", cJSON_CreateString(group));
     cJSON_AddItemToObject(params, "qq", cJSON_CreateString(qq));
@@ -679,18 +1049,30 @@ DllExport(int) Event_GetNewMsg (
 
     cJSON_AddItemToObject(root, "params", params);
 
-    const char* jsonStr = cJSON_PrintUnformatted(root);
-
-    wsFrameSendToAll(jsonStr, strlen(jsonStr), frameType_text);
+    broadcastEvent(event_message, root);
 
-    cJSON_Delete(root);
     free((void*)u8Content);
-    free((void*)jsonStr);
+    free(event);
+}
+
+DllExport(int) Event_GetNewMsg (
+    int type,              // 1=好友消息 2=群消息 3=群临时消息 4=讨论组消息 5=讨论组临时消息 6=QQ临时消息
+    const char* group,     // 类型为1或6的时候，此参数为空字符串，其余情况下为群号或讨论组号
+    const char* qq,        // 消息来源QQ号 "10000"都是来自系统的消息(比如某人被禁言或某人撤回消息等)
+    const char* msg,       // 消息内容
+    const char* msgid      // 消息id，撤回消息的时候会用到，群消息会存在，其余情况下为空  
+) {
+
+    postEvent(newMessageEventRun, type, 4, group, qq, msg, msgid);
 
     return 0;    // 返回0下个插件继续处理该事件，返回1拦截此事件不让其他插件执行
 }
 
-DllExport(int) Event_AddFriend(const char* qq, const char* message) {
+void addFriendEventRun(DispatchTask* task) {
+
+    EventTask* event = (EventTask*)task;
+    const char* qq      = event->args[0];
+    const char* message = event->args[1];
 
     const char* u8Message = GBKToUTF8(message);
 
@@ -703,70 +1085,72 @@ DllExport(int) Event_AddFriend(const char* qq, const char* message) {
 
     cJSON_AddItemToObject(root, "params", params);
 
-    const char* jsonStr = cJSON_PrintUnformatted(root);
+    broadcastEvent(event_friendRequest, root);
 
-    wsFrameSendToAll(jsonStr, strlen(jsonStr), frameType_text);
-
-    cJSON_Delete(root);
     free((void*)u8Message);
-    free((void*)jsonStr);
+    free(event);
+}
+
+DllExport(int) Event_AddFriend(const char* qq, const char* message) {
+
+    postEvent(addFriendEventRun, 0, 2, qq, message);
 
     return 0;
 }
 
-DllExport(int) Event_FriendChange(
-    int type,           // 1.成为好友（单向） 2.成为好友（双向） 3、被删除好友
-    const char* qq
-) {
+void friendChangeEventRun(DispatchTask* task) {
+
+    EventTask* event = (EventTask*)task;
+    const char* qq = event->args[0];
 
     cJSON* root = cJSON_CreateObject();
     cJSON_AddItemToObject(root, "event", cJSON_CreateString("friendChange"));
 
     cJSON* params = cJSON_CreateObject();
-    cJSON_AddItemToObject(params, "type", cJSON_CreateNumber(type));
+    cJSON_AddItemToObject(params, "type", cJSON_CreateNumber(event->type));
     cJSON_AddItemToObject(params, "qq", cJSON_CreateString(qq));
 
     cJSON_AddItemToObject(root, "params", params);
 
-    const char* jsonStr = cJSON_PrintUnformatted(root);
+    broadcastEvent(event_friendChange, root);
 
-    wsFrameSendToAll(jsonStr, strlen(jsonStr), frameType_text);
+    free(event);
+}
 
-    cJSON_Delete(root);
-    free((void*)jsonStr);
+DllExport(int) Event_FriendChange(
+    int type,           // 1.成为好友（单向） 2.成为好友（双向） 3、被删除好友
+    const char* qq
+) {
+
+    postEvent(friendChangeEventRun, type, 1, qq);
 
     return 0;
 }
 
-void handleGroupMemberChange(
-    int type, 
-    const char* group, 
-    const char* qq, 
-    const char* operator,
-    const char* event
-) {
+// groupMemberIncrease与groupMemberDecrease共用，最后一个参数为事件名
+void groupMemberChangeEventRun(DispatchTask* task) {
 
-    // 将可能为NULL的字符串指针参数修改为空字符串
-    operator = operator ? operator : "";
+    EventTask* event = (EventTask*)task;
+    const char* group     = event->args[0];
+    const char* qq        = event->args[1];
+    const char* operator  = event->args[2];
+    const char* eventName = event->args[3];
 
     cJSON* root = cJSON_CreateObject();
-    cJSON_AddItemToObject(root, "event", cJSON_CreateString(event));
+    cJSON_AddItemToObject(root, "event", cJSON_CreateString(eventName));
 
     cJSON* params = cJSON_CreateObject();
     
-    cJSON_AddItemToObject(params, "type", cJSON_CreateNumber(type));
+    cJSON_AddItemToObject(params, "type", cJSON_CreateNumber(event->type));
     cJSON_AddItemToObject(params, "group", cJSON_CreateString(group));
     cJSON_AddItemToObject(params, "qq", cJSON_CreateString(qq));
     cJSON_AddItemToObject(params, "operator", cJSON_CreateString(operator));
     
     cJSON_AddItemToObject(root, "params", params);
 
-    const char* jsonStr = cJSON_PrintUnformatted(root);
+    broadcastEvent(strcmp(eventName, "groupMemberIncrease") == 0 ? event_groupMemberIncrease : event_groupMemberDecrease, root);
 
-    wsFrameSendToAll(jsonStr, strlen(jsonStr), frameType_text);
-
-    cJSON_Delete(root);
-    free((void*)jsonStr);
+    free(event);
 }
 
 DllExport(int) Event_GroupMemberIncrease(
@@ -775,7 +1159,7 @@ DllExport(int) Event_GroupMemberIncrease(
     const char* qq,         // 
     const char* operator    // 操作者QQ
 ) {
-    handleGroupMemberChange(type, group, qq, operator, "groupMemberIncrease");
+    postEvent(groupMemberChangeEventRun, type, 4, group, qq, operator, "groupMemberIncrease");
     return 0;
 }
 
@@ -785,59 +1169,60 @@ DllExport(int) Event_GroupMemberDecrease(
     const char* qq,         // 
     const char* operator    // 操作者QQ，仅在被管理员踢出时存在
 ) {
-    handleGroupMemberChange(type, group, qq, operator, "groupMemberDecrease");
+    postEvent(groupMemberChangeEventRun, type, 4, group, qq, operator, "groupMemberDecrease");
     return 0;
 }
 
-DllExport(int) Event_AdminChange(
-    int type,               // 1=成为管理 2=被解除管理
-    const char* group,
-    const char* qq
-) {
+void adminChangeEventRun(DispatchTask* task) {
+
+    EventTask* event = (EventTask*)task;
+    const char* group = event->args[0];
+    const char* qq    = event->args[1];
 
     cJSON* root = cJSON_CreateObject();
     cJSON_AddItemToObject(root, "event", cJSON_CreateString("adminChange"));
 
     cJSON* params = cJSON_CreateObject();
     
-    cJSON_AddItemToObject(params, "type", cJSON_CreateNumber(type));
+    cJSON_AddItemToObject(params, "type", cJSON_CreateNumber(event->type));
     cJSON_AddItemToObject(params, "group", cJSON_CreateString(group));
     cJSON_AddItemToObject(params, "qq", cJSON_CreateString(qq));
     
     cJSON_AddItemToObject(root, "params", params);
 
-    const char* jsonStr = cJSON_PrintUnformatted(root);
+    broadcastEvent(event_adminChange, root);
+
+    free(event);
+}
 
-    wsFrameSendToAll(jsonStr, strlen(jsonStr), frameType_text);
+DllExport(int) Event_AdminChange(
+    int type,               // 1=成为管理 2=被解除管理
+    const char* group,
+    const char* qq
+) {
 
-    cJSON_Delete(root);
-    free((void*)jsonStr);
+    postEvent(adminChangeEventRun, type, 2, group, qq);
 
     return 0;
 }
 
-DllExport(int) Event_AddGroup(
-    int type,               // 1=主动加群、2=某人被邀请进群、3=机器人被邀请进群
-    const char* group,      //
-    const char* qq,         //
-    const char* operator,   // 邀请者QQ，主动加群时不存在
-    const char* message,    // 加群附加消息，只有主动加群时存在
-    const char* seq         // seq，同意加群时需要用到
-) {
+void addGroupEventRun(DispatchTask* task) {
 
-    // 将可能为NULL的字符串指针参数修改为空字符串
-    operator = operator ? operator : "";
-    message  = message  ? message  : "";
-    seq      = seq      ? seq      : "";
+    EventTask* event = (EventTask*)task;
+    const char* group    = event->args[0];
+    const char* qq       = event->args[1];
+    const char* operator = event->args[2];
+    const char* message  = event->args[3];
+    const char* seq      = event->args[4];
 
     cJSON* root = cJSON_CreateObject();
     cJSON_AddItemToObject(root, "event", cJSON_CreateString("groupRequest"));
 
     cJSON* params = cJSON_CreateObject();
 
-    const char* u8Message = GBKToUTF8(message ? message : "");
+    const char* u8Message = GBKToUTF8(message);
     
-    cJSON_AddItemToObject(params, "type", cJSON_CreateNumber(type));
+    cJSON_AddItemToObject(params, "type", cJSON_CreateNumber(event->type));
     cJSON_AddItemToObject(params, "group", cJSON_CreateString(group));
     cJSON_AddItemToObject(params, "qq", cJSON_CreateString(qq));
     cJSON_AddItemToObject(params, "operator", cJSON_CreateString(operator));
@@ -846,37 +1231,42 @@ DllExport(int) Event_AddGroup(
     
     cJSON_AddItemToObject(root, "params", params);
 
-    const char* jsonStr = cJSON_PrintUnformatted(root);
+    broadcastEvent(event_groupRequest, root);
 
-    wsFrameSendToAll(jsonStr, strlen(jsonStr), frameType_text);
-
-    cJSON_Delete(root);
     free((void*)u8Message);
-    free((void*)jsonStr);
+    free(event);
+}
+
+DllExport(int) Event_AddGroup(
+    int type,               // 1=主动加群、2=某人被邀请进群、3=机器人被邀请进群
+    const char* group,      //
+    const char* qq,         //
+    const char* operator,   // 邀请者QQ，主动加群时不存在
+    const char* message,    // 加群附加消息，只有主动加群时存在
+    const char* seq         // seq，同意加群时需要用到
+) {
+
+    postEvent(addGroupEventRun, type, 5, group, qq, operator, message, seq);
 
     return 0;
 }
 
-DllExport(int) Event_GetQQWalletData(
-    int type,               // 1=好友转账、2=群临时会话转账、3=讨论组临时会话转账
-    const char* group,      // type为1时此参数为空，type为2、3时分别为群号或讨论组号
-    const char* qq,         // 转账者QQ
-    const char* amount,     // 转账金额
-    const char* message,    // 转账备注消息
-    const char* id          // 转账订单号
-) {
+void qqWalletEventRun(DispatchTask* task) {
 
-    // 将可能为NULL的字符串指针参数修改为空字符串
-    group     = group    ? group    : "";
-    message   = message  ? message  : "";
+    EventTask* event = (EventTask*)task;
+    const char* group   = event->args[0];
+    const char* qq      = event->args[1];
+    const char* amount  = event->args[2];
+    const char* message = event->args[3];
+    const char* id      = event->args[4];
 
     cJSON* root = cJSON_CreateObject();
     cJSON_AddItemToObject(root, "event", cJSON_CreateString("receiveMoney"));
     
     cJSON* params = cJSON_CreateObject();
-    const char* u8Message = GBKToUTF8(message ? message : "");
+    const char* u8Message = GBKToUTF8(message);
 
-    cJSON_AddItemToObject(params, "type", cJSON_CreateNumber(type));
+    cJSON_AddItemToObject(params, "type", cJSON_CreateNumber(event->type));
     cJSON_AddItemToObject(params, "group", cJSON_CreateString(group));
     cJSON_AddItemToObject(params, "qq", cJSON_CreateString(qq));
     cJSON_AddItemToObject(params, "amount", cJSON_CreateString(amount));
@@ -885,13 +1275,22 @@ DllExport(int) Event_GetQQWalletData(
     
     cJSON_AddItemToObject(root, "params", params);
 
-    const char* jsonStr = cJSON_PrintUnformatted(root);
-
-    wsFrameSendToAll(jsonStr, strlen(jsonStr), frameType_text);
+    broadcastEvent(event_receiveMoney, root);
 
-    cJSON_Delete(root);
     free((void*)u8Message);
-    free((void*)jsonStr);
+    free(event);
+}
+
+DllExport(int) Event_GetQQWalletData(
+    int type,               // 1=好友转账、2=群临时会话转账、3=讨论组临时会话转账
+    const char* group,      // type为1时此参数为空，type为2、3时分别为群号或讨论组号
+    const char* qq,         // 转账者QQ
+    const char* amount,     // 转账金额
+    const char* message,    // 转账备注消息
+    const char* id          // 转账订单号
+) {
+
+    postEvent(qqWalletEventRun, type, 5, group, qq, amount, message, id);
 
     return 0;
 }
@@ -900,6 +1299,11 @@ BOOL APIENTRY DllMain(HANDLE hModule, DWORD  ul_reason_for_call, LPVOID lpReserv
     int errorLine;
     char message[256];
 
+    // 在任何导出函数被调用之前初始化
+    if(ul_reason_for_call == DLL_PROCESS_ATTACH) {
+        mutexInit(&hostMutex);
+    }
+
     if(loadQQLightAPI(&errorLine) != 0) {
         sprintf(message, "The message.dll load failed. l=%d", errorLine);
         MessageBox(NULL, message, "error", MB_OK);
@@ -0,0 +1,274 @@
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include "platform.h"
+#include "methods.h"
+#include "methodhash.h"
+
+// methodhash.h与methods.def不一致时编译失败，需要重新运行genmethods
+typedef char methodHashOutdated[METHOD_HASH_COUNT == rpcMethod_count && PARAM_HASH_COUNT == rpcParam_count ? 1 : -1];
+
+// 参数集合用32位的位掩码表示
+typedef char tooManyParams[rpcParam_count <= 32 ? 1 : -1];
+
+typedef struct MethodName {
+    const char* name;
+    size_t len;
+} MethodName;
+
+static const MethodName methodNames[] = {
+#define RPC_PARAM(name, kind)
+#define RPC_METHOD(name, ...) { #name, sizeof(#name) - 1 },
+#include "methods.def"
+#undef RPC_PARAM
+#undef RPC_METHOD
+};
+
+typedef enum ParamKind {
+    paramKind_int,
+    paramKind_string,
+    paramKind_bool
+} ParamKind;
+
+typedef struct ParamInfo {
+    const char* name;
+    size_t len;
+    ParamKind kind;
+    size_t offset;          // 在RpcParams中的偏移量
+} ParamInfo;
+
+static const ParamInfo paramInfos[] = {
+#define RPC_PARAM(name, kind) { #name, sizeof(#name) - 1, paramKind_##kind, offsetof(RpcParams, name) },
+#define RPC_METHOD(name, ...)
+#include "methods.def"
+#undef RPC_PARAM
+#undef RPC_METHOD
+};
+
+typedef struct MethodSchema {
+    uint32_t required;      // 必需的参数
+    uint32_t anyOf;         // 至少需要其中之一的参数，0代表没有这项要求
+    uint32_t accepted;      // 所有声明过的参数
+} MethodSchema;
+
+static const MethodSchema schemas[] = {
+#define RPC_PARAM(name, kind)
+#define RPC_METHOD(name, required, anyOf, optional) { required, anyOf, (required) | (anyOf) | (optional) },
+#include "methods.def"
+#undef RPC_PARAM
+#undef RPC_METHOD
+};
+
+typedef struct MethodCounters {
+    AtomicInt64 calls;
+    AtomicInt64 lookupNanos;
+    AtomicInt64 handleNanos;
+} MethodCounters;
+
+// 最后一项为不存在的接口
+static MethodCounters counters[rpcMethod_count + 1];
+
+int methodLookup(const char* name, size_t len) {
+
+    uint32_t slot = methodHash(name, len, METHOD_HASH_SEED) & ((1u << METHOD_HASH_BITS) - 1);
+    int id = methodSlots[slot];
+
+    // 不在表中的名称也可能落在被占用的槽位，需要再比较一次
+    if(id < 0 || methodNames[id].len != len || memcmp(methodNames[id].name, name, len) != 0) {
+        return -1;
+    }
+
+    return id;
+}
+
+const char* methodName(int id) {
+    return id >= 0 && id < rpcMethod_count ? methodNames[id].name : NULL;
+}
+
+static int paramLookup(const char* name, size_t len) {
+
+    uint32_t slot = methodHash(name, len, PARAM_HASH_SEED) & ((1u << PARAM_HASH_BITS) - 1);
+    int id = paramSlots[slot];
+
+    if(id < 0 || paramInfos[id].len != len || memcmp(paramInfos[id].name, name, len) != 0) {
+        return -1;
+    }
+
+    return id;
+}
+
+static const char* const kindNames[] = { "Number", "String", "Boolean" };
+
+// 检查必需的参数及至少需要其中之一的参数
+static bool checkRequired(const MethodSchema* schema, const RpcParams* params, char* error, size_t errorSize) {
+
+    uint32_t missing = schema->required & ~params->present;
+
+    if(missing) {
+        snprintf(error, errorSize, "Missing '%s' Parameter", paramInfos[__builtin_ctz(missing)].name);
+        return false;
+    }
+
+    // 列出其中的每一个参数，例如Missing 'group' or 'qq' Parameter
+    if(schema->anyOf && !(params->present & schema->anyOf)) {
+
+        size_t len = snprintf(error, errorSize, "Missing ");
+
+        for(uint32_t rest = schema->anyOf; rest && len < errorSize; rest &= rest - 1) {
+            const char* separator = rest == schema->anyOf ? "" : " or ";
+            len += snprintf(error + len, errorSize - len, "%s'%s'", separator, paramInfos[__builtin_ctz(rest)].name);
+        }
+
+        if(len < errorSize) {
+            snprintf(error + len, errorSize - len, " Parameter");
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+// 名称为name的参数需要绑定时返回参数编号，未声明或已经绑定过时返回-1
+static int acceptParam(const MethodSchema* schema, const RpcParams* params, const char* name, size_t len) {
+
+    int param = paramLookup(name, len);
+
+    if(param < 0 || !(schema->accepted & (1u << param)) || (params->present & (1u << param))) {
+        return -1;
+    }
+
+    return param;
+}
+
+static void invalidParam(int param, char* error, size_t errorSize) {
+    const ParamInfo* info = &paramInfos[param];
+    snprintf(error, errorSize, "Invalid '%s' Parameter, %s Expected", info->name, kindNames[info->kind]);
+}
+
+bool methodBindParams(int id, const cJSON* j_params, RpcParams* params, char* error, size_t errorSize) {
+
+    const MethodSchema* schema = &schemas[id];
+
+    memset(params, 0, sizeof(RpcParams));
+
+    if(j_params && !cJSON_IsNull(j_params) && !cJSON_IsObject(j_params)) {
+        snprintf(error, errorSize, "Invalid 'params' Field");
+        return false;
+    }
+
+    // 没有声明参数的接口不需要遍历
+    const cJSON* item = schema->accepted && j_params ? j_params->child : NULL;
+
+    for(; item; item = item->next) {
+
+        int param = acceptParam(schema, params, item->string, strlen(item->string));
+
+        if(param < 0) {
+            continue;
+        }
+
+        const ParamInfo* info = &paramInfos[param];
+        char* field = (char*)params + info->offset;
+        bool valid = false;
+
+        switch(info->kind) {
+            case paramKind_int:
+                if((valid = cJSON_IsNumber(item))) *(int*)field = item->valueint;
+                break;
+            case paramKind_string:
+                if((valid = cJSON_IsString(item))) *(const char**)field = item->valuestring;
+                break;
+            case paramKind_bool:
+                if((valid = cJSON_IsBool(item))) *(bool*)field = cJSON_IsTrue(item);
+                break;
+        }
+
+        if(!valid) {
+            invalidParam(param, error, errorSize);
+            return false;
+        }
+
+        params->present |= 1u << param;
+    }
+
+    return checkRequired(schema, params, error, errorSize);
+}
+
+bool methodBindTapeParams(int id, JsonTape* tape, int index, RpcParams* params, char* error, size_t errorSize) {
+
+    const MethodSchema* schema = &schemas[id];
+
+    memset(params, 0, sizeof(RpcParams));
+
+    if(index >= 0 && tape->entries[index].type != tapeType_null && tape->entries[index].type != tapeType_object) {
+        snprintf(error, errorSize, "Invalid 'params' Field");
+        return false;
+    }
+
+    // 对象的成员按键、值的顺序排列，值为容器时整体跳过
+    int end = schema->accepted && index >= 0 && tape->entries[index].type == tapeType_object ? (int)tape->entries[index].end : 0;
+
+    for(int key = index + 1; key < end; key = jsonTapeNext(tape, key + 1)) {
+
+        size_t len;
+        const char* name = jsonTapeString(tape, key, &len);
+
+        // 与jsonTapeFind一致，转义序列错误的键不与任何参数名匹配
+        int param = name ? acceptParam(schema, params, name, len) : -1;
+
+        if(param < 0) {
+            continue;
+        }
+
+        const ParamInfo* info = &paramInfos[param];
+        char* field = (char*)params + info->offset;
+        int value = key + 1;
+        TapeType type = tape->entries[value].type;
+        bool valid = false;
+
+        switch(info->kind) {
+            case paramKind_int:
+                // 与cJSON的valueint一致，超出范围时取最大或最小值
+                if((valid = type == tapeType_number)) {
+                    double number = jsonTapeNumber(tape, value);
+                    *(int*)field = number >= INT_MAX ? INT_MAX : number <= (double)INT_MIN ? INT_MIN : (int)number;
+                }
+                break;
+            case paramKind_string:
+                // 字符串参数在这里才解码，转义序列错误的字符串同样视为类型错误
+                if((valid = type == tapeType_string)) valid = (*(const char**)field = jsonTapeString(tape, value, NULL)) != NULL;
+                break;
+            case paramKind_bool:
+                if((valid = type == tapeType_true || type == tapeType_false)) *(bool*)field = type == tapeType_true;
+                break;
+        }
+
+        if(!valid) {
+            invalidParam(param, error, errorSize);
+            return false;
+        }
+
+        params->present |= 1u << param;
+    }
+
+    return checkRequired(schema, params, error, errorSize);
+}
+
+void methodRecord(int id, uint64_t lookupNanos, uint64_t handleNanos) {
+
+    MethodCounters* c = &counters[id < 0 ? rpcMethod_count : id];
+
+    atomicAdd64(&c->calls, 1);
+    atomicAdd64(&c->lookupNanos, (int64_t)lookupNanos);
+    atomicAdd64(&c->handleNanos, (int64_t)handleNanos);
+}
+
+void methodGetStats(int id, MethodStats* stats) {
+
+    MethodCounters* c = &counters[id < 0 ? rpcMethod_count : id];
+
+    stats->calls = (uint64_t)atomicLoad64(&c->calls);
+    stats->lookupNanos = (uint64_t)atomicLoad64(&c->lookupNanos);
+    stats->handleNanos = (uint64_t)atomicLoad64(&c->handleNanos);
+}
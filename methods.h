@@ -0,0 +1,93 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "lib/cjson/cJSON.h"
+#include "jsontape.h"
+
+#ifndef QLWS_METHODS_H
+
+#define QLWS_METHODS_H
+
+// 接口表、接口名查找及参数绑定
+// 接口及其参数在methods.def中声明，构建时genmethods为接口名及参数名生成无冲突的哈希表methodhash.h
+// 查找时只计算一次哈希并比较一次字符串，与接口数量及接口在表中的位置无关
+
+// 参数编号，即参数在methods.def参数表中的顺序
+typedef enum RpcParam {
+#define RPC_PARAM(name, kind) rpcParam_##name,
+#define RPC_METHOD(name, ...)
+#include "methods.def"
+#undef RPC_PARAM
+#undef RPC_METHOD
+    rpcParam_count
+} RpcParam;
+
+#define PARAM(name) (1u << rpcParam_##name)
+
+// 接口编号，即接口在methods.def接口表中的顺序
+typedef enum RpcMethodId {
+#define RPC_PARAM(name, kind)
+#define RPC_METHOD(name, ...) rpcMethod_##name,
+#include "methods.def"
+#undef RPC_PARAM
+#undef RPC_METHOD
+    rpcMethod_count
+} RpcMethodId;
+
+// 参数表中的类型对应的C类型
+#define RPC_TYPE_int    int
+#define RPC_TYPE_string const char*
+#define RPC_TYPE_bool   bool
+
+// 绑定后的接口参数，每个参数一个字段，present中为请求中带有的参数（PARAM(name)位），其余字段为0
+// 字符串指向请求的解析结果，在处理函数返回前有效
+typedef struct RpcParams {
+    uint32_t present;
+#define RPC_PARAM(name, kind) RPC_TYPE_##kind name;
+#define RPC_METHOD(name, ...)
+#include "methods.def"
+#undef RPC_PARAM
+#undef RPC_METHOD
+} RpcParams;
+
+// 接口名及参数名的哈希函数，genmethods与methodLookup、methodBindParams共用
+// seed由genmethods分别为接口名和参数名选取，使同一张表中所有名称的哈希值取低位后互不相同
+static inline uint32_t methodHash(const char* name, size_t len, uint32_t seed) {
+
+    uint32_t h = seed ^ (uint32_t)len;
+
+    for(size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 0X01000193;
+    }
+
+    return h ^ (h >> 16);
+}
+
+// 查找长度为len的接口名，返回接口编号，不存在时返回-1
+int methodLookup(const char* name, size_t len);
+
+const char* methodName(int id);
+
+// 按接口id的参数声明遍历一次请求中的params对象，将声明过的参数按类型存入params
+// params字段不存在或为null时视为没有参数，未声明的参数被忽略，同名参数只取第一个
+// 缺少参数或参数类型错误时返回false，error中为指出具体参数的错误信息
+bool methodBindParams(int id, const cJSON* j_params, RpcParams* params, char* error, size_t errorSize);
+
+// 同methodBindParams，从tape中下标为index的params项绑定，index为-1时视为没有参数
+// 只有绑定的字符串参数及遍历经过的键会被解码，字符串参数指向tape的数据
+bool methodBindTapeParams(int id, JsonTape* tape, int index, RpcParams* params, char* error, size_t errorSize);
+
+// 每个接口的调用统计，耗时为累计值，单位为纳秒
+typedef struct MethodStats {
+    uint64_t calls;
+    uint64_t lookupNanos;       // 查找接口名的耗时
+    uint64_t handleNanos;       // 绑定参数及执行处理函数的耗时
+} MethodStats;
+
+// 记录一次调用，id为-1代表不存在的接口，此时handleNanos应为0，可以在任意线程调用
+void methodRecord(int id, uint64_t lookupNanos, uint64_t handleNanos);
+
+// 读取一个接口的统计，id为-1时读取所有不存在的接口的合计
+void methodGetStats(int id, MethodStats* stats);
+
+#endif
@@ -0,0 +1,56 @@
+#include "platform.h"
+#include <stddef.h>
+#include "mpsc.h"
+
+void mpscInit(MpscQueue* queue) {
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
+
+void mpscPush(MpscQueue* queue, MpscNode* node) {
+
+    node->next = NULL;
+
+    // 先抢占队尾位置，再把前一个节点链接到自己
+    // 两步之间队列处于断开状态，消费者会看到队列暂时为空
+    MpscNode* prev = atomicExchangePtr((void* volatile*)&queue->head, node);
+    atomicStorePtr((void* volatile*)&prev->next, node);
+}
+
+MpscNode* mpscPop(MpscQueue* queue) {
+
+    MpscNode* tail = queue->tail;
+    MpscNode* next = atomicLoadPtr((void* volatile*)&tail->next);
+
+    // 跳过占位节点
+    if(tail == &queue->stub) {
+        if(next == NULL) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = atomicLoadPtr((void* volatile*)&next->next);
+    }
+
+    if(next) {
+        queue->tail = next;
+        return tail;
+    }
+
+    // tail是最后一个节点，或者有生产者正在链接tail之后的节点
+    if(tail != atomicLoadPtr((void* volatile*)&queue->head)) {
+        return NULL;
+    }
+
+    // 重新放入占位节点，使tail可以被取出
+    mpscPush(queue, &queue->stub);
+
+    next = atomicLoadPtr((void* volatile*)&tail->next);
+    if(next) {
+        queue->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,28 @@
+#include "platform.h"
+
+#ifndef QLWS_MPSC_H
+
+#define QLWS_MPSC_H
+
+// 无锁的多生产者单消费者侵入式队列（Dmitry Vyukov的算法）
+// 任意线程都可以调用mpscPush，只有一个线程可以调用mpscPop
+// 入队只有一次原子交换，不需要加锁也不会阻塞生产者
+
+typedef struct MpscNode {
+    struct MpscNode* volatile next;
+} MpscNode;
+
+typedef struct MpscQueue {
+    MpscNode* volatile head;    // 生产者一端
+    MpscNode*          tail;    // 消费者一端
+    MpscNode           stub;
+} MpscQueue;
+
+void mpscInit(MpscQueue* queue);
+void mpscPush(MpscQueue* queue, MpscNode* node);
+
+// 队列为空时返回NULL
+// 有生产者正在入队时也可能暂时返回NULL，该生产者完成入队后即可取出
+MpscNode* mpscPop(MpscQueue* queue);
+
+#endif
@@ -0,0 +1,332 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "msgpack.h"
+
+// 解码时允许的最大嵌套深度，与cJSON解析JSON时的限制相同
+#define MSGPACK_NESTING_LIMIT CJSON_NESTING_LIMIT
+
+// 编码输出缓冲区，空间不足时按两倍扩大
+typedef struct PackBuffer {
+    unsigned char* data;
+    size_t len;
+    size_t capacity;
+    bool failed;        // 内存不足，之后的写入都被忽略
+} PackBuffer;
+
+static unsigned char* reserve(PackBuffer* buffer, size_t len) {
+
+    if(buffer->failed) {
+        return NULL;
+    }
+
+    if(buffer->len + len > buffer->capacity) {
+        size_t capacity = buffer->capacity * 2;
+        while(capacity < buffer->len + len) capacity *= 2;
+        unsigned char* data = realloc(buffer->data, capacity);
+        if(data == NULL) {
+            buffer->failed = true;
+            return NULL;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+
+    unsigned char* p = buffer->data + buffer->len;
+    buffer->len += len;
+    return p;
+}
+
+// 写入类型字节及size字节的大端序数值
+static void putTagged(PackBuffer* buffer, unsigned char tag, uint64_t value, int size) {
+
+    unsigned char* p = reserve(buffer, 1 + size);
+    if(p == NULL) {
+        return;
+    }
+
+    p[0] = tag;
+    for(int i = 0; i < size; i++) {
+        p[1 + i] = (unsigned char)(value >> (8 * (size - 1 - i)));
+    }
+}
+
+// 按长度选择fix、8、16、32位长度的类型字节，fixLimit为0代表该类型没有8位长度的形式
+static void putLength(PackBuffer* buffer, size_t len, unsigned char fixTag, size_t fixLimit, unsigned char tag8) {
+    if(len < fixLimit) {
+        putTagged(buffer, fixTag | (unsigned char)len, 0, 0);
+    } else if(tag8 && len < 0X100) {
+        putTagged(buffer, tag8, len, 1);
+    } else if(len < 0X10000) {
+        putTagged(buffer, tag8 ? tag8 + 1 : fixTag == 0X90 ? 0XDC : 0XDE, len, 2);
+    } else {
+        putTagged(buffer, tag8 ? tag8 + 2 : fixTag == 0X90 ? 0XDD : 0XDF, len, 4);
+    }
+}
+
+static void putString(PackBuffer* buffer, const char* str) {
+
+    size_t len = strlen(str);
+    putLength(buffer, len, 0XA0, 32, 0XD9);
+
+    unsigned char* p = reserve(buffer, len);
+    if(p) {
+        memcpy(p, str, len);
+    }
+}
+
+static void putNumber(PackBuffer* buffer, double value) {
+
+    // 超出64位整数范围或带小数的数字编码为float 64
+    if(value != floor(value) || value < -9223372036854775808.0 || value >= 18446744073709551616.0) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        putTagged(buffer, 0XCB, bits, 8);
+        return;
+    }
+
+    if(value >= 0) {
+        uint64_t n = (uint64_t)value;
+        if(n < 0X80)                    putTagged(buffer, (unsigned char)n, 0, 0);
+        else if(n < 0X100)              putTagged(buffer, 0XCC, n, 1);
+        else if(n < 0X10000)            putTagged(buffer, 0XCD, n, 2);
+        else if(n < 0X100000000)        putTagged(buffer, 0XCE, n, 4);
+        else                            putTagged(buffer, 0XCF, n, 8);
+    } else {
+        int64_t n = (int64_t)value;
+        if(n >= -32)                    putTagged(buffer, (unsigned char)n, 0, 0);
+        else if(n >= INT8_MIN)          putTagged(buffer, 0XD0, (uint64_t)n, 1);
+        else if(n >= INT16_MIN)         putTagged(buffer, 0XD1, (uint64_t)n, 2);
+        else if(n >= INT32_MIN)         putTagged(buffer, 0XD2, (uint64_t)n, 4);
+        else                            putTagged(buffer, 0XD3, (uint64_t)n, 8);
+    }
+}
+
+static void putItem(PackBuffer* buffer, const cJSON* item) {
+
+    switch(item->type & 0XFF) {
+
+        case cJSON_False:   putTagged(buffer, 0XC2, 0, 0); break;
+        case cJSON_True:    putTagged(buffer, 0XC3, 0, 0); break;
+        case cJSON_Number:  putNumber(buffer, item->valuedouble); break;
+        case cJSON_String:
+        case cJSON_Raw:     putString(buffer, item->valuestring ? item->valuestring : ""); break;
+
+        case cJSON_Array:
+        case cJSON_Object: {
+            bool object = (item->type & 0XFF) == cJSON_Object;
+            putLength(buffer, cJSON_GetArraySize(item), object ? 0X80 : 0X90, 16, 0);
+            for(const cJSON* child = item->child; child; child = child->next) {
+                if(object) {
+                    putString(buffer, child->string ? child->string : "");
+                }
+                putItem(buffer, child);
+            }
+            break;
+        }
+
+        default:            putTagged(buffer, 0XC0, 0, 0); break;
+    }
+}
+
+char* msgpackEncode(const cJSON* item, int* len) {
+
+    PackBuffer buffer = { malloc(256), 0, 256, false };
+
+    if(buffer.data == NULL) {
+        return NULL;
+    }
+
+    putItem(&buffer, item);
+
+    if(buffer.failed) {
+        free(buffer.data);
+        return NULL;
+    }
+
+    *len = (int)buffer.len;
+    return (char*)buffer.data;
+}
+
+// 解码位置，出错时将p设为NULL
+typedef struct UnpackCursor {
+    const unsigned char* p;
+    const unsigned char* end;
+} UnpackCursor;
+
+// 读取size字节的大端序数值
+static bool getUint(UnpackCursor* cursor, int size, uint64_t* value) {
+
+    if(cursor->end - cursor->p < size) {
+        return false;
+    }
+
+    *value = 0;
+    for(int i = 0; i < size; i++) {
+        *value = (*value << 8) | cursor->p[i];
+    }
+    cursor->p += size;
+
+    return true;
+}
+
+// 读取长度为len的字符串，返回malloc申请的以'\0'结尾的拷贝
+static char* getString(UnpackCursor* cursor, uint64_t len) {
+
+    if((uint64_t)(cursor->end - cursor->p) < len) {
+        return NULL;
+    }
+
+    char* str = malloc(len + 1);
+    if(str) {
+        memcpy(str, cursor->p, len);
+        str[len] = '\0';
+        cursor->p += len;
+    }
+
+    return str;
+}
+
+static cJSON* getItem(UnpackCursor* cursor, int depth);
+
+// 读取count个元素（map为count对键值）
+static cJSON* getContainer(UnpackCursor* cursor, uint64_t count, bool object, int depth) {
+
+    // 每个元素至少占一个字节，元素数不可能超过剩余的字节数
+    if(depth >= MSGPACK_NESTING_LIMIT || count > (uint64_t)(cursor->end - cursor->p)) {
+        return NULL;
+    }
+
+    cJSON* container = object ? cJSON_CreateObject() : cJSON_CreateArray();
+    if(container == NULL) {
+        return NULL;
+    }
+
+    for(uint64_t i = 0; i < count; i++) {
+
+        char* key = NULL;
+
+        if(object) {
+            // 键只能是字符串
+            uint64_t keyLen;
+            unsigned char tag = cursor->p < cursor->end ? *cursor->p++ : 0XC1;
+            if((tag & 0XE0) == 0XA0) {
+                keyLen = tag & 0X1F;
+            } else if(tag < 0XD9 || tag > 0XDB || !getUint(cursor, 1 << (tag - 0XD9), &keyLen)) {
+                goto getContainerError;
+            }
+            if((key = getString(cursor, keyLen)) == NULL) {
+                goto getContainerError;
+            }
+        }
+
+        cJSON* child = getItem(cursor, depth + 1);
+        if(child == NULL) {
+            free(key);
+            goto getContainerError;
+        }
+
+        if(object) {
+            cJSON_AddItemToObject(container, key, child);
+            free(key);
+        } else {
+            cJSON_AddItemToArray(container, child);
+        }
+    }
+
+    return container;
+
+getContainerError:
+    cJSON_Delete(container);
+    return NULL;
+}
+
+static cJSON* getItem(UnpackCursor* cursor, int depth) {
+
+    if(cursor->p >= cursor->end) {
+        return NULL;
+    }
+
+    unsigned char tag = *cursor->p++;
+    uint64_t value;
+
+    if(tag < 0X80)  return cJSON_CreateNumber(tag);
+    if(tag >= 0XE0) return cJSON_CreateNumber((int8_t)tag);
+    if(tag < 0X90)  return getContainer(cursor, tag & 0X0F, true, depth);
+    if(tag < 0XA0)  return getContainer(cursor, tag & 0X0F, false, depth);
+
+    if(tag < 0XC0 || (tag >= 0XD9 && tag <= 0XDB)) {
+        if(tag < 0XC0) {
+            value = tag & 0X1F;
+        } else if(!getUint(cursor, 1 << (tag - 0XD9), &value)) {
+            return NULL;
+        }
+        char* str = getString(cursor, value);
+        if(str == NULL) {
+            return NULL;
+        }
+        cJSON* item = cJSON_CreateString(str);
+        free(str);
+        return item;
+    }
+
+    switch(tag) {
+
+        case 0XC0: return cJSON_CreateNull();
+        case 0XC2: return cJSON_CreateFalse();
+        case 0XC3: return cJSON_CreateTrue();
+
+        case 0XCA: {
+            float f;
+            uint32_t bits;
+            if(!getUint(cursor, 4, &value)) return NULL;
+            bits = (uint32_t)value;
+            memcpy(&f, &bits, sizeof(f));
+            return cJSON_CreateNumber(f);
+        }
+
+        case 0XCB: {
+            double d;
+            if(!getUint(cursor, 8, &value)) return NULL;
+            memcpy(&d, &value, sizeof(d));
+            return cJSON_CreateNumber(d);
+        }
+
+        case 0XCC: case 0XCD: case 0XCE: case 0XCF:
+            if(!getUint(cursor, 1 << (tag - 0XCC), &value)) return NULL;
+            return cJSON_CreateNumber((double)value);
+
+        case 0XD0: if(!getUint(cursor, 1, &value)) return NULL; return cJSON_CreateNumber((int8_t)value);
+        case 0XD1: if(!getUint(cursor, 2, &value)) return NULL; return cJSON_CreateNumber((int16_t)value);
+        case 0XD2: if(!getUint(cursor, 4, &value)) return NULL; return cJSON_CreateNumber((int32_t)value);
+        case 0XD3: if(!getUint(cursor, 8, &value)) return NULL; return cJSON_CreateNumber((double)(int64_t)value);
+
+        case 0XDC: case 0XDD:
+            if(!getUint(cursor, tag == 0XDC ? 2 : 4, &value)) return NULL;
+            return getContainer(cursor, value, false, depth);
+
+        case 0XDE: case 0XDF:
+            if(!getUint(cursor, tag == 0XDE ? 2 : 4, &value)) return NULL;
+            return getContainer(cursor, value, true, depth);
+
+        // bin、ext及保留的0XC1在cJSON中没有对应的类型
+        default:
+            return NULL;
+    }
+}
+
+cJSON* msgpackDecode(const char* data, size_t len) {
+
+    UnpackCursor cursor = { (const unsigned char*)data, (const unsigned char*)data + len };
+
+    cJSON* item = getItem(&cursor, 0);
+
+    if(item && cursor.p != cursor.end) {
+        cJSON_Delete(item);
+        return NULL;
+    }
+
+    return item;
+}
@@ -0,0 +1,18 @@
+#include <stddef.h>
+#include "lib/cjson/cJSON.h"
+
+#ifndef QLWS_MSGPACK_H
+
+#define QLWS_MSGPACK_H
+
+// cJSON与MessagePack之间的转换，用于协商了qlws.msgpack.v1子协议的连接
+// 请求解码为cJSON后与JSON请求走同一条处理路径，事件及回复由同一棵cJSON树编码
+
+// 将item编码为MessagePack，返回malloc申请的数据，len为编码后的长度，内存不足时返回NULL
+// 整数值的数字编码为整数，其它数字编码为float 64
+char* msgpackEncode(const cJSON* item, int* len);
+
+// 解码data中的一个完整的值，格式错误、末尾有多余数据或含有bin、ext类型及非字符串的map键时返回NULL
+cJSON* msgpackDecode(const char* data, size_t len);
+
+#endif
@@ -0,0 +1,353 @@
+#include "platform.h"
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <time.h>
+#include <sched.h>
+#endif
+
+int socketStartup(void) {
+#ifdef _WIN32
+    WSADATA wsaData;
+    return WSAStartup(MAKEWORD(2, 2), &wsaData);
+#else
+    return 0;
+#endif
+}
+
+void socketCleanup(void) {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+int socketSetNonBlocking(SOCKET socket) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(socket, FIONBIO, &mode) == 0 ? 0 : -1;
+#else
+    int flags = fcntl(socket, F_GETFL, 0);
+    if(flags == -1) {
+        return -1;
+    }
+    return fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0 ? 0 : -1;
+#endif
+}
+
+bool socketWouldBlock(void) {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+bool socketAcceptAborted(void) {
+#ifdef _WIN32
+    int error = WSAGetLastError();
+    return error == WSAECONNRESET || error == WSAEINTR;
+#else
+    return errno == ECONNABORTED || errno == EINTR || errno == EPROTO;
+#endif
+}
+
+int socketWritev(SOCKET socket, IoVec* vec, int count, bool more) {
+#ifdef _WIN32
+    // Winsock没有对应的标志，more被忽略
+    DWORD sent;
+    if(WSASend(socket, vec, count, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+        return SOCKET_ERROR;
+    }
+    return (int)sent;
+#else
+    // 使用sendmsg而不是writev，以便通过MSG_NOSIGNAL避免对端关闭时产生SIGPIPE
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = count;
+    int flags = MSG_NOSIGNAL;
+#ifdef MSG_MORE
+    if(more) {
+        flags |= MSG_MORE;
+    }
+#endif
+    ssize_t sent = sendmsg(socket, &msg, flags);
+    return sent < 0 ? SOCKET_ERROR : (int)sent;
+#endif
+}
+
+int socketSend(SOCKET socket, const char* buff, int len) {
+#ifdef _WIN32
+    return send(socket, buff, len, 0);
+#else
+    return send(socket, buff, len, MSG_NOSIGNAL);
+#endif
+}
+
+uint64_t clockMicros(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if(frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000
+         + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+uint64_t clockNanos(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if(frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000000
+         + (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000000 / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+typedef struct {
+    void (*proc)(void*);
+    void* arg;
+} ThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI threadTrampoline(LPVOID param) {
+#else
+static void* threadTrampoline(void* param) {
+#endif
+    ThreadStart start = *(ThreadStart*)param;
+    free(param);
+    start.proc(start.arg);
+    return 0;
+}
+
+int threadCreate(Thread* thread, void (*proc)(void*), void* arg) {
+
+    ThreadStart* start = malloc(sizeof(ThreadStart));
+    if(start == NULL) {
+        return -1;
+    }
+    start->proc = proc;
+    start->arg = arg;
+
+#ifdef _WIN32
+    DWORD dwThreadId;
+    *thread = CreateThread(NULL, 0, threadTrampoline, start, 0, &dwThreadId);
+    if(*thread == NULL) {
+        free(start);
+        return -1;
+    }
+#else
+    if(pthread_create(thread, NULL, threadTrampoline, start) != 0) {
+        free(start);
+        return -1;
+    }
+#endif
+
+    return 0;
+}
+
+void threadJoin(Thread thread) {
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+void threadYield(void) {
+#ifdef _WIN32
+    SwitchToThread();
+#else
+    sched_yield();
+#endif
+}
+
+ThreadId threadCurrentId(void) {
+#ifdef _WIN32
+    return GetCurrentThreadId();
+#else
+    return pthread_self();
+#endif
+}
+
+bool threadIdEqual(ThreadId a, ThreadId b) {
+#ifdef _WIN32
+    return a == b;
+#else
+    return pthread_equal(a, b) != 0;
+#endif
+}
+
+void mutexInit(Mutex* mutex) {
+#ifdef _WIN32
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, NULL);
+#endif
+}
+
+void mutexDestroy(Mutex* mutex) {
+#ifdef _WIN32
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+void mutexLock(Mutex* mutex) {
+#ifdef _WIN32
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+void mutexUnlock(Mutex* mutex) {
+#ifdef _WIN32
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+void signalInit(Signal* signal) {
+#ifdef _WIN32
+    *signal = CreateEvent(NULL, FALSE, FALSE, NULL);
+#else
+    pthread_mutex_init(&signal->mutex, NULL);
+    pthread_cond_init(&signal->cond, NULL);
+    signal->set = false;
+#endif
+}
+
+void signalDestroy(Signal* signal) {
+#ifdef _WIN32
+    CloseHandle(*signal);
+#else
+    pthread_cond_destroy(&signal->cond);
+    pthread_mutex_destroy(&signal->mutex);
+#endif
+}
+
+void signalNotify(Signal* signal) {
+#ifdef _WIN32
+    SetEvent(*signal);
+#else
+    pthread_mutex_lock(&signal->mutex);
+    signal->set = true;
+    pthread_cond_signal(&signal->cond);
+    pthread_mutex_unlock(&signal->mutex);
+#endif
+}
+
+void signalWait(Signal* signal, int timeoutMs) {
+#ifdef _WIN32
+    WaitForSingleObject(*signal, timeoutMs);
+#else
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutMs / 1000;
+    deadline.tv_nsec += (long)(timeoutMs % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&signal->mutex);
+    while(!signal->set) {
+        if(pthread_cond_timedwait(&signal->cond, &signal->mutex, &deadline) != 0) {
+            break;
+        }
+    }
+    signal->set = false;
+    pthread_mutex_unlock(&signal->mutex);
+#endif
+}
+
+long atomicAdd(AtomicLong* value, long delta) {
+#ifdef _WIN32
+    return InterlockedExchangeAdd(value, delta) + delta;
+#else
+    return __sync_add_and_fetch(value, delta);
+#endif
+}
+
+long atomicLoad(AtomicLong* value) {
+#ifdef _WIN32
+    return InterlockedCompareExchange(value, 0, 0);
+#else
+    return __sync_fetch_and_add(value, 0);
+#endif
+}
+
+long atomicExchange(AtomicLong* value, long exchange) {
+#ifdef _WIN32
+    return InterlockedExchange(value, exchange);
+#else
+    return __atomic_exchange_n(value, exchange, __ATOMIC_SEQ_CST);
+#endif
+}
+
+long atomicCompareExchange(AtomicLong* value, long exchange, long comparand) {
+#ifdef _WIN32
+    return InterlockedCompareExchange(value, exchange, comparand);
+#else
+    return __sync_val_compare_and_swap(value, comparand, exchange);
+#endif
+}
+
+void* atomicLoadPtr(void* volatile* target) {
+#ifdef _WIN32
+    return InterlockedCompareExchangePointer(target, NULL, NULL);
+#else
+    return __atomic_load_n(target, __ATOMIC_SEQ_CST);
+#endif
+}
+
+void atomicStorePtr(void* volatile* target, void* value) {
+#ifdef _WIN32
+    InterlockedExchangePointer(target, value);
+#else
+    __atomic_store_n(target, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+void* atomicExchangePtr(void* volatile* target, void* value) {
+#ifdef _WIN32
+    return InterlockedExchangePointer(target, value);
+#else
+    return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+#endif
+}
+
+int64_t atomicAdd64(AtomicInt64* value, int64_t delta) {
+#ifdef _WIN32
+    return InterlockedExchangeAdd64(value, delta) + delta;
+#else
+    return __sync_add_and_fetch(value, delta);
+#endif
+}
+
+int64_t atomicLoad64(AtomicInt64* value) {
+#ifdef _WIN32
+    return InterlockedCompareExchange64(value, 0, 0);
+#else
+    return __sync_fetch_and_add(value, 0);
+#endif
+}
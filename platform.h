@@ -0,0 +1,136 @@
+#ifndef QLWS_PLATFORM_H
+
+#define QLWS_PLATFORM_H
+
+// 该头文件需要在其它系统头文件之前被包含
+
+#ifdef _WIN32
+
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+
+typedef HANDLE Thread;
+typedef DWORD ThreadId;
+typedef CRITICAL_SECTION Mutex;
+typedef HANDLE Signal;
+typedef volatile LONG AtomicLong;
+typedef volatile LONGLONG AtomicInt64;
+
+#else
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+typedef int SOCKET;
+typedef struct sockaddr SOCKADDR;
+typedef struct sockaddr_in SOCKADDR_IN;
+typedef pthread_t Thread;
+typedef pthread_t ThreadId;
+typedef pthread_mutex_t Mutex;
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    bool            set;
+} Signal;
+typedef volatile long AtomicLong;
+typedef volatile int64_t AtomicInt64;
+
+#define INVALID_SOCKET      (-1)
+#define SOCKET_ERROR        (-1)
+#define WSAENOTSOCK         ENOTSOCK
+#define closesocket(s)      close(s)
+#define WSAGetLastError()   errno
+#define ZeroMemory(p, n)    memset((p), 0, (n))
+
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// 向量写使用的缓冲区描述，通过ioVecSet设置，注意ioVecSet的参数会被求值多次
+#ifdef _WIN32
+typedef WSABUF IoVec;
+#define ioVecSet(v, p, n) ((v)->buf = (char*)(p), (v)->len = (u_long)(n))
+#else
+typedef struct iovec IoVec;
+#define ioVecSet(v, p, n) ((v)->iov_base = (void*)(p), (v)->iov_len = (n))
+#endif
+
+// 初始化及清理socket库，Windows以外的平台为空操作
+int socketStartup(void);
+void socketCleanup(void);
+
+// 将socket设置为非阻塞模式，成功返回0
+int socketSetNonBlocking(SOCKET socket);
+
+// 上一次socket调用是否因为非阻塞模式下暂时无法完成而失败
+bool socketWouldBlock(void);
+
+// 上一次accept是否只因为排队中的一个连接已被对端中止或调用被信号中断而失败，可以接着接受下一个连接
+bool socketAcceptAborted(void);
+
+// 向量写，一次系统调用发送多个缓冲区，返回发送的字节数，出错返回SOCKET_ERROR
+// more为true代表紧接着还有数据要发送，Linux下通过MSG_MORE让内核暂缓发出不满一个报文段的尾部
+int socketWritev(SOCKET socket, IoVec* vec, int count, bool more);
+
+// 发送一个缓冲区，返回发送的字节数，出错返回SOCKET_ERROR，与socketWritev一样不会因为对端关闭产生SIGPIPE
+int socketSend(SOCKET socket, const char* buff, int len);
+
+// 单调时钟，单位为微秒，只用于计算时间间隔
+uint64_t clockMicros(void);
+
+// 单调时钟，单位为纳秒，精度取决于系统计时器，用于统计很短的耗时
+uint64_t clockNanos(void);
+
+// 创建线程，成功返回0
+int threadCreate(Thread* thread, void (*proc)(void*), void* arg);
+
+// 等待线程退出并释放线程句柄
+void threadJoin(Thread thread);
+
+// 让出当前线程的时间片，用于等待很快就会完成的操作
+void threadYield(void);
+
+ThreadId threadCurrentId(void);
+bool threadIdEqual(ThreadId a, ThreadId b);
+
+void mutexInit(Mutex* mutex);
+void mutexDestroy(Mutex* mutex);
+void mutexLock(Mutex* mutex);
+void mutexUnlock(Mutex* mutex);
+
+// 自动复位的通知，signalNotify在没有线程等待时也会被记住，直到下一次signalWait
+void signalInit(Signal* signal);
+void signalDestroy(Signal* signal);
+void signalNotify(Signal* signal);
+void signalWait(Signal* signal, int timeoutMs);
+
+// 原子地加上delta并返回相加后的值
+long atomicAdd(AtomicLong* value, long delta);
+long atomicLoad(AtomicLong* value);
+
+// 原子交换及比较交换，返回原值
+long atomicExchange(AtomicLong* value, long exchange);
+long atomicCompareExchange(AtomicLong* value, long exchange, long comparand);
+
+// 指针的原子操作，均带有完整的内存屏障
+void* atomicLoadPtr(void* volatile* target);
+void  atomicStorePtr(void* volatile* target, void* value);
+void* atomicExchangePtr(void* volatile* target, void* value);
+int64_t atomicAdd64(AtomicInt64* value, int64_t delta);
+int64_t atomicLoad64(AtomicInt64* value);
+
+#endif
@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include "pmdeflate.h"
+
+const unsigned char PMD_TAIL[4] = {0X00, 0X00, 0XFF, 0XFF};
+
+// 打印日志函数声明
+void pluginLog(const char* type, int level, const char* format, ...);
+
+// 跳过空白字符
+static const char* skipSpace(const char* cur) {
+    while(*cur == ' ' || *cur == '\t') cur++;
+    return cur;
+}
+
+// 读取一个token或带引号的字符串到buff中，返回token之后的位置
+static const char* readToken(const char* cur, char* buff, size_t size) {
+
+    size_t n = 0;
+    bool quoted = *cur == '"';
+
+    if(quoted) cur++;
+
+    while(*cur && (quoted ? *cur != '"' : (*cur != ';' && *cur != ',' && *cur != '=' && *cur != ' ' && *cur != '\t'))) {
+        if(n + 1 < size) buff[n++] = *cur;
+        cur++;
+    }
+
+    if(quoted && *cur == '"') cur++;
+
+    buff[n] = '\0';
+    return cur;
+}
+
+// 解析窗口大小参数值，不合法返回-1
+static int parseWindowBits(const char* value) {
+    if(strlen(value) != 1 && strlen(value) != 2) return -1;
+    for(const char* c = value; *c; c++) {
+        if(!isdigit((unsigned char)*c)) return -1;
+    }
+    int bits = atoi(value);
+    return bits >= 8 && bits <= 15 ? bits : -1;
+}
+
+// 解析一个提议，cur指向扩展名之后，返回该提议结束的位置（逗号或字符串末尾）
+// 提议中有未知或不合法的参数时accepted为false
+static const char* parseOffer(const char* cur, WsDeflateParams* params, bool* accepted) {
+
+    char name[64], value[64];
+    bool seen[4] = {false, false, false, false};
+
+    params->enabled = true;
+    params->serverNoContextTakeover = false;
+    params->clientNoContextTakeover = false;
+    params->serverWindowBits = 15;
+    params->clientWindowBits = 15;
+    *accepted = true;
+
+    for(;;) {
+
+        cur = skipSpace(cur);
+
+        if(*cur != ';') {
+            break;
+        }
+
+        cur = skipSpace(cur + 1);
+        cur = readToken(cur, name, sizeof(name));
+        cur = skipSpace(cur);
+
+        bool hasValue = *cur == '=';
+        value[0] = '\0';
+
+        if(hasValue) {
+            cur = readToken(skipSpace(cur + 1), value, sizeof(value));
+        }
+
+        int index;
+
+        if(strcmp(name, "server_no_context_takeover") == 0 && !hasValue) {
+            index = 0;
+            params->serverNoContextTakeover = true;
+        } else if(strcmp(name, "client_no_context_takeover") == 0 && !hasValue) {
+            index = 1;
+            params->clientNoContextTakeover = true;
+        } else if(strcmp(name, "server_max_window_bits") == 0 && hasValue) {
+            index = 2;
+            params->serverWindowBits = parseWindowBits(value);
+            // zlib的原始deflate流不支持8位窗口
+            if(params->serverWindowBits < 9) *accepted = false;
+        } else if(strcmp(name, "client_max_window_bits") == 0) {
+            // 不带值时只代表客户端支持该参数，服务器不限制客户端的窗口大小
+            index = 3;
+            if(hasValue && parseWindowBits(value) < 0) *accepted = false;
+        } else {
+            *accepted = false;
+            continue;
+        }
+
+        // 同一参数出现多次
+        if(seen[index]) *accepted = false;
+        seen[index] = true;
+    }
+
+    // 跳过提议中无法解析的剩余部分
+    while(*cur && *cur != ',') cur++;
+
+    return cur;
+}
+
+bool pmdNegotiate(const char* offers, WsDeflateParams* params, char* response, size_t responseSize) {
+
+    const char* cur = offers;
+    char name[64];
+
+    while(*cur) {
+
+        cur = skipSpace(cur);
+        cur = readToken(cur, name, sizeof(name));
+
+        bool isDeflate = strcmp(name, "permessage-deflate") == 0;
+        bool accepted;
+
+        WsDeflateParams offer;
+        cur = parseOffer(cur, &offer, &accepted);
+
+        if(isDeflate && accepted) {
+
+            *params = offer;
+
+            int n = snprintf(response, responseSize, "permessage-deflate%s%s",
+                offer.serverNoContextTakeover ? "; server_no_context_takeover" : "",
+                offer.clientNoContextTakeover ? "; client_no_context_takeover" : "");
+
+            if(offer.serverWindowBits < 15 && n > 0 && (size_t)n < responseSize) {
+                snprintf(response + n, responseSize - n, "; server_max_window_bits=%d", offer.serverWindowBits);
+            }
+
+            return true;
+        }
+
+        if(*cur == ',') cur++;
+    }
+
+    params->enabled = false;
+    return false;
+}
+
+z_stream* pmdDeflaterCreate(int windowBits) {
+
+    z_stream* strm = calloc(1, sizeof(z_stream));
+    if(strm == NULL) {
+        return NULL;
+    }
+
+    // 负的windowBits代表不带zlib头尾的原始deflate流
+    if(deflateInit2(strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        free(strm);
+        return NULL;
+    }
+
+    return strm;
+}
+
+z_stream* pmdInflaterCreate(void) {
+
+    z_stream* strm = calloc(1, sizeof(z_stream));
+    if(strm == NULL) {
+        return NULL;
+    }
+
+    if(inflateInit2(strm, -15) != Z_OK) {
+        free(strm);
+        return NULL;
+    }
+
+    return strm;
+}
+
+void pmdDeflaterDestroy(z_stream* strm) {
+    if(strm) {
+        deflateEnd(strm);
+        free(strm);
+    }
+}
+
+void pmdInflaterDestroy(z_stream* strm) {
+    if(strm) {
+        inflateEnd(strm);
+        free(strm);
+    }
+}
+
+char* pmdCompress(z_stream* strm, bool reset, const char* data, size_t len, size_t* outLen) {
+
+    if(reset && deflateReset(strm) != Z_OK) {
+        return NULL;
+    }
+
+    // Z_SYNC_FLUSH会在末尾额外输出最多几个字节的空存储块
+    size_t capacity = deflateBound(strm, len) + 16;
+    unsigned char* out = malloc(capacity);
+    if(out == NULL) {
+        return NULL;
+    }
+
+    strm->next_in = (unsigned char*)data;
+    strm->avail_in = len;
+    strm->next_out = out;
+    strm->avail_out = capacity;
+
+    int ret = deflate(strm, Z_SYNC_FLUSH);
+
+    if((ret != Z_OK && ret != Z_BUF_ERROR) || strm->avail_in != 0 || strm->avail_out == 0) {
+        free(out);
+        return NULL;
+    }
+
+    size_t produced = capacity - strm->avail_out;
+
+    // 同步刷新的输出总以0X00 0X00 0XFF 0XFF结尾，标准要求发送前去掉
+    if(produced < 4 || memcmp(out + produced - 4, PMD_TAIL, 4) != 0) {
+        free(out);
+        return NULL;
+    }
+
+    *outLen = produced - 4;
+    return (char*)out;
+}
+
+int pmdInflate(z_stream* strm, const unsigned char* data, size_t len, int (*output)(void* arg, const char* data, size_t len), void* arg) {
+
+    unsigned char out[0X4000];
+
+    strm->next_in = (unsigned char*)data;
+    strm->avail_in = len;
+
+    for(;;) {
+
+        strm->next_out = out;
+        strm->avail_out = sizeof(out);
+
+        int ret = inflate(strm, Z_SYNC_FLUSH);
+
+        if(ret != Z_OK && ret != Z_BUF_ERROR && ret != Z_STREAM_END) {
+            pluginLog("pmdInflate", 1, "Inflate failed: %d", ret);
+            return -1;
+        }
+
+        size_t produced = sizeof(out) - strm->avail_out;
+
+        if(produced > 0 && output(arg, (const char*)out, produced) != 0) {
+            return -1;
+        }
+
+        // 发送方以BFINAL块结束了deflate流，本条消息之后的数据（包括补回的结尾）都应忽略
+        // 结束状态下zlib不再消耗输入，由调用者在消息结束后重置
+        if(ret == Z_STREAM_END) {
+            return 1;
+        }
+
+        // 输出缓冲区未被填满，代表输入已经处理完
+        if(strm->avail_out != 0) {
+            break;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,35 @@
+#include "platform.h"
+#include <stddef.h>
+#include <stdbool.h>
+#include <zlib.h>
+#include "ws.h"
+
+#ifndef QLWS_PMDEFLATE_H
+
+#define QLWS_PMDEFLATE_H
+
+// permessage-deflate扩展（RFC 7692）的协商与压缩、解压
+// 每条消息压缩后去掉末尾的0X00 0X00 0XFF 0XFF，解压前补回
+
+// 从客户端的Sec-WebSocket-Extensions中选出第一个可以接受的permessage-deflate提议
+// 接受时填写params及响应头的值并返回true
+bool pmdNegotiate(const char* offers, WsDeflateParams* params, char* response, size_t responseSize);
+
+// 创建原始deflate流，windowBits为9到15
+z_stream* pmdDeflaterCreate(int windowBits);
+z_stream* pmdInflaterCreate(void);
+void pmdDeflaterDestroy(z_stream* strm);
+void pmdInflaterDestroy(z_stream* strm);
+
+// 压缩一条消息，返回申请的内存，记得free，失败返回NULL
+// reset为true时先丢弃之前消息的压缩上下文
+char* pmdCompress(z_stream* strm, bool reset, const char* data, size_t len, size_t* outLen);
+
+// 解压消息的一部分，每产生一段输出就调用一次output，output返回-1时停止并返回-1
+// 消息最后一个分片之后需要再以PMD_TAIL调用一次
+// 返回1代表发送方结束了deflate流，下一条消息开始前需要调用inflateReset
+int pmdInflate(z_stream* strm, const unsigned char* data, size_t len, int (*output)(void* arg, const char* data, size_t len), void* arg);
+
+extern const unsigned char PMD_TAIL[4];
+
+#endif
@@ -0,0 +1,407 @@
+#include "platform.h"
+#include <stdlib.h>
+#include <string.h>
+#include "poller.h"
+
+#if defined(__linux__)
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <time.h>
+
+// epoll后端，唤醒开销只与就绪的socket数量有关
+
+struct Poller {
+    int epfd;
+    int wakeFd;         // pollerWakeup通过eventfd唤醒等待中的线程
+    struct epoll_event* readyEvents;
+    int readyCapacity;
+};
+
+const char* pollerBackendName(void) {
+    return "epoll";
+}
+
+Poller* pollerCreate(void) {
+
+    Poller* poller = malloc(sizeof(Poller));
+    if(poller == NULL) {
+        return NULL;
+    }
+
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(poller->epfd == -1) {
+        free(poller);
+        return NULL;
+    }
+
+    poller->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &poller->wakeFd;
+
+    if(poller->wakeFd == -1 || epoll_ctl(poller->epfd, EPOLL_CTL_ADD, poller->wakeFd, &ev) != 0) {
+        if(poller->wakeFd != -1) close(poller->wakeFd);
+        close(poller->epfd);
+        free(poller);
+        return NULL;
+    }
+
+    poller->readyEvents = NULL;
+    poller->readyCapacity = 0;
+
+    return poller;
+}
+
+void pollerDestroy(Poller* poller) {
+    close(poller->wakeFd);
+    close(poller->epfd);
+    free(poller->readyEvents);
+    free(poller);
+}
+
+int pollerWakeup(Poller* poller) {
+    uint64_t one = 1;
+    return write(poller->wakeFd, &one, sizeof(one)) == sizeof(one) || errno == EAGAIN ? 0 : -1;
+}
+
+static uint32_t toEpollEvents(int events) {
+    uint32_t result = EPOLLET | EPOLLRDHUP;
+    if(events & pollerEvent_read)  result |= EPOLLIN;
+    if(events & pollerEvent_write) result |= EPOLLOUT;
+    return result;
+}
+
+static int epollControl(Poller* poller, int op, SOCKET socket, int events, void* data) {
+    struct epoll_event ev;
+    ev.events = toEpollEvents(events);
+    ev.data.ptr = data;
+    return epoll_ctl(poller->epfd, op, socket, &ev) == 0 ? 0 : -1;
+}
+
+int pollerAdd(Poller* poller, SOCKET socket, int events, void* data) {
+    return epollControl(poller, EPOLL_CTL_ADD, socket, events, data);
+}
+
+int pollerModify(Poller* poller, SOCKET socket, int events, void* data) {
+    return epollControl(poller, EPOLL_CTL_MOD, socket, events, data);
+}
+
+int pollerRemove(Poller* poller, SOCKET socket) {
+    struct epoll_event ev;    // 2.6.9之前的内核要求传入非NULL指针
+    return epoll_ctl(poller->epfd, EPOLL_CTL_DEL, socket, &ev) == 0 ? 0 : -1;
+}
+
+int pollerWait(Poller* poller, PollerEvent* events, int maxEvents, int64_t timeoutUs) {
+
+    if(poller->readyCapacity < maxEvents) {
+        struct epoll_event* readyEvents = realloc(poller->readyEvents, sizeof(struct epoll_event) * maxEvents);
+        if(readyEvents == NULL) {
+            return -1;
+        }
+        poller->readyEvents = readyEvents;
+        poller->readyCapacity = maxEvents;
+    }
+
+    int n = -1;
+
+    // epoll_pwait2的超时为纳秒精度，内核不支持时退回到毫秒精度的epoll_wait
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+    static volatile bool noPwait2;
+    if(!noPwait2) {
+        struct timespec ts = { (time_t)(timeoutUs / 1000000), (long)(timeoutUs % 1000000) * 1000 };
+        n = epoll_pwait2(poller->epfd, poller->readyEvents, maxEvents, timeoutUs < 0 ? NULL : &ts, NULL);
+        if(n == -1 && errno == ENOSYS) {
+            noPwait2 = true;
+        }
+    }
+    if(noPwait2)
+#endif
+    n = epoll_wait(poller->epfd, poller->readyEvents, maxEvents, timeoutUs < 0 ? -1 : (int)((timeoutUs + 999) / 1000));
+
+    if(n == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    int count = 0;
+
+    for(int i = 0; i < n; i++) {
+
+        uint32_t ev = poller->readyEvents[i].events;
+
+        // 唤醒事件不返回给调用者，读取eventfd将计数清零
+        if(poller->readyEvents[i].data.ptr == &poller->wakeFd) {
+            uint64_t value;
+            while(read(poller->wakeFd, &value, sizeof(value)) > 0);
+            continue;
+        }
+
+        events[count].data = poller->readyEvents[i].data.ptr;
+        events[count].events = 0;
+        if(ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) events[count].events |= pollerEvent_read;
+        if(ev & EPOLLOUT)                          events[count].events |= pollerEvent_write;
+        if(ev & EPOLLERR)                          events[count].events |= pollerEvent_error;
+        count++;
+    }
+
+    return count;
+}
+
+#else
+
+// select后端，每次等待都需要遍历所有已注册的socket
+// 已注册socket的数组按需增长；Windows的fd_set是socket数组，按实际数量申请即可突破FD_SETSIZE的限制
+// POSIX的fd_set是位图，fd本身不能超过FD_SETSIZE
+
+typedef struct {
+    SOCKET socket;
+    int    events;
+    void*  data;
+} PollerEntry;
+
+#ifdef _WIN32
+// 与fd_set的内存布局相同，但数组长度可变
+typedef struct PollerFdSet {
+    u_int  fd_count;
+    SOCKET fd_array[];
+} PollerFdSet;
+#define fdSetZero(set)         ((set)->fd_count = 0)
+#define fdSetAdd(set, socket)  ((set)->fd_array[(set)->fd_count++] = (socket))
+#define fdSetHas(set, socket)  FD_ISSET(socket, (fd_set*)(set))
+#else
+typedef fd_set PollerFdSet;
+#define fdSetZero(set)         FD_ZERO(set)
+#define fdSetAdd(set, socket)  FD_SET(socket, set)
+#define fdSetHas(set, socket)  FD_ISSET(socket, set)
+#endif
+
+struct Poller {
+    SOCKET       wakeSocket;    // 连接到自身的UDP socket，pollerWakeup向其发送一个字节来唤醒select
+    int          total;
+    int          capacity;
+    PollerEntry* entries;
+    PollerFdSet* readSet;
+    PollerFdSet* writeSet;
+    PollerFdSet* exceptSet;
+};
+
+const char* pollerBackendName(void) {
+    return "select";
+}
+
+static size_t fdSetSize(int capacity) {
+#ifdef _WIN32
+    return sizeof(PollerFdSet) + sizeof(SOCKET) * (capacity + 1);     // 包括唤醒用的socket
+#else
+    return sizeof(fd_set);
+#endif
+}
+
+// 将容量扩大一倍，失败时保持原有容量
+static int growPoller(Poller* poller) {
+
+    int capacity = poller->capacity ? poller->capacity * 2 : 64;
+
+    PollerEntry* entries = realloc(poller->entries, sizeof(PollerEntry) * capacity);
+    if(entries == NULL) {
+        return -1;
+    }
+    poller->entries = entries;
+
+#ifdef _WIN32
+    PollerFdSet** sets[3] = {&poller->readSet, &poller->writeSet, &poller->exceptSet};
+    for(int i = 0; i < 3; i++) {
+        PollerFdSet* set = realloc(*sets[i], fdSetSize(capacity));
+        if(set == NULL) {
+            return -1;
+        }
+        *sets[i] = set;
+    }
+#endif
+
+    poller->capacity = capacity;
+
+    return 0;
+}
+
+Poller* pollerCreate(void) {
+
+    Poller* poller = malloc(sizeof(Poller));
+    if(poller == NULL) {
+        return NULL;
+    }
+
+    poller->total = 0;
+    poller->capacity = 0;
+    poller->entries = NULL;
+    poller->readSet = malloc(fdSetSize(0));
+    poller->writeSet = malloc(fdSetSize(0));
+    poller->exceptSet = malloc(fdSetSize(0));
+
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+
+    ZeroMemory(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    poller->wakeSocket = INVALID_SOCKET;
+
+    if(poller->readSet == NULL || poller->writeSet == NULL || poller->exceptSet == NULL) {
+        goto pollerCreateError;
+    }
+
+    poller->wakeSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    if(poller->wakeSocket == INVALID_SOCKET ||
+       bind(poller->wakeSocket, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+       getsockname(poller->wakeSocket, (struct sockaddr*)&addr, &addrLen) == SOCKET_ERROR ||
+       connect(poller->wakeSocket, (struct sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+       socketSetNonBlocking(poller->wakeSocket) != 0) {
+        goto pollerCreateError;
+    }
+
+    return poller;
+
+    pollerCreateError:
+    if(poller->wakeSocket != INVALID_SOCKET) closesocket(poller->wakeSocket);
+    free(poller->readSet);
+    free(poller->writeSet);
+    free(poller->exceptSet);
+    free(poller);
+    return NULL;
+}
+
+void pollerDestroy(Poller* poller) {
+    closesocket(poller->wakeSocket);
+    free(poller->entries);
+    free(poller->readSet);
+    free(poller->writeSet);
+    free(poller->exceptSet);
+    free(poller);
+}
+
+int pollerWakeup(Poller* poller) {
+    char one = 1;
+    return send(poller->wakeSocket, &one, 1, 0) == 1 || socketWouldBlock() ? 0 : -1;
+}
+
+static int findEntry(Poller* poller, SOCKET socket) {
+    for(int i = 0; i < poller->total; i++) {
+        if(poller->entries[i].socket == socket) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int pollerAdd(Poller* poller, SOCKET socket, int events, void* data) {
+
+    if(findEntry(poller, socket) != -1) {
+        return -1;
+    }
+
+#ifndef _WIN32
+    if(socket >= FD_SETSIZE) {
+        return -1;
+    }
+#endif
+
+    if(poller->total == poller->capacity && growPoller(poller) != 0) {
+        return -1;
+    }
+
+    PollerEntry* entry = &poller->entries[poller->total++];
+    entry->socket = socket;
+    entry->events = events;
+    entry->data = data;
+
+    return 0;
+}
+
+int pollerModify(Poller* poller, SOCKET socket, int events, void* data) {
+
+    int pos = findEntry(poller, socket);
+    if(pos == -1) {
+        return -1;
+    }
+
+    poller->entries[pos].events = events;
+    poller->entries[pos].data = data;
+
+    return 0;
+}
+
+int pollerRemove(Poller* poller, SOCKET socket) {
+
+    int pos = findEntry(poller, socket);
+    if(pos == -1) {
+        return -1;
+    }
+
+    poller->entries[pos] = poller->entries[--poller->total];
+
+    return 0;
+}
+
+int pollerWait(Poller* poller, PollerEvent* events, int maxEvents, int64_t timeoutUs) {
+
+    PollerFdSet* fdread = poller->readSet;
+    PollerFdSet* fdwrite = poller->writeSet;
+    PollerFdSet* fdexcept = poller->exceptSet;
+    struct timeval tv = {(long)(timeoutUs / 1000000), (long)(timeoutUs % 1000000)};
+    SOCKET maxfd = poller->wakeSocket;
+
+    fdSetZero(fdread);
+    fdSetZero(fdwrite);
+    fdSetZero(fdexcept);
+    fdSetAdd(fdread, poller->wakeSocket);
+
+    for(int i = 0; i < poller->total; i++) {
+        PollerEntry* entry = &poller->entries[i];
+        if(entry->events & pollerEvent_read)  fdSetAdd(fdread, entry->socket);
+        if(entry->events & pollerEvent_write) fdSetAdd(fdwrite, entry->socket);
+        fdSetAdd(fdexcept, entry->socket);
+        if(entry->socket > maxfd) maxfd = entry->socket;
+    }
+
+    int ret = select((int)maxfd + 1, (fd_set*)fdread, (fd_set*)fdwrite, (fd_set*)fdexcept, timeoutUs < 0 ? NULL : &tv);
+
+    if(ret <= 0) {
+#ifdef _WIN32
+        return ret == 0 ? 0 : -1;
+#else
+        return ret == 0 || errno == EINTR ? 0 : -1;
+#endif
+    }
+
+    if(fdSetHas(fdread, poller->wakeSocket)) {
+        char drain[64];
+        while(recv(poller->wakeSocket, drain, sizeof(drain), 0) > 0);
+    }
+
+    int n = 0;
+
+    for(int i = 0; i < poller->total && n < maxEvents; i++) {
+
+        PollerEntry* entry = &poller->entries[i];
+        int ev = 0;
+
+        if(fdSetHas(fdread, entry->socket))   ev |= pollerEvent_read;
+        if(fdSetHas(fdwrite, entry->socket))  ev |= pollerEvent_write;
+        if(fdSetHas(fdexcept, entry->socket)) ev |= pollerEvent_error;
+
+        if(ev != 0) {
+            events[n].data = entry->data;
+            events[n].events = ev;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+#endif
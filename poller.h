@@ -0,0 +1,40 @@
+#include "platform.h"
+
+#ifndef QLWS_POLLER_H
+
+#define QLWS_POLLER_H
+
+// socket就绪通知后端
+// Linux下使用边缘触发的epoll，其它平台退化为select
+// 由于epoll为边缘触发，收到可读/可写通知后调用者必须一直读写直到socket返回WOULDBLOCK
+
+typedef enum PollerEventType {
+    pollerEvent_read  = 1,
+    pollerEvent_write = 2,
+    pollerEvent_error = 4      // 仅出现在pollerWait返回的事件中
+} PollerEventType;
+
+typedef struct PollerEvent {
+    void* data;     // 注册socket时传入的data
+    int   events;   // PollerEventType的组合
+} PollerEvent;
+
+typedef struct Poller Poller;
+
+Poller* pollerCreate(void);
+void pollerDestroy(Poller* poller);
+const char* pollerBackendName(void);
+
+// 注册、修改、注销socket，成功返回0
+int pollerAdd(Poller* poller, SOCKET socket, int events, void* data);
+int pollerModify(Poller* poller, SOCKET socket, int events, void* data);
+int pollerRemove(Poller* poller, SOCKET socket);
+
+// 等待就绪事件，返回就绪事件数量，超时或被唤醒返回0，出错返回-1
+// 超时时间单位为微秒，小于0时一直等待；不支持微秒精度的后端向上取整到毫秒
+int pollerWait(Poller* poller, PollerEvent* events, int maxEvents, int64_t timeoutUs);
+
+// 唤醒正在pollerWait中等待的线程，可以在任意线程调用
+int pollerWakeup(Poller* poller);
+
+#endif
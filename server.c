@@ -1,157 +1,1356 @@
-#include <windows.h>
-#include <winsock2.h>
+#include "platform.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include "ws.h"
 #include "server.h"
+#include "poller.h"
+#include "epoch.h"
+#include "slab.h"
+#include "bufpool.h"
+#include "unmask.h"
+#include "utf8.h"
+#include "acceptkey.h"
+#include "pmdeflate.h"
 
 typedef enum {
     socketProtocol,
     websocketProtocol
 } Protocol;
 
-typedef struct {
+typedef struct IoThread IoThread;
+
+// 引用计数的消息载荷，广播时所有客户的发送队列共享同一份载荷
+// 帧头由各客户的发送队列单独编码，发送时与载荷作为两个向量提交，序列化后的载荷不会再被拷贝
+typedef struct SharedFrame {
+    AtomicLong refs;
+    FrameType type;
+    bool   compressed;  // 载荷经过permessage-deflate压缩
+    char*  data;        // 载荷，由共享帧持有，拷贝的载荷紧跟在共享帧之后，与共享帧一起释放
+    size_t len;         // 载荷长度
+} SharedFrame;
+
+// 发送通道，决定消息在发送队列中的位置
+typedef enum SendLane {
+    sendLane_normal,    // 事件广播等普通消息，按入队顺序排在队尾
+    sendLane_priority,  // RPC回复等直接发给单个客户的消息，插到尚未开始发送的普通消息之前
+    sendLane_control    // 控制帧，插到下一个帧边界，可以夹在其它消息的分片之间
+} SendLane;
+
+// 发送队列中的一个帧，超过分片大小的消息被拆成多个帧，各自引用共享载荷的一段
+// 一条消息的所有帧在同一块内存中连续存放，最后一帧发送完时整块释放并归还共享帧的引用
+typedef struct OutFrame {
+    struct OutFrame* next;
+    SharedFrame* frame;
+    size_t offset;      // 本帧载荷在共享载荷中的位置
+    size_t len;         // 本帧载荷长度
+    int    index;       // 在消息中的序号，只有在第一帧之前才能插入其它数据消息
+    unsigned char header[WS_MAX_SERVER_HEADER_LEN];
+    uint8_t  headerLen;
+    uint8_t  lane;      // SendLane
+    bool     last;      // 消息的最后一帧
+} OutFrame;
+
+struct Client {
     Protocol protocol;
     SOCKET socket;
-    WsFrame wsFrame;    // 仅在升级协议后使用
-} Client;
+    SlabHandle handle;  // 在客户表中的句柄
+    IoThread* owner;    // 负责该连接读写的I/O线程
+    Client* prev;       // 所属线程客户链表，在inbox中时只使用next
+    Client* next;
+    WsFrame* wsFrame;   // 升级协议后才申请
+    HttpRequest httpRequest;    // 握手请求的解析状态，请求可以分多次到达
+    WsSession session;  // 握手时确定的编码、事件订阅等连接选项，握手后不再改变
+    uint16_t closeCode; // 移除连接时发给客户端的关闭状态码，为0时直接关闭
+
+    // 接收缓冲区，socket数据直接读入其中，帧在其中原地解析
+    // 连接空闲（没有未处理完的数据）时归还给所属线程的缓冲区池
+    char*  recvBuff;
+    size_t recvCapacity;
+    size_t recvStart;           // 未处理数据的起始位置，即当前帧的帧首
+    size_t recvEnd;             // 已接收数据的结束位置
+
+    // 分片消息的接收状态
+    bool   msgActive;           // 已收到首个分片，正在等待后续分片
+    size_t msgLen;              // 已收到的消息长度
+    char*  msgBuff;             // 拼接缓冲区，流式处理消息时不使用
+    size_t msgCapacity;
+    void*  msgStream;           // 流式处理消息时MessageStream.begin返回的上下文
+    bool   msgCompressed;       // 当前消息经过压缩，载荷需要解压后再处理
+    Utf8State utf8;             // 未压缩文本消息的UTF-8校验状态，在解码载荷时校验
+    Utf8State inflateUtf8;      // 压缩消息解压后数据的UTF-8校验状态
+
+    // permessage-deflate，握手时协商
+    WsDeflateParams deflateParams;
+    Mutex     deflateLock;      // 保护deflater及deflateReset，任意线程都可能压缩发送，需要在sendLock之前获取
+    z_stream* deflater;         // 首次压缩发送时创建
+    bool      deflateReset;     // 客户端的解压上下文中插入了广播消息，下一条消息需要重置压缩上下文
+    z_stream* inflater;         // 首条压缩消息到达时创建，只由所属线程使用
+
+    // 发送队列，任意线程都可以入队，只有所属线程会写socket
+    Mutex     sendLock;         // 保护发送队列及以下字段
+    OutFrame* sendHead;
+    OutFrame* sendTail;
+    OutFrame* lastCompressed;   // 队列中最后一条压缩消息的最后一帧，压缩消息之间不能改变顺序
+    size_t    sendOffset;       // 队首帧已发送的字节数
+    size_t    queuedBytes;      // 队列中尚未发送的字节数
+    bool      flushScheduled;   // 已加入所属线程的待发送链表
+    bool      wantWrite;        // 已向poller注册可写通知
+    bool      closing;          // 队列积压过多，所属线程应关闭连接
+    Client*   nextFlush;        // 待发送链表的下一项
+
+    // 合并发送，以下字段由所属线程的inboxLock保护
+    bool      coalescePending;  // 已加入所属线程的合并发送队列
+    uint64_t  coalesceDeadline; // 最晚发送时间，clockMicros的返回值
+    Client*   nextCoalesce;     // 合并发送队列的下一项
+
+    EpochNode retireNode;       // 移除后延迟释放，广播线程可能仍持有该客户的指针
+};
+
+// 已完成WebSocket握手的客户集合的不可变快照
+// 广播线程通过一次原子读取得到当前快照，遍历时不需要加锁
+// 客户升级协议或被移除时复制出新快照并发布，旧快照通过纪元延迟回收
+typedef struct ClientSnapshot {
+    EpochNode retireNode;
+    int       total;
+    Client*   clients[];
+} ClientSnapshot;
+
+// 回调函数
+// payload已经解除掩码，回调可以原地修改其中的数据，但不能写到payloadLen之外
+void wsClientTextDataHandle(char* payload, uint64_t payloadLen, Client* client);
+
+// 打印日志函数声明
+void pluginLog(const char* type, int level, const char* format, ...);
+
+// 每个I/O线程拥有自己的poller和客户链表，只有该线程会访问自己的客户链表
+// 客户结构从客户表中分配，地址在连接期间保持不变，可以作为poller的data使用
+struct IoThread {
+    int        id;
+    Thread     thread;
+    ThreadId   threadId;
+    Poller*    poller;
+    int        total;
+    Client*    clients;                     // 所属客户的双向链表
+    Mutex      inboxLock;                   // 保护inbox、flushList及合并发送队列
+    Client*    inbox;                       // acceptor线程交给该线程的新连接
+    Client*    flushList;                   // 发送队列有新数据、等待该线程写socket的客户
+    Client*    coalesceHead;                // 等待合并发送的客户，按截止时间排列
+    Client*    coalesceTail;
+    AtomicLong load;                        // 分配给该线程的连接数，包括还在inbox中的连接
+    BufferPool recvPool;                    // 所属客户的接收缓冲区池
+};
+
+static IoThread ioThreads[MAX_IO_THREADS];
+static int ioThreadNum;
+
+static SOCKET serverSocket;
+static Poller* acceptPoller;
+static Thread acceptThread;
+static const char* serverPath;
+static volatile bool serverRunning;
+
+// 客户表，按块增长，连接数达到硬上限时拒绝新连接，超过软上限时打印警告
+static Slab* clientSlab;
+static int clientSoftLimit;
+static bool overSoftLimit;          // 只由acceptor线程访问
+
+static ClientSnapshot* volatile clientSnapshot;    // 为NULL时代表没有客户
+static Mutex snapshotLock;                          // 串行化快照的复制与发布
+
+static struct {
+    AtomicInt64 broadcasts;
+    AtomicInt64 broadcastBytesCopied;
+    AtomicInt64 deflateBytesIn;
+    AtomicInt64 deflateBytesOut;
+    AtomicInt64 bufferedBytes;      // 所有连接的接收缓冲区及分片拼接缓冲区占用的字节数
+    AtomicInt64 queuedBytes;        // 所有连接的发送队列中尚未发送的字节数
+    AtomicInt64 sendCalls;          // 发送队列的向量写次数
+    AtomicInt64 framesSent;         // 通过发送队列完整发送的帧数
+} serverStats;
+
+// 单个客户允许积压的最大发送字节数，超过后关闭该连接，防止过慢的客户端耗尽内存
+#define MAX_QUEUED_BYTES 0X4000000
+
+// 一次向量写最多提交的向量数，每个帧占用帧头及载荷两个向量
+#define MAX_WRITEV_VECS 128
+
+// 未配置时的发送分片大小，更大的消息被拆成多个帧，控制帧可以夹在分片之间发送
+#define DEFAULT_FRAGMENT_SIZE 0X10000
+
+// 未配置时合并发送的字节阈值，队列积压达到该值时立即发送
+#define DEFAULT_COALESCE_BYTES 0X4000
+
+// 缓冲区池中接收缓冲区的大小，更大的帧单独按帧长度申请缓冲区
+#define RECV_BLOCK_SIZE 0X4000
+
+// 每个I/O线程最多保留的空闲接收缓冲区数量
+#define RECV_POOL_MAX_FREE 256
+
+// 单个帧最大长度
+#define RECV_MAX_FRAME 0X7FFFFFFF
+
+// 未配置时单条消息（包括拼接后的分片消息）的最大长度
+#define DEFAULT_MAX_MESSAGE_SIZE 0X1000000
+
+// 未配置时单个帧载荷的最大长度
+#define DEFAULT_MAX_FRAME_SIZE 0X1000000
+
+// 未配置时压缩发送的最小消息长度，更短的消息压缩收益很小
+#define DEFAULT_COMPRESSION_THRESHOLD 1024
+
+// 服务器窗口大小的取值范围为9到15，按窗口大小索引
+#define DEFLATE_WINDOW_SLOTS 16
+
+static uint64_t maxMessageSize;
+static uint64_t maxFrameSize;                   // 不超过RECV_MAX_FRAME
+static const MessageStream* messageStream;     // 为NULL时分片消息拼接完整后再交给wsClientTextDataHandle
+static const char* const* eventNames;           // 查询参数events可以使用的事件名
+static AtomicLong encodingClients[wsEncoding_count];   // 使用各编码的已握手连接数
+
+static bool permessageDeflate;                  // 是否接受客户端的permessage-deflate请求
+static int compressionThreshold;
+static size_t fragmentSize;                     // 为0时不分片
+static uint64_t coalesceDelay;                  // 合并发送的最长延迟，单位为微秒，为0时不合并
+static size_t coalesceBytes;
+
+// 广播消息使用的压缩流，每次使用前重置，压缩结果由协商了相同窗口大小的客户共享
+static Mutex broadcastDeflateLock;
+static z_stream* broadcastDeflaters[DEFLATE_WINDOW_SLOTS];
+
+// 将载荷放入引用计数为1的共享帧中，成功时共享帧接管payload，失败时payload仍由调用者持有
+// compressed为true代表载荷已经过压缩，第一帧的帧头设置RSV1位
+static SharedFrame* createSharedFrame(char* payload, size_t len, FrameType type, bool compressed) {
+
+    SharedFrame* frame = malloc(sizeof(SharedFrame));
+    if(frame == NULL) {
+        return NULL;
+    }
+
+    frame->refs = 1;
+    frame->type = type;
+    frame->compressed = compressed;
+    frame->data = payload;
+    frame->len = len;
+
+    return frame;
+}
+
+// 将载荷拷贝到共享帧之后，共享帧与载荷只申请一次内存，内存不足返回NULL
+static SharedFrame* createSharedFrameCopy(const char* payload, size_t len, FrameType type) {
+
+    SharedFrame* frame = malloc(sizeof(SharedFrame) + len);
+    if(frame == NULL) {
+        return NULL;
+    }
+
+    frame->refs = 1;
+    frame->type = type;
+    frame->compressed = false;
+    frame->data = (char*)(frame + 1);
+    frame->len = len;
+    memcpy(frame->data, payload, len);
+
+    return frame;
+}
+
+// 帧在发送队列中占用的字节数
+static size_t frameSize(const OutFrame* outFrame) {
+    return outFrame->headerLen + outFrame->len;
+}
+
+// 控制帧总是走控制通道，其它消息使用调用者指定的通道
+static SendLane laneOf(FrameType type, SendLane lane) {
+    return type == frameType_connectionClose || type == frameType_ping || type == frameType_pong ? sendLane_control : lane;
+}
+
+// 压缩文本消息并生成共享帧，失败返回NULL，此时压缩流的上下文不再可用，下次使用前需要重置
+static SharedFrame* createCompressedFrame(z_stream* strm, bool reset, const char* buff, int len) {
+
+    size_t compressedLen;
+    char* compressed = pmdCompress(strm, reset, buff, len, &compressedLen);
+    if(compressed == NULL) {
+        pluginLog("createCompressedFrame", 1, "Compression failed");
+        return NULL;
+    }
+
+    SharedFrame* frame = createSharedFrame(compressed, compressedLen, frameType_text, true);
+
+    if(frame == NULL) {
+        free(compressed);
+    } else {
+        atomicAdd64(&serverStats.deflateBytesIn, len);
+        atomicAdd64(&serverStats.deflateBytesOut, compressedLen);
+    }
+
+    return frame;
+}
+
+// 使用广播压缩流压缩消息，每个窗口大小只在第一次需要时压缩一次
+static SharedFrame* createBroadcastFrame(int windowBits, const char* buff, int len) {
+
+    SharedFrame* frame = NULL;
+
+    mutexLock(&broadcastDeflateLock);
+
+    if(broadcastDeflaters[windowBits] == NULL) {
+        broadcastDeflaters[windowBits] = pmdDeflaterCreate(windowBits);
+    }
+
+    // 共享帧不能引用任何客户各自的历史消息，压缩前总是重置
+    if(broadcastDeflaters[windowBits]) {
+        frame = createCompressedFrame(broadcastDeflaters[windowBits], true, buff, len);
+    }
+
+    mutexUnlock(&broadcastDeflateLock);
+
+    return frame;
+}
+
+static void releaseSharedFrame(SharedFrame* frame) {
+    if(atomicAdd(&frame->refs, -1) == 0) {
+        if(frame->data != (char*)(frame + 1)) {
+            free(frame->data);
+        }
+        free(frame);
+    }
+}
+
+// 按分片大小将消息拆成连续存放的帧，返回第一帧，内存不足返回NULL
+static OutFrame* splitFrames(SharedFrame* frame, SendLane lane, int* count) {
+
+    size_t fragLen = lane != sendLane_control && fragmentSize > 0 && frame->len > fragmentSize ? fragmentSize : frame->len;
+    int total = fragLen > 0 ? (int)((frame->len + fragLen - 1) / fragLen) : 1;
+
+    OutFrame* outFrames = malloc(sizeof(OutFrame) * total);
+    if(outFrames == NULL) {
+        return NULL;
+    }
+
+    for(int i = 0; i < total; i++) {
+
+        OutFrame* outFrame = &outFrames[i];
+
+        outFrame->next = i + 1 < total ? &outFrames[i + 1] : NULL;
+        outFrame->frame = frame;
+        outFrame->offset = i * fragLen;
+        outFrame->len = i + 1 < total ? fragLen : frame->len - outFrame->offset;
+        outFrame->index = i;
+        outFrame->lane = lane;
+        outFrame->last = i + 1 == total;
+
+        // 只有第一帧带有消息类型及RSV1位，之后的帧都是延续帧
+        outFrame->headerLen = encodeFrameHeader(outFrame->header, i == 0 ? frame->type : frameType_continuation,
+                                                outFrame->last, i == 0 && frame->compressed, outFrame->len);
+    }
+
+    *count = total;
+    return outFrames;
+}
+
+// 找到一条消息在发送队列中应插入的位置，返回指向插入位置的链接，需要持有sendLock
+// 已经开始发送的帧及之前的帧不能被越过，数据消息不能插到其它消息的分片之间
+// 控制帧排在已有控制帧之后，高优先级消息排在已有高优先级消息之后，普通消息总是排在队尾
+// 压缩消息之间的顺序必须与压缩顺序一致，否则客户端的解压上下文会错乱
+static OutFrame** findInsertLink(Client* client, SendLane lane, bool compressed) {
+
+    if(lane == sendLane_normal) {
+        return client->sendTail ? &client->sendTail->next : &client->sendHead;
+    }
+
+    OutFrame** link = &client->sendHead;
+
+    if(lane == sendLane_priority && compressed && client->lastCompressed) {
+        link = &client->lastCompressed->next;
+    } else if(*link && client->sendOffset > 0) {
+        link = &(*link)->next;
+    }
+
+    for(OutFrame* outFrame; (outFrame = *link) != NULL; link = &outFrame->next) {
+        if(outFrame->lane == sendLane_control) {
+            continue;
+        }
+        if(lane == sendLane_control) {
+            break;
+        }
+        if(outFrame->index > 0 || outFrame->lane == sendLane_priority) {
+            continue;
+        }
+        break;
+    }
+
+    return link;
+}
+
+// 按截止时间将客户插入合并发送队列，需要持有inboxLock，客户成为队首时返回true
+// 大多数客户使用服务器配置的窗口，截止时间不早于队尾，直接追加到队尾
+static bool insertCoalesce(IoThread* ioThread, Client* client) {
+
+    Client** link = &ioThread->coalesceHead;
+
+    if(ioThread->coalesceTail && ioThread->coalesceTail->coalesceDeadline <= client->coalesceDeadline) {
+        link = &ioThread->coalesceTail->nextCoalesce;
+    } else {
+        while(*link && (*link)->coalesceDeadline <= client->coalesceDeadline) {
+            link = &(*link)->nextCoalesce;
+        }
+    }
+
+    client->nextCoalesce = *link;
+    *link = client;
+    if(client->nextCoalesce == NULL) {
+        ioThread->coalesceTail = client;
+    }
+
+    return ioThread->coalesceHead == client;
+}
+
+// 将帧加入客户的发送队列，入队成功时队列持有帧的一个引用，调用者不会写socket
+// 实际的发送由所属I/O线程在本轮事件处理结束后或socket可写时完成
+static int enqueueFrame(Client* client, SharedFrame* frame, SendLane lane) {
+
+    int count;
+    lane = laneOf(frame->type, lane);
+
+    OutFrame* first = splitFrames(frame, lane, &count);
+    if(first == NULL) {
+        return -1;
+    }
+
+    OutFrame* last = &first[count - 1];
+
+    IoThread* ioThread = client->owner;
+    bool schedule = false;
+
+    mutexLock(&client->sendLock);
+
+    if(client->closing) {
+        mutexUnlock(&client->sendLock);
+        free(first);
+        return -1;
+    }
+
+    atomicAdd(&frame->refs, 1);
+
+    OutFrame** link = findInsertLink(client, lane, frame->compressed);
+    last->next = *link;
+    *link = first;
+    if(last->next == NULL) {
+        client->sendTail = last;
+    }
+    if(frame->compressed) {
+        client->lastCompressed = last;
+    }
+
+    size_t bytes = 0;
+    for(int i = 0; i < count; i++) {
+        bytes += frameSize(&first[i]);
+    }
+    client->queuedBytes += bytes;
+    atomicAdd64(&serverStats.queuedBytes, bytes);
+
+    if(client->queuedBytes > MAX_QUEUED_BYTES) {
+        pluginLog("enqueueFrame", 1, "Too many bytes queued, the client will be closed");
+        client->closing = true;
+    }
+
+    // 在sendLock内加入待发送链表，removeClient设置closing后客户不会再被加入
+    // 开启合并发送时，控制帧以外的帧先等待一个窗口，窗口内陆续入队的帧通过一次向量写发出
+    // 队列积压达到阈值时立即发送，已在合并发送队列中的客户到期后再检查一次，多余的检查不会发送任何数据
+    // 客户端可以在握手时通过查询参数batch指定自己的合并窗口
+    uint64_t delay = client->session.batchDelay >= 0 ? (uint64_t)client->session.batchDelay : coalesceDelay;
+
+    if(client->flushScheduled) {
+        // 已经在待发送链表中
+    } else if(delay > 0 && lane != sendLane_control && client->queuedBytes < coalesceBytes) {
+        mutexLock(&ioThread->inboxLock);
+        if(!client->coalescePending) {
+            client->coalescePending = true;
+            client->coalesceDeadline = clockMicros() + delay;
+            // 成为队首时I/O线程可能正在按更晚的时间等待，需要唤醒它重新计算等待时间
+            schedule = insertCoalesce(ioThread, client);
+        }
+        mutexUnlock(&ioThread->inboxLock);
+    } else {
+        client->flushScheduled = true;
+        schedule = true;
+        mutexLock(&ioThread->inboxLock);
+        client->nextFlush = ioThread->flushList;
+        ioThread->flushList = client;
+        mutexUnlock(&ioThread->inboxLock);
+    }
+
+    mutexUnlock(&client->sendLock);
+
+    // 在所属线程中调用时线程本身就处于运行状态，不需要唤醒
+    if(schedule && !threadIdEqual(threadCurrentId(), ioThread->threadId)) {
+        pollerWakeup(ioThread->poller);
+    }
+
+    return 0;
+}
+
+// 释放已发送完或被丢弃的帧，消息的最后一帧释放时整块释放并归还共享帧的引用
+static void releaseOutFrame(Client* client, OutFrame* outFrame) {
+
+    if(outFrame == client->lastCompressed) {
+        client->lastCompressed = NULL;
+    }
+
+    if(outFrame->last) {
+        SharedFrame* frame = outFrame->frame;
+        free(outFrame - outFrame->index);
+        releaseSharedFrame(frame);
+    }
+}
+
+// 通过向量写尽可能多地发送队列中的帧，只能由所属线程调用
+// 发送缓冲区满时注册可写通知，队列清空后注销，返回-1代表需要关闭连接
+static int flushClient(Client* client) {
+
+    IoVec vec[MAX_WRITEV_VECS];
+    int result = 0;
+    int sendCalls = 0;
+    int framesSent = 0;
+
+    mutexLock(&client->sendLock);
+
+    client->flushScheduled = false;
+
+    if(client->closing) {
+        result = -1;
+        goto flushClientEnd;
+    }
+
+    while(client->sendHead) {
+
+        int count = 0;
+        size_t offset = client->sendOffset;     // 队首帧可能已经发送了一部分
+        OutFrame* outFrame;
+
+        for(outFrame = client->sendHead; outFrame && count < MAX_WRITEV_VECS - 1; outFrame = outFrame->next) {
+
+            if(offset < outFrame->headerLen) {
+                ioVecSet(&vec[count], outFrame->header + offset, outFrame->headerLen - offset);
+                count++;
+                offset = 0;
+            } else {
+                offset -= outFrame->headerLen;
+            }
+
+            if(offset < outFrame->len) {
+                ioVecSet(&vec[count], outFrame->frame->data + outFrame->offset + offset, outFrame->len - offset);
+                count++;
+            }
+
+            offset = 0;
+        }
+
+        // 本次写不下整个队列时，通知内核后面还有数据，避免发出不满一个报文段的尾部
+        int iSendResult = socketWritev(client->socket, vec, count, outFrame != NULL);
+
+        if(iSendResult == SOCKET_ERROR) {
+            if(socketWouldBlock()) {
+                break;
+            }
+            pluginLog("flushClient", 1, "Send failed: %d", WSAGetLastError());
+            result = -1;
+            goto flushClientEnd;
+        }
+
+        pluginLog("flushClient", 0, "Bytes sent: %d", iSendResult);
+        sendCalls++;
+
+        size_t sent = iSendResult;
+        client->queuedBytes -= sent;
+        atomicAdd64(&serverStats.queuedBytes, -(int64_t)sent);
+
+        // 移除已完整发送的帧，记录队首帧的发送位置
+        while(sent > 0) {
+            outFrame = client->sendHead;
+            size_t remain = frameSize(outFrame) - client->sendOffset;
+            if(sent < remain) {
+                client->sendOffset += sent;
+                break;
+            }
+            sent -= remain;
+            client->sendOffset = 0;
+            client->sendHead = outFrame->next;
+            releaseOutFrame(client, outFrame);
+            framesSent++;
+        }
+
+        if(client->sendHead == NULL) {
+            client->sendTail = NULL;
+        }
+    }
+
+    bool wantWrite = client->sendHead != NULL;
+
+    if(wantWrite != client->wantWrite) {
+        int events = pollerEvent_read | (wantWrite ? pollerEvent_write : 0);
+        if(pollerModify(client->owner->poller, client->socket, events, client) != 0) {
+            result = -1;
+            goto flushClientEnd;
+        }
+        client->wantWrite = wantWrite;
+    }
+
+    flushClientEnd:
+    mutexUnlock(&client->sendLock);
+    if(sendCalls > 0) {
+        atomicAdd64(&serverStats.sendCalls, sendCalls);
+        atomicAdd64(&serverStats.framesSent, framesSent);
+    }
+    return result;
+}
+
+// 释放发送队列中所有尚未发送的帧
+static void freeSendQueue(Client* client) {
+    OutFrame* outFrame = client->sendHead;
+    while(outFrame) {
+        OutFrame* next = outFrame->next;
+        releaseOutFrame(client, outFrame);
+        outFrame = next;
+    }
+    client->sendHead = client->sendTail = NULL;
+    atomicAdd64(&serverStats.queuedBytes, -(int64_t)client->queuedBytes);
+    client->queuedBytes = 0;
+}
+
+// 使用客户自己的压缩流压缩消息并加入发送队列，接管buff
+// 压缩与入队在deflateLock内完成，保证发送顺序与压缩上下文中消息的顺序一致
+static int wsCompressedFrameSend(Client* client, char* buff, int len) {
+
+    int result = -1;
+    SharedFrame* frame = NULL;
+
+    mutexLock(&client->deflateLock);
+
+    if(client->deflater == NULL) {
+        client->deflater = pmdDeflaterCreate(client->deflateParams.serverWindowBits);
+        client->deflateReset = false;
+    }
+
+    if(client->deflater) {
+        bool reset = client->deflateReset || client->deflateParams.serverNoContextTakeover;
+        frame = createCompressedFrame(client->deflater, reset, buff, len);
+        client->deflateReset = frame == NULL;
+    }
+
+    // 无法压缩时发送未压缩的帧，未压缩的消息不影响双方的压缩上下文
+    if(frame) {
+        free(buff);
+    } else if((frame = createSharedFrame(buff, len, frameType_text, false)) == NULL) {
+        free(buff);
+    }
+
+    if(frame) {
+        result = enqueueFrame(client, frame, sendLane_priority);
+        releaseSharedFrame(frame);
+    }
+
+    mutexUnlock(&client->deflateLock);
+
+    return result;
+}
+
+// 将malloc申请的数据作为载荷加入发送队列，无论成功与否buff都由服务器接管并在发送后释放
+// 协商了permessage-deflate时超过压缩阈值的文本消息会被压缩
+// 需要调用者自己确保客户端已完成WebSocket握手，可以在任意线程调用
+int wsFrameSendOwned(Client* client, char* buff, int len, FrameType type) {
+
+    if(type == frameType_text && client->deflateParams.enabled && len >= compressionThreshold) {
+        return wsCompressedFrameSend(client, buff, len);
+    }
+
+    SharedFrame* frame = createSharedFrame(buff, len, type, false);
+    if(frame == NULL) {
+        free(buff);
+        return -1;
+    }
+
+    int result = enqueueFrame(client, frame, sendLane_priority);
+    releaseSharedFrame(frame);
+
+    return result;
+}
+
+// 拷贝一份数据后发送，buff在返回后即可释放，适用于载荷不是单独申请的内存的情况
+// 不需要压缩时载荷拷贝到共享帧之后，适合回复等短消息
+int wsFrameSend(Client* client, const char* buff, int len, FrameType type) {
+
+    if(type == frameType_text && client->deflateParams.enabled && len >= compressionThreshold) {
+        char* payload = malloc(len > 0 ? len : 1);
+        if(payload == NULL) {
+            return -1;
+        }
+        memcpy(payload, buff, len);
+        return wsCompressedFrameSend(client, payload, len);
+    }
+
+    SharedFrame* frame = createSharedFrameCopy(buff, len, type);
+    if(frame == NULL) {
+        return -1;
+    }
+
+    int result = enqueueFrame(client, frame, sendLane_priority);
+    releaseSharedFrame(frame);
+
+    return result;
+}
+
+ClientHandle wsClientHandle(Client* client) {
+    return client->handle;
+}
+
+// 通过句柄发送，客户已断开或句柄已失效时返回-1，可以在任意线程调用
+int wsFrameSendToHandle(ClientHandle handle, const char* buff, int len, FrameType type) {
+
+    int result = -1;
+
+    long epoch = epochEnter();
+
+    Client* client = slabGet(clientSlab, handle);
+
+    if(client && client->protocol == websocketProtocol) {
+        result = wsFrameSend(client, buff, len, type);
+    }
+
+    epochExit(epoch);
+
+    return result;
+}
+
+// 广播的实现，slots为1时所有客户都发送buffs[0]，否则按客户的编码选择载荷，buffs中的载荷都由这里接管
+// event不小于0时只发给订阅了该事件的客户，没有对应编码的载荷（为NULL）的客户也不会收到
+// 帧头只在第一次需要时编码一次，所有客户的发送队列共享同一个帧，载荷不会被拷贝
+// 只有buffs[0]为文本消息时才压缩，压缩帧按服务器窗口大小各编码一次，由协商了相同窗口大小的客户共享
+// 遍历的是进入纪元后读取的快照，不需要加锁，遍历期间快照及其中的客户都不会被释放
+static void broadcastOwned(int event, char* buffs[], const int lens[], const FrameType types[], int slots) {
+
+    SharedFrame* frames[wsEncoding_count] = {NULL};
+    SharedFrame* compressedFrames[DEFLATE_WINDOW_SLOTS] = {NULL};
+    bool compress = types[0] == frameType_text && buffs[0] && lens[0] >= compressionThreshold;
+    uint32_t eventBit = event >= 0 ? (uint32_t)1 << event : 0XFFFFFFFF;
+
+    long epoch = epochEnter();
+
+    ClientSnapshot* snapshot = atomicLoadPtr((void* volatile*)&clientSnapshot);
+
+    for(int i = 0; snapshot && i < snapshot->total; i++) {
+
+        Client* client = snapshot->clients[i];
+        int slot = slots > 1 ? client->session.encoding : 0;
+
+        if((client->session.events & eventBit) == 0 || buffs[slot] == NULL) {
+            continue;
+        }
+
+        pluginLog("wsFrameSendToAll", 0, "Send data to %dst client", i);
+
+        if(slot == 0 && compress && client->deflateParams.enabled) {
+
+            int windowBits = client->deflateParams.serverWindowBits;
+
+            if(compressedFrames[windowBits] == NULL) {
+                compressedFrames[windowBits] = createBroadcastFrame(windowBits, buffs[0], lens[0]);
+            }
+
+            // 共享帧不在客户自己的压缩上下文中，客户的下一条压缩消息需要重置压缩上下文
+            if(compressedFrames[windowBits]) {
+                mutexLock(&client->deflateLock);
+                if(enqueueFrame(client, compressedFrames[windowBits], sendLane_normal) == 0) {
+                    client->deflateReset = true;
+                }
+                mutexUnlock(&client->deflateLock);
+                continue;
+            }
+        }
+
+        if(frames[slot] == NULL && (frames[slot] = createSharedFrame(buffs[slot], lens[slot], types[slot], false)) == NULL) {
+            continue;
+        }
+
+        enqueueFrame(client, frames[slot], sendLane_normal);
+    }
+
+    epochExit(epoch);
+
+    atomicAdd64(&serverStats.broadcasts, 1);
+
+    // 没有客户需要未压缩的帧时载荷仍由这里持有
+    for(int i = 0; i < slots; i++) {
+        if(frames[i]) {
+            releaseSharedFrame(frames[i]);
+        } else {
+            free(buffs[i]);
+        }
+    }
+
+    for(int i = 0; i < DEFLATE_WINDOW_SLOTS; i++) {
+        if(compressedFrames[i]) {
+            releaseSharedFrame(compressedFrames[i]);
+        }
+    }
+}
+
+// 将malloc申请的数据作为载荷发送给所有已完成WebSocket握手的客户端，buff由服务器接管
+// 不区分客户协商的编码及订阅的事件
+void wsFrameSendToAllOwned(char* buff, int len, FrameType type) {
+    broadcastOwned(-1, &buff, &len, &type, 1);
+}
+
+// 将事件发送给订阅了该事件的客户，payloads按WsEncoding提供各编码的载荷，都由服务器接管
+// 可以只提供wsEncodingsInUse中的编码，其余为NULL
+void wsEventSendToAllOwned(int event, char* payloads[wsEncoding_count], const int lens[wsEncoding_count]) {
+
+    FrameType types[wsEncoding_count];
+    for(int i = 0; i < wsEncoding_count; i++) {
+        types[i] = wsEncodingFrameType(i);
+    }
+
+    broadcastOwned(event, payloads, lens, types, wsEncoding_count);
+}
+
+uint32_t wsEncodingsInUse(void) {
+
+    uint32_t mask = 0;
+    for(int i = 0; i < wsEncoding_count; i++) {
+        if(atomicLoad(&encodingClients[i]) > 0) {
+            mask |= 1u << i;
+        }
+    }
+
+    return mask;
+}
+
+WsEncoding wsClientEncoding(Client* client) {
+    return client->session.encoding;
+}
+
+// 拷贝一份数据后广播，buff在返回后即可释放
+void wsFrameSendToAll(const char* buff, int len, FrameType type) {
+
+    char* payload = malloc(len > 0 ? len : 1);
+    if(payload == NULL) {
+        return;
+    }
+    memcpy(payload, buff, len);
+
+    atomicAdd64(&serverStats.broadcastBytesCopied, len);
+
+    wsFrameSendToAllOwned(payload, len, type);
+}
+
+static void destroySnapshot(EpochNode* node) {
+    free((ClientSnapshot*)((char*)node - offsetof(ClientSnapshot, retireNode)));
+}
+
+// 复制当前快照，加入或去掉一个客户后发布新快照，返回-1代表内存不足
+static int publishSnapshot(Client* join, Client* leave) {
+
+    int result = 0;
+
+    mutexLock(&snapshotLock);
+
+    ClientSnapshot* old = clientSnapshot;
+    int total = old ? old->total : 0;
+    int newTotal = total + (join ? 1 : 0) - (leave ? 1 : 0);
+    ClientSnapshot* snapshot = NULL;
+
+    if(newTotal > 0) {
+        snapshot = malloc(sizeof(ClientSnapshot) + sizeof(Client*) * newTotal);
+        if(snapshot == NULL) {
+            result = -1;
+            goto publishSnapshotEnd;
+        }
+
+        snapshot->total = 0;
+        for(int i = 0; i < total; i++) {
+            if(old->clients[i] != leave) {
+                snapshot->clients[snapshot->total++] = old->clients[i];
+            }
+        }
+        if(join) {
+            snapshot->clients[snapshot->total++] = join;
+        }
+    }
+
+    atomicStorePtr((void* volatile*)&clientSnapshot, snapshot);
+
+    if(old) {
+        epochRetire(&old->retireNode, destroySnapshot);
+    }
+
+    publishSnapshotEnd:
+    mutexUnlock(&snapshotLock);
+    return result;
+}
+
+void serverGetStats(ServerStats* stats) {
+    stats->broadcasts = atomicLoad64(&serverStats.broadcasts);
+    stats->broadcastBytesCopied = atomicLoad64(&serverStats.broadcastBytesCopied);
+    stats->deflateBytesIn = atomicLoad64(&serverStats.deflateBytesIn);
+    stats->deflateBytesOut = atomicLoad64(&serverStats.deflateBytesOut);
+    stats->bufferedBytes = atomicLoad64(&serverStats.bufferedBytes);
+    stats->queuedBytes = atomicLoad64(&serverStats.queuedBytes);
+    stats->sendCalls = atomicLoad64(&serverStats.sendCalls);
+    stats->framesSent = atomicLoad64(&serverStats.framesSent);
+    stats->clients = clientSlab ? slabCount(clientSlab) : 0;
+    stats->clientCapacity = clientSlab ? slabCapacity(clientSlab) : 0;
+}
+
+// 开始接收分片消息或压缩消息，设置了流式处理回调时由回调决定是否流式处理该消息
+// 返回-1代表无法创建解压流
+static int beginMessage(Client* client, bool compressed, bool text) {
+
+    if(compressed && client->inflater == NULL && (client->inflater = pmdInflaterCreate()) == NULL) {
+        pluginLog("beginMessage", 1, "Failed to create inflate stream");
+        return -1;
+    }
+
+    client->msgActive = true;
+    client->msgLen = 0;
+    client->msgCompressed = compressed;
+    utf8Reset(&client->inflateUtf8);
+    client->inflateUtf8.active = compressed && text;
+    client->msgStream = messageStream ? messageStream->begin(client) : NULL;
+
+    return 0;
+}
+
+// 处理消息的一段数据，流式处理时直接交给回调，否则拷贝到拼接缓冲区，返回-1代表需要关闭连接
+// 压缩消息的长度上限按解压后的长度计算
+static int appendMessageData(void* arg, const char* data, size_t len) {
+
+    Client* client = arg;
+
+    if(len > maxMessageSize - client->msgLen) {
+        pluginLog("appendFragment", 1, "Message too large: more than %llu bytes", maxMessageSize);
+        client->closeCode = WS_CLOSE_MESSAGE_TOO_BIG;
+        return -1;
+    }
+
+    if(client->msgStream) {
+        client->msgLen += len;
+        return messageStream->data(client->msgStream, data, len);
+    }
+
+    // 按倍数扩大拼接缓冲区，不超过消息长度上限
+    if(client->msgLen + len > client->msgCapacity) {
+        uint64_t capacity = client->msgCapacity ? client->msgCapacity * 2 : RECV_BLOCK_SIZE;
+        if(capacity < client->msgLen + len) capacity = client->msgLen + len;
+        if(capacity > maxMessageSize) capacity = maxMessageSize;
+
+        char* buff = realloc(client->msgBuff, capacity);
+        if(buff == NULL) {
+            pluginLog("appendFragment", 1, "Out of memory");
+            return -1;
+        }
+        atomicAdd64(&serverStats.bufferedBytes, capacity - client->msgCapacity);
+        client->msgBuff = buff;
+        client->msgCapacity = capacity;
+    }
+
+    memcpy(client->msgBuff + client->msgLen, data, len);
+    client->msgLen += len;
+
+    return 0;
+}
+
+// 处理解压后的数据，文本消息先校验UTF-8编码，非法数据不会交给上层
+static int appendInflatedData(void* arg, const char* data, size_t len) {
+
+    Client* client = arg;
+
+    if(client->inflateUtf8.active && !utf8Validate(&client->inflateUtf8, (const unsigned char*)data, len)) {
+        pluginLog("appendInflatedData", 1, "Invalid UTF-8 in compressed message");
+        client->closeCode = WS_CLOSE_INVALID_PAYLOAD;
+        return -1;
+    }
+
+    return appendMessageData(client, data, len);
+}
+
+// 处理一个分片的载荷，压缩消息解压后再处理，返回-1代表需要关闭连接
+static int appendFragment(Client* client, const char* data, uint64_t len) {
+
+    if(client->msgCompressed) {
+        return pmdInflate(client->inflater, (const unsigned char*)data, len, appendInflatedData, client) < 0 ? -1 : 0;
+    }
+
+    return appendMessageData(client, data, len);
+}
+
+// 压缩消息的最后一个分片处理完后补回发送方去掉的结尾，返回-1代表需要关闭连接
+static int inflateMessageTail(Client* client) {
+
+    int result = pmdInflate(client->inflater, PMD_TAIL, sizeof(PMD_TAIL), appendInflatedData, client);
+    if(result < 0) {
+        return -1;
+    }
+
+    if(client->inflateUtf8.active && !utf8Finish(&client->inflateUtf8)) {
+        pluginLog("inflateMessageTail", 1, "Truncated UTF-8 sequence in compressed message");
+        client->closeCode = WS_CLOSE_INVALID_PAYLOAD;
+        return -1;
+    }
+
+    // 客户端结束了deflate流或每条消息都重置压缩上下文，之后的消息不会引用之前的数据
+    if(result == 1 || client->deflateParams.clientNoContextTakeover) {
+        inflateReset(client->inflater);
+    }
+
+    return 0;
+}
+
+// 结束分片消息，complete为false代表连接在消息接收完之前被关闭
+static void finishMessage(Client* client, bool complete) {
+
+    if(client->msgStream) {
+        messageStream->end(client->msgStream, complete);
+    } else if(complete) {
+        wsClientTextDataHandle(client->msgBuff, client->msgLen, client);
+    }
+
+    free(client->msgBuff);
+    atomicAdd64(&serverStats.bufferedBytes, -(int64_t)client->msgCapacity);
+    client->msgBuff = NULL;
+    client->msgCapacity = 0;
+    client->msgLen = 0;
+    client->msgStream = NULL;
+    client->msgActive = false;
+    client->msgCompressed = false;
+}
+
+// 检查帧及其所属消息的长度，帧头解析完后立即调用，超过上限时设置关闭状态码并返回-1
+// 压缩消息解压后的长度在解压时检查
+static int checkFrameSize(Client* client, const WsFrame* wsFrame) {
+
+    if(wsFrame->payloadLen > maxFrameSize) {
+        pluginLog("checkFrameSize", 1, "Frame too large: %llu bytes", wsFrame->payloadLen);
+        client->closeCode = WS_CLOSE_MESSAGE_TOO_BIG;
+        return -1;
+    }
+
+    bool continuation = wsFrame->frameType == frameType_continuation && client->msgActive;
+
+    if(wsFrame->compressed || (continuation && client->msgCompressed)) {
+        return 0;
+    }
+
+    uint64_t received = continuation ? client->msgLen : 0;
+
+    if(wsFrame->payloadLen > maxMessageSize - received) {
+        pluginLog("checkFrameSize", 1, "Message too large: more than %llu bytes", maxMessageSize);
+        client->closeCode = WS_CLOSE_MESSAGE_TOO_BIG;
+        return -1;
+    }
+
+    return 0;
+}
+
+// 处理接收缓冲区中所有完整的帧，返回-1代表需要关闭连接
+// 未接收完的帧保留在缓冲区中，收到更多数据后从帧首继续解析
+int wsClientDataHandle(Client* client) {
+
+    WsFrame* wsFrame = client->wsFrame;
+
+    while(client->recvStart < client->recvEnd) {
+
+        size_t recvLen = client->recvEnd - client->recvStart;
+        size_t consume = readWebSocketFrameStream(wsFrame, client->recvBuff + client->recvStart, recvLen, &client->utf8);
+
+        pluginLog("wsClientDataHandle", 0, "Consume %llu bytes of data in %llu bytes", (uint64_t)consume, (uint64_t)recvLen);
+        pluginLog("wsClientDataHandle", 0, "wsFrame->state is %d", wsFrame->state);
+
+        // 解析ws帧出错或文本不是合法的UTF-8，通知关闭连接
+        if(wsFrame->state == frameState_failure) {
+            client->closeCode = wsFrame->failureCode;
+            return -1;
+        }
+
+        // 帧头一解析完就检查长度，超过上限的帧在缓冲载荷之前就被拒绝
+        if(wsFrame->state != frameState_init && checkFrameSize(client, wsFrame) != 0) {
+            return -1;
+        }
+
+        // 帧未接收完，等待更多数据
+        if(wsFrame->state != frameState_success) {
+            return 0;
+        }
+
+        pluginLog("wsClientDataHandle", 0, "Header and payload lengths are %llu and %llu", wsFrame->headerLen, wsFrame->payloadLen);
+
+        // 载荷已在接收过程中原地解码
+        uint64_t payloadLen = wsFrame->payloadLen;
+        u_char* payload = wsFrame->payload;
+
+        // RSV1只能出现在协商了permessage-deflate后数据消息的首个帧中
+        if(wsFrame->compressed && (!client->deflateParams.enabled
+            || (wsFrame->frameType != frameType_text && wsFrame->frameType != frameType_binary))) {
+            pluginLog("wsClientDataHandle", 1, "Unexpected RSV1 bit");
+            client->closeCode = WS_CLOSE_PROTOCOL_ERROR;
+            return -1;
+        }
+
+        switch(wsFrame->frameType) {
+
+            // 客户端希望关闭连接
+            case frameType_connectionClose:
+                pluginLog("wsClientDataHandle", 1, "Connection close frame");
+                return -1;
+
+            // 心跳，控制帧可以夹在分片消息的分片之间
+            case frameType_ping:
+                pluginLog("wsClientDataHandle", 0, "pong");
+                wsFrameSend(client, (const char*)payload, payloadLen, frameType_pong);
+                break;
+
+            // 未请求的pong可以作为单向心跳，忽略即可
+            case frameType_pong:
+                break;
+
+            // 数据消息的类型由握手时协商的编码决定，JSON为文本消息，其它编码为二进制消息
+            case frameType_text:
+            case frameType_binary:
 
-// 回调函数
-void wsClientTextDataHandle(const char* payload, uint64_t payloadLen, SOCKET socket);
+                // 上一条分片消息还未结束
+                if(client->msgActive) {
+                    pluginLog("wsClientDataHandle", 1, "New message before the final fragment");
+                    client->closeCode = WS_CLOSE_PROTOCOL_ERROR;
+                    return -1;
+                }
 
-// 打印日志函数声明
-void pluginLog(const char* type, int level, const char* format, ...);
+                if(wsFrame->frameType != wsEncodingFrameType(client->session.encoding)) {
+                    pluginLog("wsClientDataHandle", 1, "Data frame type does not match the negotiated subprotocol");
+                    client->closeCode = WS_CLOSE_UNSUPPORTED_DATA;
+                    return -1;
+                }
 
-#define MAX_CLIENT_NUM FD_SETSIZE
-static struct {
-    int    total;
-    Client clients[MAX_CLIENT_NUM];
-} clientSockets;
+                // 未分片的未压缩消息直接交给回调，不需要拷贝
+                if(wsFrame->FIN && !wsFrame->compressed) {
+                    wsClientTextDataHandle((char*)payload, payloadLen, client);
+                    break;
+                }
 
-static SOCKET serverSocket;
+                if(beginMessage(client, wsFrame->compressed, wsFrame->frameType == frameType_text) != 0) {
+                    return -1;
+                }
 
-// 将数据转换成WebSocket帧并发送
-// 需要调用者自己确保socket已完成WebSocket握手
-int wsFrameSend(SOCKET socket, const char* buff, int len, FrameType type) {
+                if(appendFragment(client, (const char*)payload, payloadLen) != 0) {
+                    return -1;
+                }
 
-    int newLen;
-    const char* frame = convertToWebSocketFrame(buff, type, len, &newLen);
+                if(wsFrame->FIN) {
+                    if(inflateMessageTail(client) != 0) {
+                        return -1;
+                    }
+                    finishMessage(client, true);
+                }
 
-    int iSendResult = send(socket, frame, newLen, 0);
+                break;
 
-    if(iSendResult == SOCKET_ERROR) {
-        pluginLog("wsFrameSend", 1, "Send failed: %d", WSAGetLastError());
-        goto wsFrameSendEnd;
-    }
+            case frameType_continuation:
 
-    pluginLog("wsFrameSend", 0, "Bytes sent: %d", iSendResult);
-    
-    wsFrameSendEnd:    
-    free((void*)frame);
-    return iSendResult;
-}
+                if(!client->msgActive) {
+                    pluginLog("wsClientDataHandle", 1, "Continuation frame without a message");
+                    client->closeCode = WS_CLOSE_PROTOCOL_ERROR;
+                    return -1;
+                }
+
+                if(appendFragment(client, (const char*)payload, payloadLen) != 0) {
+                    return -1;
+                }
 
-// 将数据转换为WebSocket帧并发送给所有已完成WebSocket握手的客户端
-void wsFrameSendToAll(const char* buff, int len,  FrameType type) {
-    for(int i = 0; i < clientSockets.total; i++) {
-        if(clientSockets.clients[i].protocol == websocketProtocol) {
-            pluginLog("wsFrameSendToAll", 0, "Send data to %dst client", i);
-            wsFrameSend(clientSockets.clients[i].socket, buff, len, type);
+                if(wsFrame->FIN) {
+                    if(client->msgCompressed && inflateMessageTail(client) != 0) {
+                        return -1;
+                    }
+                    finishMessage(client, true);
+                }
+
+                break;
+
+            // 遇到意料之外的帧类型
+            default:
+                pluginLog("wsClientDataHandle", 1, "Unexpected frame type");
+                client->closeCode = WS_CLOSE_PROTOCOL_ERROR;
+                return -1;
         }
+
+        // 一个帧处理完毕后从缓冲区中移除，继续处理缓冲区中的下一帧
+        client->recvStart += consume;
+        initWsFrameStruct(wsFrame);
     }
-}
 
-// 处理WebSocket帧数据，返回-1代表需要关闭连接
-int wsClientDataHandle(const char* recvBuff, int recvLen, Client* client) {
+    return 0;
+}
 
-    WsFrame* wsFrame = &client->wsFrame;
+// 归还接收缓冲区，池中大小的缓冲区放回所属线程的缓冲区池，为大帧单独申请的缓冲区直接释放
+static void releaseRecvBuffer(Client* client) {
 
-    if(recvLen == 0) {
-        return 0;
+    if(client->recvBuff == NULL) {
+        return;
     }
 
-    int consume = readWebSocketFrameStream(wsFrame, recvBuff, recvLen);
+    if(client->recvCapacity == RECV_BLOCK_SIZE) {
+        bufferPoolPut(&client->owner->recvPool, client->recvBuff);
+    } else {
+        free(client->recvBuff);
+    }
 
-    pluginLog("wsClientDataHandle", 0, "Consume %d bytes of data in %d bytes", consume, recvLen);
-    pluginLog("wsClientDataHandle", 0, "wsFrame->state is %d", wsFrame->state);
+    atomicAdd64(&serverStats.bufferedBytes, -(int64_t)client->recvCapacity);
 
-    if(wsFrame->state == frameState_success) {
+    client->recvBuff = NULL;
+    client->recvCapacity = client->recvStart = client->recvEnd = 0;
+}
 
-        pluginLog("wsClientDataHandle", 0, "Header and payload lengths are %llu and %llu", wsFrame->headerLen, wsFrame->payloadLen);
+// 确保接收缓冲区末尾有可用空间，返回-1代表帧过大或内存不足
+// 缓冲区满时，如果当前帧能放进池中大小的缓冲区就将其移到缓冲区开头，否则按帧的总长度一次性申请缓冲区
+static int reserveRecvSpace(Client* client) {
 
-        // 暂时不处理多帧数据，遇到多帧数据关闭连接
-        if(wsFrame->FIN == 0) {
-            pluginLog("wsClientDataHandle", 1, "This is not the final fragment in a message");
+    if(client->recvBuff == NULL) {
+        client->recvBuff = bufferPoolGet(&client->owner->recvPool);
+        if(client->recvBuff == NULL) {
             return -1;
         }
+        client->recvCapacity = RECV_BLOCK_SIZE;
+        client->recvStart = client->recvEnd = 0;
+        atomicAdd64(&serverStats.bufferedBytes, RECV_BLOCK_SIZE);
+        return 0;
+    }
 
-        // 客户端希望关闭连接
-        if(wsFrame->frameType == frameType_connectionClose) {
-            pluginLog("wsClientDataHandle", 1, "Connection close frame");
-            return -1;
-        }
+    if(client->recvEnd < client->recvCapacity) {
+        return 0;
+    }
+
+    size_t pending = client->recvEnd - client->recvStart;
+    uint64_t need = RECV_BLOCK_SIZE;
+
+    // 缓冲区远大于WS_MAX_HEADER_LEN，缓冲区满时当前帧的帧头一定已经解析完毕
+    WsFrame* wsFrame = client->wsFrame;
+    if(wsFrame && wsFrame->state == frameState_readingData) {
+        need = wsFrame->headerLen + wsFrame->payloadLen;
+    }
+
+    if(need > RECV_MAX_FRAME) {
+        pluginLog("reserveRecvSpace", 1, "Frame too large: %llu bytes", need);
+        return -1;
+    }
 
-        // 遇到意料之外的帧类型
-        if(wsFrame->frameType == frameType_binary      ||
-           wsFrame->frameType == frameType_pong        ||
-           wsFrame->frameType == frameType_continuation
-        ) {
-            pluginLog("wsClientDataHandle", 1, "Unexpected frame type");
+    if(need <= client->recvCapacity) {
+        memmove(client->recvBuff, client->recvBuff + client->recvStart, pending);
+    } else {
+        char* buff = need <= RECV_BLOCK_SIZE ? bufferPoolGet(&client->owner->recvPool) : malloc(need);
+        if(buff == NULL) {
             return -1;
         }
+        memcpy(buff, client->recvBuff + client->recvStart, pending);
+        releaseRecvBuffer(client);
+        client->recvBuff = buff;
+        client->recvCapacity = need <= RECV_BLOCK_SIZE ? RECV_BLOCK_SIZE : need;
+        atomicAdd64(&serverStats.bufferedBytes, client->recvCapacity);
+    }
 
-        uint64_t payloadLen = wsFrame->payloadLen;
-        u_char* payload = wsFrame->buff + wsFrame->headerLen;
+    client->recvStart = 0;
+    client->recvEnd = pending;
 
-        // 解码载荷
-        for(uint64_t j = 0; j < payloadLen; j++) {
-            payload[j] = payload[j] ^ wsFrame->mask[j % 4];
-        }
+    return 0;
+}
 
-        int iSendResult;
+// 直接向socket写入带状态码的关闭帧，尽力而为，发送队列中有发送了一部分的帧时不写入以免破坏帧边界
+static void sendCloseFrame(Client* client) {
 
-        // 心跳
-        if(wsFrame->frameType == frameType_ping) {
-            pluginLog("wsClientDataHandle", 0, "pong");
-            wsFrameSend(client->socket, payload, payloadLen, frameType_pong);
-        }
+    unsigned char frame[WS_MAX_SERVER_HEADER_LEN + 2];
+    size_t len = encodeFrameHeader(frame, frameType_connectionClose, true, false, 2);
+    frame[len++] = (uint8_t)(client->closeCode >> 8);
+    frame[len++] = (uint8_t)client->closeCode;
 
-        // 处理文本数据
-        if(wsFrame->frameType == frameType_text) {
-            wsClientTextDataHandle(payload, payloadLen, client->socket);
-        }
+    IoVec vec;
+    ioVecSet(&vec, frame, len);
+    socketWritev(client->socket, &vec, 1, false);
+}
 
-    }
+static void destroyClient(EpochNode* node) {
+    Client* client = (Client*)((char*)node - offsetof(Client, retireNode));
+    pmdDeflaterDestroy(client->deflater);
+    mutexDestroy(&client->deflateLock);
+    mutexDestroy(&client->sendLock);
+    slabFree(clientSlab, client->handle);
+}
+
+// 从所属线程的客户链表及客户快照中移除客户并关闭连接，只能由所属线程调用
+// 客户结构在所有可能持有旧快照或句柄的线程退出后才会归还给客户表
+void removeClient(Client* client) {
+
+    IoThread* ioThread = client->owner;
+    SOCKET socket = client->socket;  // 保存需要被关闭的socket
 
-    // 一个帧接收完成并处理完毕后释放内存
-    if(wsFrame->state == frameState_success) {
-        freeWebSocketFrame(wsFrame);
+    if(client->prev) {
+        client->prev->next = client->next;
+    } else {
+        ioThread->clients = client->next;
     }
+    if(client->next) {
+        client->next->prev = client->prev;
+    }
+    ioThread->total--;
 
-    // 解析ws帧出错，释放内存并通知关闭连接
-    if (wsFrame->state == frameState_failure) {
-        freeWebSocketFrame(wsFrame);
-        return -1;
+    if(client->protocol == websocketProtocol) {
+        // 内存不足时无法复制快照，只能由closing阻止之后的入队
+        if(publishSnapshot(NULL, client) != 0) {
+            pluginLog("removeClient", 1, "Failed to publish client snapshot");
+        }
+        atomicAdd(&encodingClients[client->session.encoding], -1);
     }
 
-    // 传入的数据不止包含当前帧，包含下一帧的数据
-    if(consume != recvLen) {
-        return wsClientDataHandle(recvBuff + consume, recvLen - consume, client);
+    // 此后仍持有旧快照的广播线程不会再向该客户入队
+    mutexLock(&client->sendLock);
+    client->closing = true;
+
+    // 从待发送链表中移除
+    mutexLock(&ioThread->inboxLock);
+    for(Client** link = &ioThread->flushList; *link; link = &(*link)->nextFlush) {
+        if(*link == client) {
+            *link = client->nextFlush;
+            break;
+        }
+    }
+    if(client->coalescePending) {
+        Client* prev = NULL;
+        for(Client** link = &ioThread->coalesceHead; *link; prev = *link, link = &(*link)->nextCoalesce) {
+            if(*link == client) {
+                *link = client->nextCoalesce;
+                if(ioThread->coalesceTail == client) {
+                    ioThread->coalesceTail = prev;
+                }
+                break;
+            }
+        }
+        client->coalescePending = false;
     }
+    mutexUnlock(&ioThread->inboxLock);
 
-    return 0;
-}
+    if(client->closeCode != 0 && client->protocol == websocketProtocol && client->sendOffset == 0) {
+        sendCloseFrame(client);
+    }
 
-// 从客户数组中移除指定位置的客户，并关闭连接
-// 如果被移除的客户不在数组末尾，数组末尾的客户会移动到被移除的客户所在位置
-// 所以如果调用该函数时正在遍历客户数组，记得回退遍历位置
-void removeClient(int pos) {
+    freeSendQueue(client);
+    mutexUnlock(&client->sendLock);
 
-    SOCKET socket = clientSockets.clients[pos].socket;  // 保存需要被关闭的socket
+    pollerRemove(ioThread->poller, socket);
 
-    if(pos < clientSockets.total - 1) {      // 该socket不处于数组末尾 
-        // 将数组末尾的socket填到当前位置 
-        clientSockets.clients[pos] = clientSockets.clients[clientSockets.total - 1];
+    if(client->protocol == websocketProtocol) {
+        free(client->wsFrame);
     }
-    clientSockets.total--;
+    if(client->msgActive) {
+        finishMessage(client, false);
+    }
+    pmdInflaterDestroy(client->inflater);
+    client->inflater = NULL;
+    releaseRecvBuffer(client);
 
     struct linger so_linger;
     so_linger.l_onoff = 1;
@@ -159,180 +1358,590 @@ void removeClient(int pos) {
     setsockopt(socket, SOL_SOCKET, SO_LINGER, (const char*)&so_linger, sizeof(so_linger));
     closesocket(socket);
 
-    pluginLog("removeClient", 1, "Client socket closed, now length of clients: %d", clientSockets.total);
+    epochRetire(&client->retireNode, destroyClient);
+
+    long load = atomicAdd(&ioThread->load, -1);
+
+    pluginLog("removeClient", 1, "Client socket closed, now length of clients of thread %d: %ld", ioThread->id, load);
 }
 
-void receiveConnect(void) {
-    
-    SOCKET  clientSocket;
-    SOCKADDR_IN client; 
-    
-    // Accept a connection   
-    clientSocket = accept(serverSocket, (struct sockaddr*)&client, NULL);   
-
-    // 当连接数达到上限时拒绝连接
-    if(clientSockets.total >= MAX_CLIENT_NUM) {
-        closesocket(clientSocket);
-        return;
+// 选出负责连接数最少的I/O线程
+static IoThread* leastLoadedThread(void) {
+
+    IoThread* target = &ioThreads[0];
+    long minLoad = atomicLoad(&target->load);
+
+    for(int t = 1; t < ioThreadNum; t++) {
+        long load = atomicLoad(&ioThreads[t].load);
+        if(load < minLoad) {
+            minLoad = load;
+            target = &ioThreads[t];
+        }
     }
-    
-    if(clientSocket != INVALID_SOCKET) {
 
-        pluginLog("receiveConnect", 1, "Accepted client: %s:%d", inet_ntoa(client.sin_addr), ntohs(client.sin_port));
-        
-        clientSockets.clients[clientSockets.total].socket = clientSocket;
-        clientSockets.clients[clientSockets.total].protocol = socketProtocol;
-        clientSockets.total++;
+    return target;
+}
 
-        return;
+// 监听socket为非阻塞模式，一次可读通知需要接受所有排队中的连接
+// 接受的连接从客户表中分配客户结构后交给负责连接数最少的I/O线程
+// 因为文件描述符耗尽等原因停止接受时返回true，队列中可能还有连接，边缘触发下不会再有通知，需要稍后重试
+bool receiveConnect(void) {
+
+    SOCKET  clientSocket;
+    SOCKADDR_IN client;
+    socklen_t clientLen;
+
+    for(;;) {
+
+        clientLen = sizeof(client);
+
+        // Accept a connection
+        clientSocket = accept(serverSocket, (struct sockaddr*)&client, &clientLen);
+
+        if(clientSocket == INVALID_SOCKET) {
+            if(socketWouldBlock()) {
+                return false;
+            }
+            if(socketAcceptAborted()) {
+                continue;
+            }
+            pluginLog("receiveConnect", 1, "Accept failed: %d, will retry later", WSAGetLastError());
+            return true;
+        }
+
+        SlabHandle handle;
+        Client* newClient = NULL;
+
+        // 当连接数达到硬上限时拒绝连接
+        if(socketSetNonBlocking(clientSocket) != 0 || (newClient = slabAlloc(clientSlab, &handle)) == NULL) {
+            pluginLog("receiveConnect", 1, "Client limit reached or out of memory, connection rejected");
+            closesocket(clientSocket);
+            continue;
+        }
+
+        int count = slabCount(clientSlab);
+
+        if(count > clientSoftLimit && !overSoftLimit) {
+            pluginLog("receiveConnect", 1, "Number of clients %d exceeds the soft limit %d", count, clientSoftLimit);
+        }
+        overSoftLimit = count > clientSoftLimit;
+
+        IoThread* ioThread = leastLoadedThread();
+
+        pluginLog("receiveConnect", 1, "Accepted client: %s:%d, assigned to thread %d", inet_ntoa(client.sin_addr), ntohs(client.sin_port), ioThread->id);
+
+        newClient->socket = clientSocket;
+        newClient->protocol = socketProtocol;
+        newClient->handle = handle;
+        newClient->owner = ioThread;
+        newClient->prev = NULL;
+        newClient->wsFrame = NULL;
+        httpRequestInit(&newClient->httpRequest);
+        newClient->closeCode = 0;
+        newClient->recvBuff = NULL;
+        newClient->recvCapacity = newClient->recvStart = newClient->recvEnd = 0;
+        newClient->msgActive = false;
+        newClient->msgLen = newClient->msgCapacity = 0;
+        newClient->msgBuff = NULL;
+        newClient->msgStream = NULL;
+        newClient->msgCompressed = false;
+        utf8Reset(&newClient->utf8);
+        utf8Reset(&newClient->inflateUtf8);
+        newClient->deflateParams.enabled = false;
+        mutexInit(&newClient->deflateLock);
+        newClient->deflater = NULL;
+        newClient->deflateReset = false;
+        newClient->inflater = NULL;
+        mutexInit(&newClient->sendLock);
+        newClient->sendHead = newClient->sendTail = NULL;
+        newClient->lastCompressed = NULL;
+        newClient->sendOffset = 0;
+        newClient->queuedBytes = 0;
+        newClient->flushScheduled = false;
+        newClient->wantWrite = false;
+        newClient->closing = false;
+        newClient->nextFlush = NULL;
+        newClient->coalescePending = false;
+        newClient->nextCoalesce = NULL;
+
+        atomicAdd(&ioThread->load, 1);
+
+        mutexLock(&ioThread->inboxLock);
+        newClient->next = ioThread->inbox;
+        ioThread->inbox = newClient;
+        mutexUnlock(&ioThread->inboxLock);
+
+        pollerWakeup(ioThread->poller);
     }
+}
+
+// 释放还未注册到poller的客户，只有未被发布过的客户可以直接归还给客户表
+static void discardNewClient(Client* client) {
+    closesocket(client->socket);
+    mutexDestroy(&client->deflateLock);
+    mutexDestroy(&client->sendLock);
+    slabFree(clientSlab, client->handle);
+    atomicAdd(&client->owner->load, -1);
+}
+
+// 将acceptor线程交来的连接加入客户链表并注册到poller
+static void takeNewClients(IoThread* ioThread) {
 
-    int errCode = WSAGetLastError();
-    
-    // serverSocket不是一个套接字，即已经调用了serverStop，执行了closesocket(serverSocket)
-    if(errCode == WSAENOTSOCK) {
-        
-        pluginLog("receiveConnect", 1, "Closing all client sockets...");
+    mutexLock(&ioThread->inboxLock);
+    Client* newClient = ioThread->inbox;
+    ioThread->inbox = NULL;
+    mutexUnlock(&ioThread->inboxLock);
 
-        // 关闭所有客户端连接 
-        for(int i = 0; i < clientSockets.total; i++) {
-            closesocket(clientSockets.clients[i].socket);       
+    while(newClient) {
+
+        Client* next = newClient->next;
+
+        if(pollerAdd(ioThread->poller, newClient->socket, pollerEvent_read, newClient) != 0) {
+            pluginLog("takeNewClients", 1, "Failed to register client socket");
+            discardNewClient(newClient);
+        } else {
+            newClient->next = ioThread->clients;
+            if(ioThread->clients) {
+                ioThread->clients->prev = newClient;
+            }
+            ioThread->clients = newClient;
+            ioThread->total++;
         }
-        clientSockets.total = 0;
-        
-        pluginLog("receiveConnect", 1, "Threads will exit");
-        ExitThread(0);     // 退出 
+
+        newClient = next;
     }
-    
-    pluginLog("receiveConnect", 1, "Accept failed: %d", errCode);
 }
 
-void receiveComingData(const char* path) {
+// 解析接收缓冲区中的握手请求，请求接收完后完成协议升级
+// 返回-1代表需要关闭连接，请求之后的数据留在缓冲区中作为WebSocket帧处理
+static int upgradeClient(Client* client) {
+
+    const char* request = client->recvBuff + client->recvStart;
+    int requestLen = httpParseRequest(&client->httpRequest, request, client->recvEnd - client->recvStart);
+
+    // 请求未接收完，等待更多数据
+    if(requestLen == 0) {
+        return 0;
+    }
+
+    if(wsShakeHands(request, &client->httpRequest, client->socket, serverPath, permessageDeflate, eventNames,
+        &client->session, &client->deflateParams) != 0) {
+        return -1;
+    }
+
+    client->recvStart += requestLen;
+
+    if((client->wsFrame = malloc(sizeof(WsFrame))) == NULL) {
+        return -1;
+    }
+
+    initWsFrameStruct(client->wsFrame);         // 初始化ws帧结构
+    client->protocol = websocketProtocol;
+    atomicAdd(&encodingClients[client->session.encoding], 1);
+
+    if(publishSnapshot(client, NULL) != 0) {
+        pluginLog("upgradeClient", 1, "Failed to publish client snapshot");
+        return -1;
+    }
+
+    return 0;
+}
 
-    #define RECV_BUFLEN 0X40000
+// 将客户端socket中的所有数据直接读入客户的接收缓冲区并处理，返回-1代表连接已被移除
+int receiveClientData(Client* client) {
 
-    char recvbuf[RECV_BUFLEN];
     int iResult;
 
-    int ret; 
-    fd_set fdread; 
-    struct timeval tv = {1, 0}; 
- 
-    receivingDataLoop:
-        
-    FD_ZERO(&fdread); 
-    FD_SET(serverSocket, &fdread);
-    for(int i = 0; i < clientSockets.total; i++) {     
-        FD_SET(clientSockets.clients[i].socket, &fdread);   
-    }
-    
-    ret = select(0, &fdread, NULL, NULL, &tv);
-    
-    if(ret == 0) {
-        goto receivingDataLoop;     // select的等待时间到达，开始下一轮等待 
-    }
-
-    if(FD_ISSET(serverSocket, &fdread)) {
-        receiveConnect();
-    }
-    
-    for(int i = 0; i < clientSockets.total; i++) {
-
-        Client* client = &clientSockets.clients[i];
-        
-        if(!FD_ISSET(client->socket, &fdread)) {
-            continue;
+    for(;;) {
+
+        if(reserveRecvSpace(client) != 0) {
+            pluginLog("receiveComingData", 1, "Failed to reserve receive buffer");
+            removeClient(client);
+            return -1;
         }
 
-        iResult = recv(client->socket, recvbuf, RECV_BUFLEN, 0);
+        iResult = recv(client->socket, client->recvBuff + client->recvEnd, client->recvCapacity - client->recvEnd, 0);
 
         if(iResult > 0) {
-            
+
             pluginLog("receiveComingData", 0, "Bytes received: %d", iResult);
-            
+
+            client->recvEnd += iResult;
+
             // 协议升级
-            if(client->protocol == socketProtocol) {
-                int result = wsShakeHands(recvbuf, iResult, client->socket, path);
-                if(result != 0) {
-                    removeClient(i--);
-                } else {
-                    client->protocol = websocketProtocol;
-                    initWsFrameStruct(&client->wsFrame);        // 初始化ws帧结构
-                }
+            if(client->protocol == socketProtocol && upgradeClient(client) != 0) {
+                removeClient(client);
+                return -1;
             }
-            // WebSocket通信
-            else if(client->protocol == websocketProtocol) {
-                int result = wsClientDataHandle(recvbuf, iResult, client);
+
+            // WebSocket通信，与握手请求一起到达的帧在升级后立即处理
+            if(client->protocol == websocketProtocol) {
+                int result = wsClientDataHandle(client);
                 if(result == -1) {
-                    removeClient(i--);
+                    removeClient(client);
+                    return -1;
+                }
+            }
+
+            // 数据已全部处理，为大帧单独申请的缓冲区不再保留
+            if(client->recvStart == client->recvEnd) {
+                if(client->recvCapacity != RECV_BLOCK_SIZE) {
+                    releaseRecvBuffer(client);
+                } else {
+                    client->recvStart = client->recvEnd = 0;
                 }
             }
 
+            continue;
+        }
+
+        if(iResult == SOCKET_ERROR && socketWouldBlock()) {
+            // 数据已读完，等待下一次可读通知，没有未处理完的帧时归还接收缓冲区
+            if(client->recvStart == client->recvEnd) {
+                releaseRecvBuffer(client);
+            }
+            return 0;
+        }
+
+        if(iResult == 0) {
+            // 客户端礼貌的关闭连接
+            pluginLog("receiveComingData", 1, "Connection closing...");
         } else {
+            // 客户端异常关闭连接等情况
+            pluginLog("receiveComingData", 1, "Recv failed: %d", WSAGetLastError());
+        }
 
-            if(iResult == 0) {
-                // 客户端礼貌的关闭连接 
-                pluginLog("receiveComingData", 1, "Connection closing...");
-            } else {
-                // 客户端异常关闭连接等情况
-                pluginLog("receiveComingData", 1, "Recv failed: %d", WSAGetLastError());
+        removeClient(client);
+        return -1;
+    }
+}
+
+// 发送待发送链表中所有客户的发送队列
+static void flushScheduledClients(IoThread* ioThread) {
+
+    mutexLock(&ioThread->inboxLock);
+    Client* client = ioThread->flushList;
+    ioThread->flushList = NULL;
+    mutexUnlock(&ioThread->inboxLock);
+
+    while(client) {
+        Client* next = client->nextFlush;
+        if(flushClient(client) == -1) {
+            removeClient(client);
+        }
+        client = next;
+    }
+}
+
+// 发送合并窗口已到期的客户的发送队列，返回距离下一个截止时间的微秒数，没有等待中的客户时返回-1
+// 客户出队后其它线程可能立即再次入队并修改nextCoalesce，因此按批取出到局部数组后再发送
+static int64_t flushExpiredClients(IoThread* ioThread) {
+
+    #define COALESCE_BATCH 64
+
+    Client* expired[COALESCE_BATCH];
+    int64_t wait;
+    int count;
+
+    do {
+        uint64_t now = clockMicros();
+        wait = -1;
+        count = 0;
+
+        mutexLock(&ioThread->inboxLock);
+        while(ioThread->coalesceHead && count < COALESCE_BATCH) {
+            Client* client = ioThread->coalesceHead;
+            if(client->coalesceDeadline > now) {
+                wait = (int64_t)(client->coalesceDeadline - now);
+                break;
+            }
+            ioThread->coalesceHead = client->nextCoalesce;
+            client->coalescePending = false;
+            expired[count++] = client;
+        }
+        if(ioThread->coalesceHead == NULL) {
+            ioThread->coalesceTail = NULL;
+        }
+        mutexUnlock(&ioThread->inboxLock);
+
+        for(int i = 0; i < count; i++) {
+            if(flushClient(expired[i]) == -1) {
+                removeClient(expired[i]);
+            }
+        }
+    } while(count == COALESCE_BATCH);
+
+    return wait;
+}
+
+// I/O线程，负责所属连接的握手、帧解析、RPC调用及发送
+void receiveComingData(void* arg) {
+
+    #define MAX_EVENTS 64
+
+    IoThread* ioThread = arg;
+    PollerEvent events[MAX_EVENTS];
+    int64_t coalesceWait = -1;
+
+    ioThread->threadId = threadCurrentId();
+
+    while(serverRunning) {
+
+        // 等待时间最长为1秒，以便及时发现serverStop，有等待合并发送的客户时等到最早的截止时间
+        int64_t timeout = coalesceWait >= 0 && coalesceWait < 1000000 ? coalesceWait : 1000000;
+        int n = pollerWait(ioThread->poller, events, MAX_EVENTS, timeout);
+
+        if(n < 0) {
+            pluginLog("receiveComingData", 1, "Poller wait failed: %d", WSAGetLastError());
+            continue;
+        }
+
+        for(int i = 0; i < n; i++) {
+
+            Client* client = events[i].data;
+
+            if(events[i].events & (pollerEvent_read | pollerEvent_error)) {
+                if(receiveClientData(client) == -1) {
+                    continue;       // 连接已被移除
+                }
+            }
+
+            if(events[i].events & pollerEvent_write) {
+                if(flushClient(client) == -1) {
+                    removeClient(client);
+                }
             }
-            
-            removeClient(i--);
         }
+
+        takeNewClients(ioThread);
+        coalesceWait = flushExpiredClients(ioThread);
+        flushScheduledClients(ioThread);
+        epochReclaim();     // 回收已经没有广播线程持有的快照及客户
+    }
+
+    pluginLog("receiveComingData", 1, "Closing all client sockets of thread %d...", ioThread->id);
+
+    // 关闭所有客户端连接，包括还未被取出的新连接
+    while(ioThread->clients) {
+        removeClient(ioThread->clients);
+    }
+
+    while(ioThread->inbox) {
+        Client* next = ioThread->inbox->next;
+        discardNewClient(ioThread->inbox);
+        ioThread->inbox = next;
+    }
+
+    pluginLog("receiveComingData", 1, "Thread %d will exit", ioThread->id);
+}
+
+// acceptor线程，只负责接受连接
+void acceptConnections(void* arg) {
+
+    PollerEvent events[1];
+    bool retry = false;
+
+    pluginLog("acceptConnections", 1, "Poller backend: %s, unmask backend: %s, UTF-8 backend: %s, SHA-1 backend: %s, I/O threads: %d", pollerBackendName(), wsUnmaskBackendName(), utf8BackendName(), wsAcceptKeyBackendName(), ioThreadNum);
+
+    while(serverRunning) {
+        // 上次因为资源不足没有接受完时，等待超时后即使没有新的通知也再接受一次
+        if(pollerWait(acceptPoller, events, 1, 1000000) > 0 || retry) {
+            retry = receiveConnect();
+        }
+    }
+}
+
+// 通知所有I/O线程退出，等待其关闭所有连接并释放线程资源
+static void stopIoThreads(void) {
+
+    serverRunning = false;
+
+    for(int t = 0; t < ioThreadNum; t++) {
+        pollerWakeup(ioThreads[t].poller);
+        threadJoin(ioThreads[t].thread);
+    }
+
+    for(int t = 0; t < ioThreadNum; t++) {
+        pollerDestroy(ioThreads[t].poller);
+        mutexDestroy(&ioThreads[t].inboxLock);
+        bufferPoolDestroy(&ioThreads[t].recvPool);
+    }
+
+    ioThreadNum = 0;
+
+    // 所有客户已被移除，不会再有广播线程读取快照
+    epochShutdown();
+    mutexDestroy(&snapshotLock);
+
+    for(int i = 0; i < DEFLATE_WINDOW_SLOTS; i++) {
+        pmdDeflaterDestroy(broadcastDeflaters[i]);
+        broadcastDeflaters[i] = NULL;
+    }
+    mutexDestroy(&broadcastDeflateLock);
+    slabDestroy(clientSlab);
+    clientSlab = NULL;
+}
+
+// 启动I/O线程，失败时停止已经启动的线程
+static int startIoThreads(int total, int hardLimit) {
+
+    clientSlab = slabCreate(sizeof(Client), hardLimit);
+    if(clientSlab == NULL) {
+        pluginLog("ServerStart", 1, "Failed to create client table");
+        return -1;
+    }
+
+    ioThreadNum = 0;
+    clientSnapshot = NULL;
+    mutexInit(&snapshotLock);
+    mutexInit(&broadcastDeflateLock);
+    epochInit();
+
+    for(int t = 0; t < total; t++) {
+
+        IoThread* ioThread = &ioThreads[t];
+
+        ioThread->id = t;
+        ioThread->total = 0;
+        ioThread->clients = NULL;
+        ioThread->inbox = NULL;
+        ioThread->flushList = NULL;
+        ioThread->coalesceHead = ioThread->coalesceTail = NULL;
+        ioThread->load = 0;
+        ioThread->poller = pollerCreate();
+
+        if(ioThread->poller == NULL) {
+            pluginLog("ServerStart", 1, "Poller initialization failed");
+            stopIoThreads();
+            return -1;
+        }
+
+        mutexInit(&ioThread->inboxLock);
+        bufferPoolInit(&ioThread->recvPool, RECV_BLOCK_SIZE, RECV_POOL_MAX_FREE);
+
+        if(threadCreate(&ioThread->thread, receiveComingData, ioThread) != 0) {
+            pluginLog("ServerStart", 1, "Failed to create I/O thread");
+            pollerDestroy(ioThread->poller);
+            mutexDestroy(&ioThread->inboxLock);
+            bufferPoolDestroy(&ioThread->recvPool);
+            stopIoThreads();
+            return -1;
+        }
+
+        ioThreadNum = t + 1;
     }
 
-    goto receivingDataLoop;
+    return 0;
 }
 
-int serverStart(const char* address, u_short port, const char* path) {
+int serverStart(const char* address, u_short port, const char* path, const ServerOptions* options) {
 
-    WSADATA wsaData;
-    
-    int iResult = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    int iResult = socketStartup();
     if(iResult != 0) {
         pluginLog("ServerStart", 1, "WSAStartup failed");
         return -1;
     }
-    
+
     struct sockaddr_in sockAddr;
-    
+
     ZeroMemory(&sockAddr, sizeof(sockAddr));
     sockAddr.sin_family = PF_INET;
     sockAddr.sin_addr.s_addr = inet_addr(address);
     sockAddr.sin_port = htons(port);
-    
+
     serverSocket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    
+
     if(serverSocket == INVALID_SOCKET) {
         pluginLog("ServerStart", 1, "Error at socket(): %d", WSAGetLastError());
-        WSACleanup();
+        socketCleanup();
         return -1;
     }
-    
+
     if(bind(serverSocket, (SOCKADDR*)&sockAddr, sizeof(SOCKADDR)) == SOCKET_ERROR) {
         pluginLog("ServerStart", 1, "Bind failed with error: %d", WSAGetLastError());
         closesocket(serverSocket);
-        WSACleanup();
+        socketCleanup();
         return -1;
     }
-    
+
     if(listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) {
         pluginLog("ServerStart", 1, "Listen failed with error: %d", WSAGetLastError());
         closesocket(serverSocket);
-        WSACleanup();
+        socketCleanup();
+        return -1;
+    }
+
+    acceptPoller = pollerCreate();
+
+    if(acceptPoller == NULL || socketSetNonBlocking(serverSocket) != 0 ||
+       pollerAdd(acceptPoller, serverSocket, pollerEvent_read, NULL) != 0) {
+        pluginLog("ServerStart", 1, "Poller initialization failed");
+        if(acceptPoller) pollerDestroy(acceptPoller);
+        closesocket(serverSocket);
+        socketCleanup();
+        return -1;
+    }
+
+    int threads = options->ioThreads;
+    if(threads < 1) threads = 1;
+    if(threads > MAX_IO_THREADS) threads = MAX_IO_THREADS;
+
+    wsUnmaskInit();
+    utf8Init();
+    wsAcceptKeyInit();
+
+    maxMessageSize = options->maxMessageSize > 0 ? options->maxMessageSize : DEFAULT_MAX_MESSAGE_SIZE;
+    maxFrameSize = options->maxFrameSize > 0 ? options->maxFrameSize : DEFAULT_MAX_FRAME_SIZE;
+    if(maxFrameSize > RECV_MAX_FRAME - WS_MAX_HEADER_LEN) maxFrameSize = RECV_MAX_FRAME - WS_MAX_HEADER_LEN;
+    messageStream = options->messageStream;
+    eventNames = options->eventNames;
+    permessageDeflate = options->permessageDeflate;
+    compressionThreshold = options->compressionThreshold >= 0 ? options->compressionThreshold : DEFAULT_COMPRESSION_THRESHOLD;
+    fragmentSize = options->fragmentSize >= 0 ? options->fragmentSize : DEFAULT_FRAGMENT_SIZE;
+    coalesceDelay = options->coalesceDelay > 0 ? options->coalesceDelay : 0;
+    coalesceBytes = options->coalesceBytes > 0 ? options->coalesceBytes : DEFAULT_COALESCE_BYTES;
+
+    serverPath = path;
+    serverRunning = true;
+
+    clientSoftLimit = options->clientSoftLimit;
+    overSoftLimit = false;
+
+    if(startIoThreads(threads, options->clientHardLimit) != 0) {
+        pollerDestroy(acceptPoller);
+        closesocket(serverSocket);
+        socketCleanup();
+        return -1;
+    }
+
+    if(threadCreate(&acceptThread, acceptConnections, NULL) != 0) {
+        pluginLog("ServerStart", 1, "Failed to create server thread");
+        stopIoThreads();
+        pollerDestroy(acceptPoller);
+        closesocket(serverSocket);
+        socketCleanup();
         return -1;
     }
 
-    clientSockets.total = 0;
-    
-    DWORD dwThreadId;
-    HANDLE hHandle = CreateThread(NULL, 0, (void*)receiveComingData, (PVOID)path, 0, &dwThreadId);
-    
     return 0;
 }
 
+// 通知所有线程退出并等待其关闭所有连接
 void serverStop(void) {
+
+    if(!serverRunning) {
+        return;     // 服务器未启动或启动失败
+    }
+
+    serverRunning = false;
+
+    pollerWakeup(acceptPoller);
+    threadJoin(acceptThread);
+
+    stopIoThreads();
+
+    pollerRemove(acceptPoller, serverSocket);
+    pollerDestroy(acceptPoller);
     closesocket(serverSocket);
-    WSACleanup();
+    socketCleanup();
 }
@@ -1,13 +1,80 @@
-#include <winsock2.h>
+#include "platform.h"
 #include "ws.h"
 
 #ifndef QLWS_SERVER_H
 
 #define QLWS_SERVER_H
 
-int wsFrameSend(SOCKET socket, const char* buff, int len, FrameType type);
+#define MAX_IO_THREADS 16
+
+// 客户结构只在server.c内部使用
+typedef struct Client Client;
+
+// 分片消息的流式处理回调，使解析器可以在分片到达时就开始处理，而不必等待整条消息
+// 压缩消息（包括未分片的）也通过该回调处理，data收到的是解压后的数据
+// 三个函数都在连接所属的I/O线程中调用
+typedef struct MessageStream {
+    // 收到分片消息的首个分片时调用，返回值作为之后调用的上下文
+    // 返回NULL代表不流式处理该消息，由服务器拼接后整体交给wsClientTextDataHandle
+    void* (*begin)(Client* client);
+    // 每个分片的载荷到达时调用，返回-1会关闭连接
+    int (*data)(void* context, const char* data, uint64_t len);
+    // 最后一个分片处理完毕后调用，complete为false代表连接在消息结束前被关闭
+    void (*end)(void* context, bool complete);
+} MessageStream;
+
+typedef struct ServerOptions {
+    int ioThreads;                          // I/O线程数量，客户端连接会分配给连接数最少的线程
+    int clientSoftLimit;                    // 连接数超过该值时打印警告
+    int clientHardLimit;                    // 连接数达到该值时拒绝新连接，小于1时只受客户表本身的上限限制
+    uint64_t maxFrameSize;                  // 单个帧载荷的最大长度，帧头解析后立即检查，超过时以1009关闭连接，为0时使用默认值
+    uint64_t maxMessageSize;                // 单条消息（包括拼接后的分片消息）的最大长度，超过时以1009关闭连接，为0时使用默认值
+    const MessageStream* messageStream;     // 为NULL时分片消息拼接完整后再处理
+    const char* const* eventNames;          // 以NULL结尾的事件名表，最多WS_MAX_EVENTS个，客户端握手时可以通过查询参数events按名称订阅
+    bool permessageDeflate;                 // 是否接受客户端的permessage-deflate压缩请求
+    int compressionThreshold;               // 不短于该长度的文本消息才压缩发送，小于0时使用默认值
+    int fragmentSize;                       // 超过该长度的消息拆成多个分片发送，控制帧可以夹在分片之间，为0时不分片，小于0时使用默认值
+    int coalesceDelay;                      // 合并发送的最长延迟（微秒），窗口内入队的帧通过一次向量写发送，控制帧不等待，为0时不合并
+    int coalesceBytes;                      // 合并发送时队列积压达到该字节数立即发送，小于1时使用默认值
+} ServerOptions;
+
+typedef struct ServerStats {
+    uint64_t broadcasts;            // 广播次数
+    uint64_t broadcastBytesCopied;  // 广播时拷贝载荷的字节数，只有wsFrameSendToAll会拷贝，wsFrameSendToAllOwned不拷贝
+    uint64_t deflateBytesIn;        // 压缩发送的消息压缩前的总字节数
+    uint64_t deflateBytesOut;       // 压缩发送的消息压缩后的总字节数
+    uint64_t bufferedBytes;         // 当前所有连接的接收缓冲区及分片拼接缓冲区占用的字节数
+    uint64_t queuedBytes;           // 当前所有连接的发送队列中尚未发送的字节数
+    uint64_t sendCalls;             // 发送队列的向量写次数
+    uint64_t framesSent;            // 通过发送队列完整发送的帧数，与sendCalls之比为平均每次系统调用发送的帧数
+    int clients;                    // 当前连接数
+    int clientCapacity;             // 客户表已申请的槽位数
+} ServerStats;
+
+// 客户句柄，包含客户表槽位的代数，客户断开后句柄失效，可以安全地跨线程保存
+typedef uint64_t ClientHandle;
+
+// 带Owned后缀的发送函数接管malloc申请的buff，载荷直接作为帧的一部分发送，不再拷贝
+// 其它发送函数会拷贝一份数据，buff在返回后即可释放
+// 发给单个客户的消息（RPC回复等）优先于尚未开始发送的广播消息，控制帧在下一个分片边界发送
+int wsFrameSend(Client* client, const char* buff, int len, FrameType type);
+int wsFrameSendOwned(Client* client, char* buff, int len, FrameType type);
+ClientHandle wsClientHandle(Client* client);
+int wsFrameSendToHandle(ClientHandle handle, const char* buff, int len, FrameType type);
 void wsFrameSendToAll(const char* buff, int len, FrameType type);
-int serverStart(const char* address, u_short port, const char* path);
+void wsFrameSendToAllOwned(char* buff, int len, FrameType type);
+
+// 事件广播，event为事件在ServerOptions.eventNames中的下标，只发给订阅了该事件的客户
+// 每个客户收到其握手时协商的编码对应的载荷，payloads按WsEncoding索引
+void wsEventSendToAllOwned(int event, char* payloads[wsEncoding_count], const int lens[wsEncoding_count]);
+
+// 当前有已握手的客户使用的编码，第i位对应WsEncoding中的第i个编码，广播前据此决定需要序列化哪些载荷
+uint32_t wsEncodingsInUse(void);
+
+// 客户握手时协商的编码，RPC回复需要使用该编码
+WsEncoding wsClientEncoding(Client* client);
+int serverStart(const char* address, u_short port, const char* path, const ServerOptions* options);
 void serverStop(void);
+void serverGetStats(ServerStats* stats);
 
 #endif
@@ -0,0 +1,174 @@
+#include "platform.h"
+#include <stdlib.h>
+#include "slab.h"
+
+// 槽位按块申请，块目录大小固定，已申请的块永不移动，slabGet因此可以无锁访问
+#define SLAB_CHUNK_SHIFT 8
+#define SLAB_CHUNK_SIZE (1 << SLAB_CHUNK_SHIFT)
+#define SLAB_MAX_CHUNKS (SLAB_MAX_OBJECTS / SLAB_CHUNK_SIZE)
+#define SLAB_NO_SLOT 0XFFFFFFFF
+
+// 槽位头部，代数为奇数时槽位已被分配
+typedef struct SlabSlot {
+    AtomicLong generation;
+    uint32_t   nextFree;        // 空闲链表的下一个槽位
+} SlabSlot;
+
+// 对象紧跟在槽位头部之后，按16字节对齐
+#define SLAB_HEADER_SIZE ((sizeof(SlabSlot) + 15) & ~(size_t)15)
+
+struct Slab {
+    Mutex    lock;              // 保护以下除chunks外的字段，及块的申请
+    size_t   slotSize;
+    int      limit;
+    int      count;             // 已分配的对象数量
+    int      chunkCount;
+    uint32_t freeHead;          // 空闲槽位链表
+    char* volatile chunks[SLAB_MAX_CHUNKS];
+};
+
+static SlabSlot* slotAt(Slab* slab, char* chunk, uint32_t index) {
+    return (SlabSlot*)(chunk + (size_t)(index & (SLAB_CHUNK_SIZE - 1)) * slab->slotSize);
+}
+
+Slab* slabCreate(size_t objectSize, int limit) {
+
+    Slab* slab = malloc(sizeof(Slab));
+    if(slab == NULL) {
+        return NULL;
+    }
+
+    mutexInit(&slab->lock);
+    slab->slotSize = SLAB_HEADER_SIZE + ((objectSize + 15) & ~(size_t)15);
+    slab->limit = limit < 1 || limit > SLAB_MAX_OBJECTS ? SLAB_MAX_OBJECTS : limit;
+    slab->count = 0;
+    slab->chunkCount = 0;
+    slab->freeHead = SLAB_NO_SLOT;
+
+    for(int i = 0; i < SLAB_MAX_CHUNKS; i++) {
+        slab->chunks[i] = NULL;
+    }
+
+    return slab;
+}
+
+void slabDestroy(Slab* slab) {
+    for(int i = 0; i < slab->chunkCount; i++) {
+        free(slab->chunks[i]);
+    }
+    mutexDestroy(&slab->lock);
+    free(slab);
+}
+
+// 申请一个新块并将其槽位加入空闲链表，需要持有锁
+static int growSlab(Slab* slab) {
+
+    if(slab->chunkCount >= SLAB_MAX_CHUNKS) {
+        return -1;
+    }
+
+    char* chunk = malloc(slab->slotSize * SLAB_CHUNK_SIZE);
+    if(chunk == NULL) {
+        return -1;
+    }
+
+    uint32_t base = (uint32_t)slab->chunkCount << SLAB_CHUNK_SHIFT;
+
+    // 倒序加入，使低下标的槽位先被使用
+    for(int i = SLAB_CHUNK_SIZE - 1; i >= 0; i--) {
+        SlabSlot* slot = slotAt(slab, chunk, i);
+        slot->generation = 0;
+        slot->nextFree = slab->freeHead;
+        slab->freeHead = base + i;
+    }
+
+    atomicStorePtr((void* volatile*)&slab->chunks[slab->chunkCount], chunk);
+    slab->chunkCount++;
+
+    return 0;
+}
+
+void* slabAlloc(Slab* slab, SlabHandle* handle) {
+
+    void* object = NULL;
+
+    mutexLock(&slab->lock);
+
+    if(slab->count >= slab->limit) {
+        goto slabAllocEnd;
+    }
+
+    if(slab->freeHead == SLAB_NO_SLOT && growSlab(slab) != 0) {
+        goto slabAllocEnd;
+    }
+
+    uint32_t index = slab->freeHead;
+    SlabSlot* slot = slotAt(slab, slab->chunks[index >> SLAB_CHUNK_SHIFT], index);
+
+    slab->freeHead = slot->nextFree;
+    slab->count++;
+
+    uint32_t generation = (uint32_t)atomicAdd(&slot->generation, 1);
+
+    *handle = ((SlabHandle)generation << 32) | index;
+    object = (char*)slot + SLAB_HEADER_SIZE;
+
+    slabAllocEnd:
+    mutexUnlock(&slab->lock);
+    return object;
+}
+
+void slabFree(Slab* slab, SlabHandle handle) {
+
+    uint32_t index = (uint32_t)handle;
+
+    mutexLock(&slab->lock);
+
+    SlabSlot* slot = slotAt(slab, slab->chunks[index >> SLAB_CHUNK_SHIFT], index);
+
+    if((uint32_t)slot->generation == (uint32_t)(handle >> 32)) {
+        atomicAdd(&slot->generation, 1);       // 变为偶数，旧句柄失效
+        slot->nextFree = slab->freeHead;
+        slab->freeHead = index;
+        slab->count--;
+    }
+
+    mutexUnlock(&slab->lock);
+}
+
+void* slabGet(Slab* slab, SlabHandle handle) {
+
+    uint32_t index = (uint32_t)handle;
+    uint32_t generation = (uint32_t)(handle >> 32);
+
+    if((generation & 1) == 0 || (index >> SLAB_CHUNK_SHIFT) >= SLAB_MAX_CHUNKS) {
+        return NULL;
+    }
+
+    char* chunk = atomicLoadPtr((void* volatile*)&slab->chunks[index >> SLAB_CHUNK_SHIFT]);
+    if(chunk == NULL) {
+        return NULL;
+    }
+
+    SlabSlot* slot = slotAt(slab, chunk, index);
+
+    if((uint32_t)atomicLoad(&slot->generation) != generation) {
+        return NULL;
+    }
+
+    return (char*)slot + SLAB_HEADER_SIZE;
+}
+
+int slabCount(Slab* slab) {
+    mutexLock(&slab->lock);
+    int count = slab->count;
+    mutexUnlock(&slab->lock);
+    return count;
+}
+
+int slabCapacity(Slab* slab) {
+    mutexLock(&slab->lock);
+    int capacity = slab->chunkCount * SLAB_CHUNK_SIZE;
+    mutexUnlock(&slab->lock);
+    return capacity;
+}
@@ -0,0 +1,34 @@
+#include "platform.h"
+
+#ifndef QLWS_SLAB_H
+
+#define QLWS_SLAB_H
+
+// 按块增长的定长对象分配器，对象地址在释放前保持不变
+// 每个槽位带有代数，句柄由代数和下标组成，槽位被释放或重新分配后旧句柄失效
+// 分配与释放都是O(1)，在内部加锁；slabGet不加锁，可以在任意线程调用
+
+typedef uint64_t SlabHandle;    // 高32位为代数，低32位为下标，0为无效句柄
+
+typedef struct Slab Slab;
+
+// limit为最多能分配的对象数量，不能超过SLAB_MAX_OBJECTS，小于1时使用SLAB_MAX_OBJECTS
+#define SLAB_MAX_OBJECTS 0X100000
+
+Slab* slabCreate(size_t objectSize, int limit);
+
+// 调用者需要保证所有对象已被释放或不会再被使用
+void slabDestroy(Slab* slab);
+
+// 达到数量上限或内存不足时返回NULL，对象内容未初始化
+void* slabAlloc(Slab* slab, SlabHandle* handle);
+void slabFree(Slab* slab, SlabHandle handle);
+
+// 句柄已失效时返回NULL
+// 调用者需要自行保证返回的对象在使用期间不会被释放
+void* slabGet(Slab* slab, SlabHandle handle);
+
+int slabCount(Slab* slab);
+int slabCapacity(Slab* slab);
+
+#endif
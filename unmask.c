@@ -0,0 +1,119 @@
+#include <string.h>
+#include "unmask.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define UNMASK_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*UnmaskProc)(unsigned char* data, size_t len, uint32_t key);
+
+static UnmaskProc unmaskProc;
+static const char* unmaskBackend;
+
+// 以下实现中key为已按offset旋转的4字节掩码，按内存顺序存放在uint32_t中
+
+static void unmaskTail(unsigned char* data, size_t len, uint32_t key) {
+    uint8_t mask[4];
+    memcpy(mask, &key, 4);
+    for(size_t i = 0; i < len; i++) {
+        data[i] ^= mask[i & 3];
+    }
+}
+
+// 每次处理8字节，通过memcpy读写以允许非对齐地址
+static void unmaskWord(unsigned char* data, size_t len, uint32_t key) {
+
+    uint64_t key64 = (uint64_t)key << 32 | key;
+    size_t i = 0;
+
+    for(; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word ^= key64;
+        memcpy(data + i, &word, 8);
+    }
+
+    unmaskTail(data + i, len - i, key);
+}
+
+#ifdef UNMASK_X86
+
+__attribute__((target("sse2")))
+static void unmaskSSE2(unsigned char* data, size_t len, uint32_t key) {
+
+    __m128i key128 = _mm_set1_epi32((int)key);
+    size_t i = 0;
+
+    for(; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+        _mm_storeu_si128((__m128i*)(data + i), _mm_xor_si128(block, key128));
+    }
+
+    // 16是4的倍数，剩余部分的掩码相位不变
+    unmaskWord(data + i, len - i, key);
+}
+
+__attribute__((target("avx2")))
+static void unmaskAVX2(unsigned char* data, size_t len, uint32_t key) {
+
+    __m256i key256 = _mm256_set1_epi32((int)key);
+    size_t i = 0;
+
+    for(; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(data + i + 32));
+        _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(a, key256));
+        _mm256_storeu_si256((__m256i*)(data + i + 32), _mm256_xor_si256(b, key256));
+    }
+
+    for(; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(data + i));
+        _mm256_storeu_si256((__m256i*)(data + i), _mm256_xor_si256(a, key256));
+    }
+
+    // 进入标量代码前清除YMM寄存器的高位，否则之后的SSE指令会因状态切换变得很慢
+    _mm256_zeroupper();
+    unmaskWord(data + i, len - i, key);
+}
+
+#endif
+
+void wsUnmaskInit(void) {
+
+    unmaskProc = unmaskWord;
+    unmaskBackend = "word";
+
+#ifdef UNMASK_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        unmaskProc = unmaskAVX2;
+        unmaskBackend = "avx2";
+    } else if(__builtin_cpu_supports("sse2")) {
+        unmaskProc = unmaskSSE2;
+        unmaskBackend = "sse2";
+    }
+#endif
+}
+
+const char* wsUnmaskBackendName(void) {
+    return unmaskBackend;
+}
+
+void wsUnmask(unsigned char* data, size_t len, const uint8_t mask[4], uint64_t offset) {
+
+    uint8_t rotated[4];
+    uint32_t key;
+
+    for(int i = 0; i < 4; i++) {
+        rotated[i] = mask[(offset + i) & 3];
+    }
+    memcpy(&key, rotated, 4);
+
+    // 短载荷（如心跳、小请求）直接逐字节处理
+    if(len < 16) {
+        unmaskTail(data, len, key);
+    } else {
+        unmaskProc(data, len, key);
+    }
+}
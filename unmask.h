@@ -0,0 +1,18 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef QLWS_UNMASK_H
+
+#define QLWS_UNMASK_H
+
+// WebSocket载荷掩码解码，x86下根据CPU在运行时选择AVX2、SSE2或按机器字处理的实现
+
+// 选择实现，需要在第一次调用wsUnmask前调用
+void wsUnmaskInit(void);
+const char* wsUnmaskBackendName(void);
+
+// 原地解码载荷中从offset开始的len字节，offset用于确定掩码的起始字节
+// 载荷可以分多次在接收到数据后逐段解码
+void wsUnmask(unsigned char* data, size_t len, const uint8_t mask[4], uint64_t offset);
+
+#endif
@@ -0,0 +1,375 @@
+#include <string.h>
+#include "utf8.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define UTF8_X86
+#include <immintrin.h>
+#endif
+
+// 以下实现中prev为已校验数据的最后3个字节，key为已按offset旋转的4字节掩码，masked为false时不解码
+typedef bool (*Utf8Proc)(uint8_t prev[3], unsigned char* data, size_t len, uint32_t key, bool masked);
+
+static Utf8Proc utf8Proc;
+static const char* utf8Backend;
+
+// 逐字节校验的状态：need为当前序列还缺少的字节数，lo和hi为下一个字节的取值范围
+typedef struct ScalarState {
+    int need;
+    uint8_t lo;
+    uint8_t hi;
+} ScalarState;
+
+// 非法组合（超长编码、代理项、超过U+10FFFF）都通过收窄第二个字节的范围排除
+static bool scalarStep(ScalarState* st, uint8_t c) {
+
+    if(st->need == 0) {
+        if(c < 0x80) {
+            return true;
+        } else if(c < 0xC2) {
+            return false;
+        } else if(c < 0xE0) {
+            st->need = 1;
+            st->lo = 0x80;
+            st->hi = 0xBF;
+        } else if(c < 0xF0) {
+            st->need = 2;
+            st->lo = c == 0xE0 ? 0xA0 : 0x80;
+            st->hi = c == 0xED ? 0x9F : 0xBF;
+        } else if(c < 0xF5) {
+            st->need = 3;
+            st->lo = c == 0xF0 ? 0x90 : 0x80;
+            st->hi = c == 0xF4 ? 0x8F : 0xBF;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    if(c < st->lo || c > st->hi) {
+        return false;
+    }
+    st->need--;
+    st->lo = 0x80;
+    st->hi = 0xBF;
+    return true;
+}
+
+// 由最后3个字节恢复未完整序列的状态
+// 向量实现要到下一块才检查块末字节与其后字节的关系，所以这里要重新校验未完整的序列
+static bool scalarStateFromPrev(const uint8_t prev[3], ScalarState* st) {
+
+    st->need = 0;
+
+    for(int i = 0; i < 3; i++) {
+        uint8_t c = prev[i];
+        int seqLen = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 0;
+        if(seqLen > 0 && i + seqLen > 3) {
+            for(; i < 3; i++) {
+                if(!scalarStep(st, prev[i])) {
+                    return false;
+                }
+            }
+            break;
+        }
+    }
+
+    return true;
+}
+
+static void updatePrev(uint8_t prev[3], const unsigned char* data, size_t len) {
+
+    if(len >= 3) {
+        memcpy(prev, data + len - 3, 3);
+    } else if(len > 0) {
+        memmove(prev, prev + len, 3 - len);
+        memcpy(prev + 3 - len, data, len);
+    }
+}
+
+// 每次处理8字节，全部为ASCII且不在多字节序列中时跳过逐字节校验
+static bool validateWord(uint8_t prev[3], unsigned char* data, size_t len, uint32_t key, bool masked) {
+
+    uint64_t key64 = (uint64_t)key << 32 | key;
+    uint8_t mask[4];
+    ScalarState st;
+    size_t i = 0;
+
+    memcpy(mask, &key, 4);
+    if(!scalarStateFromPrev(prev, &st)) {
+        return false;
+    }
+
+    for(; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        if(masked) {
+            word ^= key64;
+            memcpy(data + i, &word, 8);
+        }
+        if(st.need == 0 && (word & 0x8080808080808080ULL) == 0) {
+            continue;
+        }
+        for(size_t j = i; j < i + 8; j++) {
+            if(!scalarStep(&st, data[j])) {
+                return false;
+            }
+        }
+    }
+
+    // 8是4的倍数，剩余部分的掩码相位不变
+    for(; i < len; i++) {
+        if(masked) {
+            data[i] ^= mask[i & 3];
+        }
+        if(!scalarStep(&st, data[i])) {
+            return false;
+        }
+    }
+
+    updatePrev(prev, data, len);
+    return true;
+}
+
+#ifdef UTF8_X86
+
+// 向量实现使用查表法：用前一字节的高4位、低4位和当前字节的高4位各查一张16项的表，
+// 三个结果按位与后非0代表出现了过短、过长、超长编码、代理项或超过U+10FFFF等错误，
+// 三、四字节序列中第3、4个字节是否为后续字节再单独检查
+
+#define TOO_SHORT       (1 << 0)    // 首字节或ASCII之后不是后续字节（对应位置应为后续字节）
+#define TOO_LONG        (1 << 1)    // ASCII之后出现后续字节
+#define OVERLONG_3      (1 << 2)
+#define TOO_LARGE       (1 << 3)
+#define SURROGATE       (1 << 4)
+#define OVERLONG_2      (1 << 5)
+#define TOO_LARGE_1000  (1 << 6)
+#define OVERLONG_4      (1 << 6)
+#define TWO_CONTS       (1 << 7)    // 两个后续字节相连，需要由三、四字节序列检查排除
+#define CARRY           (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+#define BYTE_1_HIGH_TABLE \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, \
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, \
+    TOO_SHORT | OVERLONG_2, \
+    TOO_SHORT, \
+    TOO_SHORT | OVERLONG_3 | SURROGATE, \
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+
+#define BYTE_1_LOW_TABLE \
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, \
+    CARRY | OVERLONG_2, \
+    CARRY, \
+    CARRY, \
+    CARRY | TOO_LARGE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000, \
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+
+#define BYTE_2_HIGH_TABLE \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, \
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+
+__attribute__((target("ssse3")))
+static inline __m128i checkBlockSSSE3(__m128i input, __m128i prevInput) {
+
+    const __m128i low4 = _mm_set1_epi8(0x0F);
+    __m128i prev1 = _mm_alignr_epi8(input, prevInput, 15);
+    __m128i prev2 = _mm_alignr_epi8(input, prevInput, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prevInput, 13);
+
+    __m128i byte1High = _mm_shuffle_epi8(_mm_setr_epi8(BYTE_1_HIGH_TABLE), _mm_and_si128(_mm_srli_epi16(prev1, 4), low4));
+    __m128i byte1Low = _mm_shuffle_epi8(_mm_setr_epi8(BYTE_1_LOW_TABLE), _mm_and_si128(prev1, low4));
+    __m128i byte2High = _mm_shuffle_epi8(_mm_setr_epi8(BYTE_2_HIGH_TABLE), _mm_and_si128(_mm_srli_epi16(input, 4), low4));
+    __m128i special = _mm_and_si128(_mm_and_si128(byte1High, byte1Low), byte2High);
+
+    // 前2个字节为三、四字节序列首字节（或前3个字节为四字节序列首字节）时，当前字节必须是后续字节
+    __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+    __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+    __m128i must23 = _mm_and_si128(_mm_or_si128(third, fourth), _mm_set1_epi8((char)0x80));
+
+    return _mm_xor_si128(must23, special);
+}
+
+// 末尾3个字节中有需要更多字节的首字节时非0
+__attribute__((target("ssse3")))
+static inline __m128i incompleteSSSE3(__m128i input) {
+    const __m128i maxValue = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    return _mm_subs_epu8(input, maxValue);
+}
+
+__attribute__((target("ssse3")))
+static bool validateSSSE3(uint8_t prev[3], unsigned char* data, size_t len, uint32_t key, bool masked) {
+
+    size_t blocks = len & ~(size_t)15;
+
+    if(blocks > 0) {
+        uint8_t tmp[16] = {0};
+        __m128i key128 = _mm_set1_epi32((int)key);
+        __m128i error = _mm_setzero_si128();
+        __m128i prevInput, prevIncomplete;
+
+        memcpy(tmp + 13, prev, 3);
+        prevInput = _mm_loadu_si128((const __m128i*)tmp);
+        prevIncomplete = incompleteSSSE3(prevInput);
+
+        for(size_t i = 0; i < blocks; i += 16) {
+            __m128i input = _mm_loadu_si128((const __m128i*)(data + i));
+            if(masked) {
+                input = _mm_xor_si128(input, key128);
+                _mm_storeu_si128((__m128i*)(data + i), input);
+            }
+            // 全部为ASCII时只需确认前一块没有以未完整的序列结尾
+            if(_mm_movemask_epi8(input) == 0) {
+                error = _mm_or_si128(error, prevIncomplete);
+            } else {
+                error = _mm_or_si128(error, checkBlockSSSE3(input, prevInput));
+                prevIncomplete = incompleteSSSE3(input);
+            }
+            prevInput = input;
+        }
+
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF) {
+            return false;
+        }
+        memcpy(prev, data + blocks - 3, 3);
+    }
+
+    // 16是4的倍数，剩余部分的掩码相位不变
+    return validateWord(prev, data + blocks, len - blocks, key, masked);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i checkBlockAVX2(__m256i input, __m256i prevInput) {
+
+    const __m256i low4 = _mm256_set1_epi8(0x0F);
+    __m256i carried = _mm256_permute2x128_si256(prevInput, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, carried, 15);
+    __m256i prev2 = _mm256_alignr_epi8(input, carried, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, carried, 13);
+
+    __m256i byte1High = _mm256_shuffle_epi8(_mm256_setr_epi8(BYTE_1_HIGH_TABLE, BYTE_1_HIGH_TABLE),
+        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low4));
+    __m256i byte1Low = _mm256_shuffle_epi8(_mm256_setr_epi8(BYTE_1_LOW_TABLE, BYTE_1_LOW_TABLE),
+        _mm256_and_si256(prev1, low4));
+    __m256i byte2High = _mm256_shuffle_epi8(_mm256_setr_epi8(BYTE_2_HIGH_TABLE, BYTE_2_HIGH_TABLE),
+        _mm256_and_si256(_mm256_srli_epi16(input, 4), low4));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+    __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+
+    return _mm256_xor_si256(must23, special);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i incompleteAVX2(__m256i input) {
+    const __m256i maxValue = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    return _mm256_subs_epu8(input, maxValue);
+}
+
+__attribute__((target("avx2")))
+static bool validateAVX2(uint8_t prev[3], unsigned char* data, size_t len, uint32_t key, bool masked) {
+
+    size_t blocks = len & ~(size_t)31;
+
+    if(blocks > 0) {
+        uint8_t tmp[32] = {0};
+        __m256i key256 = _mm256_set1_epi32((int)key);
+        __m256i error = _mm256_setzero_si256();
+        __m256i prevInput, prevIncomplete;
+
+        memcpy(tmp + 29, prev, 3);
+        prevInput = _mm256_loadu_si256((const __m256i*)tmp);
+        prevIncomplete = incompleteAVX2(prevInput);
+
+        for(size_t i = 0; i < blocks; i += 32) {
+            __m256i input = _mm256_loadu_si256((const __m256i*)(data + i));
+            if(masked) {
+                input = _mm256_xor_si256(input, key256);
+                _mm256_storeu_si256((__m256i*)(data + i), input);
+            }
+            if(_mm256_movemask_epi8(input) == 0) {
+                error = _mm256_or_si256(error, prevIncomplete);
+            } else {
+                error = _mm256_or_si256(error, checkBlockAVX2(input, prevInput));
+                prevIncomplete = incompleteAVX2(input);
+            }
+            prevInput = input;
+        }
+
+        if(!_mm256_testz_si256(error, error)) {
+            return false;
+        }
+        memcpy(prev, data + blocks - 3, 3);
+    }
+
+    return validateWord(prev, data + blocks, len - blocks, key, masked);
+}
+
+#endif
+
+void utf8Init(void) {
+
+    utf8Proc = validateWord;
+    utf8Backend = "word";
+
+#ifdef UTF8_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        utf8Proc = validateAVX2;
+        utf8Backend = "avx2";
+    } else if(__builtin_cpu_supports("ssse3")) {
+        utf8Proc = validateSSSE3;
+        utf8Backend = "ssse3";
+    }
+#endif
+}
+
+const char* utf8BackendName(void) {
+    return utf8Backend;
+}
+
+void utf8Reset(Utf8State* state) {
+    memset(state->prev, 0, sizeof(state->prev));
+    state->active = false;
+}
+
+bool utf8Validate(Utf8State* state, const unsigned char* data, size_t len) {
+    // masked为false时不会写入data
+    return utf8Proc(state->prev, (unsigned char*)data, len, 0, false);
+}
+
+bool utf8ValidateUnmask(Utf8State* state, unsigned char* data, size_t len, const uint8_t mask[4], uint64_t offset) {
+
+    uint8_t rotated[4];
+    uint32_t key;
+
+    for(int i = 0; i < 4; i++) {
+        rotated[i] = mask[(offset + i) & 3];
+    }
+    memcpy(&key, rotated, 4);
+
+    return utf8Proc(state->prev, data, len, key, true);
+}
+
+bool utf8Finish(const Utf8State* state) {
+    return state->prev[0] < 0xF0 && state->prev[1] < 0xE0 && state->prev[2] < 0xC0;
+}
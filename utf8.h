@@ -0,0 +1,35 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef QLWS_UTF8_H
+
+#define QLWS_UTF8_H
+
+// UTF-8校验，x86下根据CPU在运行时选择AVX2、SSSE3或按机器字处理的实现
+// 校验可以分多次进行，多字节序列可以跨越两次调用的边界
+
+// 增量校验的状态，只记录已校验数据的最后3个字节
+typedef struct Utf8State {
+    uint8_t prev[3];
+    bool    active;     // 供调用者使用，标记当前消息是否需要校验
+} Utf8State;
+
+// 选择实现，需要在第一次校验前调用
+void utf8Init(void);
+const char* utf8BackendName(void);
+
+void utf8Reset(Utf8State* state);
+
+// 校验紧接在之前数据之后的len字节，出现非法序列返回false
+// 末尾未完整的多字节序列不算错误，由之后的数据或utf8Finish判断
+bool utf8Validate(Utf8State* state, const unsigned char* data, size_t len);
+
+// 与utf8Validate相同，但先用WebSocket掩码原地解码，解码与校验在同一次遍历中完成
+// offset为data在载荷中的位置，用于确定掩码的起始字节
+bool utf8ValidateUnmask(Utf8State* state, unsigned char* data, size_t len, const uint8_t mask[4], uint64_t offset);
+
+// 数据结束，末尾有未完整的多字节序列时返回false
+bool utf8Finish(const Utf8State* state);
+
+#endif
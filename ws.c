@@ -1,537 +1,537 @@
+#include "platform.h"
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
-#include <windef.h>
 #include <stdlib.h>
-#include <winsock2.h>
-#include "lib/sha1/sha1.h"
-#include "lib/base64/b64.h"
 #include "ws.h"
-
-// 不区分大小写的比较字符串，相等返回true
-bool stricasecmp(const char* a, const char* b) {
-  do {
-    if(*a == '\0' && *b == '\0')
-      return true;
-  } while(tolower(*a++) == tolower(*b++));
-
-  return false;
-}
-
-// 不区分大小写的比较字符串，n个字符内（包括n）相等返回true
-bool strnicasecmp(const char* a, const char* b, unsigned n) {
-  do {
-    if(n-- == 0 || (*a == '\0' && *b == '\0'))
-      return true;
-  } while(tolower(*a++) == tolower(*b++));
-
-  return false;
-}
+#include "unmask.h"
+#include "pmdeflate.h"
+#include "acceptkey.h"
 
 // 打印日志函数声明
 void pluginLog(const char* type, int level, const char* format, ...);
 
+// 查询参数batch的上限，单位为微秒
+#define MAX_BATCH_DELAY 1000000
+
 // 初始化帧结构
 void initWsFrameStruct(WsFrame* wsFrame) {
     wsFrame->state = frameState_init;
     wsFrame->FIN = false;
+    wsFrame->compressed = false;
     wsFrame->frameType = frameType_connectionClose;
     memset(wsFrame->mask, 0, sizeof(wsFrame->mask));
     wsFrame->buff = NULL;
-    wsFrame->buffSize = 0;
-    wsFrame->handledLen = 0;
+    wsFrame->payload = NULL;
     wsFrame->headerLen = 0;
     wsFrame->payloadLen = 0;
-    wsFrame->next = NULL;
+    wsFrame->unmaskedLen = 0;
+    wsFrame->failureCode = 0;
 }
 
-// 将数据转换为WebSocket帧并返回转换后内存空间，记得free
-// len为数据长度，对于文本不包括\0，newLen返回帧长度
-// type暂时只支持frameType_text、frameType_pong
-char* convertToWebSocketFrame(const char* data, FrameType type, size_t len, size_t* newLen) {
+// 将帧头编码到header中并返回帧头长度，header至少需要WS_MAX_SERVER_HEADER_LEN字节
+// 服务器发出的帧不带掩码，载荷由调用者与帧头分开发送，不需要拷贝到帧头之后
+// 分片发送时第一帧使用消息类型，之后的帧使用frameType_continuation，只有最后一帧的fin为true
+// compressed为true时设置RSV1位，代表载荷是permessage-deflate压缩后的数据，只能用于消息的第一帧
+size_t encodeFrameHeader(unsigned char* header, FrameType type, bool fin, bool compressed, uint64_t len) {
+
+    switch(type) {
+        case frameType_continuation: header[0] = 0X0; break;
+        case frameType_text:    header[0] = 0X1; break;
+        case frameType_binary:  header[0] = 0X2; break;
+        case frameType_ping:    header[0] = 0X9; break;
+        case frameType_pong:    header[0] = 0XA; break;
+        default:                header[0] = 0X8; fin = true; break;    // type值在预料之外时发送关闭连接指令
+    }
 
-    char* frame = malloc(len + 10);    // 服务器端帧头最多十字节
+    if(fin) {
+        header[0] |= 0X80;
+    }
 
-    if(type == frameType_text) {
-        frame[0] = 0X81;
-    } else if (type == frameType_pong) {
-        frame[0] = 0X8A;
-    } else {
-        frame[0] = 0X88;    // type值在预料之外时发送关闭连接指令
+    if(compressed) {
+        header[0] |= 0X40;
     }
 
     if(len < 126) {
-
-        frame[1] = len;
-
-        memcpy(frame + 2, data, len);
-
-        *newLen = len + 2;
-
-        return frame;
-        
-    } else if (len >= 126 && len < 65536) {
-        
-        frame[1] = 126;
-        frame[2] = (uint8_t)(len >> 8);    // 高位
-        frame[3] = (uint8_t)len;            // 低位
-
-        memcpy(frame + 4, data, len);
-
-        *newLen = len + 4;
-
-        return frame;
-
-    } else if (len >= 65536) {
-
-        frame[1] = 127;
-        frame[2] = 0;
-        frame[3] = 0;
-        frame[4] = 0;
-        frame[5] = 0;
-        frame[6] = (uint8_t)(len >> 24);
-        frame[7] = (uint8_t)(len >> 16);
-        frame[8] = (uint8_t)(len >> 8);
-        frame[9] = (uint8_t)len;
-
-        memcpy(frame + 10, data, len);
-
-        *newLen = len + 10;
-
-        return frame;
+        header[1] = (uint8_t)len;
+        return 2;
     }
-}
 
-// 返回已读取的buff内的字节数，通常等于传入buff长度
-// 如果完整读完一个frame后还有数据剩余或读取发生错误，就不会等于buff长度
-// 当buff中的数据不足时，一次函数调用不能读取到一个完整的帧，可以之后再提供接下来的数据继续调用该函数组成一个完整的帧
-// 调用该函数后通过wsFrame.state来判断读取状态
-int readWebSocketFrameStream(WsFrame* wsFrame, const char* buff, int len) {
-
-    // 申请足够容纳传入数据的空间，并拷贝传入数据
+    if(len < 65536) {
+        header[1] = 126;
+        header[2] = (uint8_t)(len >> 8);    // 高位
+        header[3] = (uint8_t)len;           // 低位
+        return 4;
+    }
 
-    if(wsFrame->buff == NULL) {
+    // 64位长度，网络字节序
+    header[1] = 127;
+    for(int i = 0; i < 8; i++) {
+        header[2 + i] = (uint8_t)(len >> (56 - 8 * i));
+    }
 
-        wsFrame->buff = malloc(len);
-        wsFrame->buffSize = len;
+    return 10;
+}
 
-        memcpy(wsFrame->buff, buff, len);
+// 解析帧头，帧头的所有字段在接收完整后一次解析完毕
+// 返回帧头长度，帧头未接收完返回0，帧头不合法时将state设为读取错误并返回0
+static size_t decodeFrameHeader(WsFrame* wsFrame, const unsigned char* buff, size_t len) {
 
-    } else {
+    wsFrame->failureCode = WS_CLOSE_PROTOCOL_ERROR;
 
-        char* copyStartAddr;
-        int requiedLen = wsFrame->buffSize + len; 
+    if(len < 2) {
+        return 0;
+    }
 
-        wsFrame->buff = realloc((void*)wsFrame->buff, requiedLen);
-        copyStartAddr = wsFrame->buff + wsFrame->buffSize;
-        wsFrame->buffSize = requiedLen;
+    int opcode = buff[0] & 0X0F;
+    uint8_t length7 = buff[1] & 0X7F;
 
-        memcpy(copyStartAddr, buff, len);
+    // 前两个字节足以判断的错误不需要等待帧头接收完
+    // RSV1由permessage-deflate使用，是否允许由调用者根据协商结果判断，RSV2、RSV3没有对应的扩展
+    // 标准规定客户端传入帧的掩码位必须不为0
+    if((buff[0] & 0X30) != 0 || (buff[1] & 0X80) == 0) {
+        wsFrame->state = frameState_failure;
+        return 0;
     }
-    
 
-    // 消耗的数据量
-    int consumed = 0;
+    switch(opcode) {
+        case 0X0: wsFrame->frameType = frameType_continuation;     break;
+        case 0X1: wsFrame->frameType = frameType_text;             break;
+        case 0X2: wsFrame->frameType = frameType_binary;           break;
+        case 0X8: wsFrame->frameType = frameType_connectionClose;  break;
+        case 0X9: wsFrame->frameType = frameType_ping;             break;
+        case 0XA: wsFrame->frameType = frameType_pong;             break;
+        default:
+            wsFrame->state = frameState_failure;
+            return 0;
+    }
 
-    stateTransitionBegin:
+    wsFrame->FIN = !!(buff[0] & 0X80);
+    wsFrame->compressed = !!(buff[0] & 0X40);
 
-    switch(wsFrame->state) {
+    // 控制帧不能分片，载荷不能超过125字节
+    if((opcode & 0X8) && (!wsFrame->FIN || length7 > 125)) {
+        wsFrame->state = frameState_failure;
+        return 0;
+    }
 
-        case frameState_init:
+    // 7bit长度为126、127时分别附加2、8字节的长度字段
+    size_t headerLen = 2 + (length7 == 126 ? 2 : length7 == 127 ? 8 : 0) + 4;
 
-            if(wsFrame->buffSize < 1) {
-                return consumed;
-            }
+    if(len < headerLen) {
+        return 0;
+    }
 
-            wsFrame->FIN = !!(wsFrame->buff[0] & 0X80);
+    uint64_t payloadLen = length7;
 
-            // RSV位不全为0，存在扩展协议，服务器不处理扩展协议
-            if((wsFrame->buff[0] & 0X70) != 0) {
-                wsFrame->state = frameState_failure;
-                break;
-            }
-
-            int opcode = wsFrame->buff[0] & 0X0F;
-
-            if(opcode == 0X0) {
-                wsFrame->frameType = frameType_continuation;
-            } else if(opcode == 0X1) {
-                wsFrame->frameType = frameType_text;
-            } else if(opcode == 0X2) {
-                wsFrame->frameType = frameType_binary;
-            } else if(opcode == 0X8) {
-                wsFrame->frameType = frameType_connectionClose;
-            } else if(opcode == 0X9) {
-                wsFrame->frameType = frameType_ping;
-            } else if(opcode == 0XA) {
-                wsFrame->frameType = frameType_pong;
-            } else {
-                wsFrame->state = frameState_failure;
-                break;
-            }
+    if(length7 == 126) {
+        payloadLen = ((uint64_t)buff[2] << 8) | buff[3];
+    } else if(length7 == 127) {
+        payloadLen = 0;
+        for(int i = 2; i < 10; i++) {
+            payloadLen = (payloadLen << 8) | buff[i];
+        }
+        // 标准规定64位长度的最高位必须为0
+        if(payloadLen >> 63) {
+            wsFrame->state = frameState_failure;
+            return 0;
+        }
+    }
 
-            consumed += 1;
-            wsFrame->handledLen += 1;
-            wsFrame->headerLen += 1;
-            wsFrame->state = frameState_firstByte;
+    memcpy(wsFrame->mask, buff + headerLen - 4, 4);
+    wsFrame->headerLen = headerLen;
+    wsFrame->payloadLen = payloadLen;
+    wsFrame->state = frameState_readingData;
 
-        break;
+    return headerLen;
+}
 
-        case frameState_firstByte:
+// 在调用者的接收缓冲区上原地解析并解码帧，不拷贝也不申请内存
+// buff指向当前帧的第一个字节，len为从帧首开始已接收的字节数，其中可能包含下一帧的数据
+// 帧未接收完时返回0，可以在收到更多数据后再次传入从帧首开始的全部数据继续解析
+// 再次调用时buff可以指向新的地址（缓冲区被移动或扩大），但已传入过的数据内容不能改变
+// 帧头解析完毕后state为正在接收载荷数据，此时headerLen + payloadLen即为帧的总长度，调用者可据此一次性预留缓冲区
+// 每次调用都会原地解码新到达的载荷数据，解码与之后数据的接收交替进行
+// 帧接收完成时state为读取完毕，返回帧的总长度，payload指向buff中已解码的载荷
+// utf8不为NULL时同时校验未压缩文本消息的UTF-8编码，与解码在同一次遍历中完成，跨越分片的多字节序列由utf8保存状态
+// 校验失败时state为读取错误，failureCode为1007，非法数据在交给上层处理之前就被拒绝
+size_t readWebSocketFrameStream(WsFrame* wsFrame, char* buff, size_t len, Utf8State* utf8) {
+
+    const unsigned char* data = (const unsigned char*)buff;
+
+    if(wsFrame->state == frameState_init) {
+        if(decodeFrameHeader(wsFrame, data, len) == 0) {
+            return 0;
+        }
+        // 数据消息的首帧决定整条消息是否需要校验，压缩消息由调用者校验解压后的数据
+        if(utf8 && (wsFrame->frameType == frameType_text || wsFrame->frameType == frameType_binary)) {
+            utf8Reset(utf8);
+            utf8->active = wsFrame->frameType == frameType_text && !wsFrame->compressed;
+        }
+    }
 
-            if(wsFrame->buffSize < 2) {
-                return consumed;
-            }
+    if(wsFrame->state != frameState_readingData) {
+        return 0;
+    }
 
-            // 标准规定客户端传入帧的掩码位必须不为0
-            if((wsFrame->buff[1] & 0X80) == 0) {
-                wsFrame->state = frameState_failure;
-            }
+    wsFrame->buff = (unsigned char*)buff;
 
-            wsFrame->state = frameState_mask;
+    // 注意 buff的长度可能大于帧总长度
+    // 因为TCP是面向字节流的，buff中有可能包含下一帧的数据
+    uint64_t available = len - wsFrame->headerLen;
+    if(available > wsFrame->payloadLen) {
+        available = wsFrame->payloadLen;
+    }
 
-        break;
+    unsigned char* payload = wsFrame->buff + wsFrame->headerLen;
 
-        case frameState_mask:
+    bool validate = utf8 && utf8->active && (wsFrame->frameType == frameType_text || wsFrame->frameType == frameType_continuation);
 
-            if(wsFrame->buffSize < 2) {
-                return consumed;
+    if(available > wsFrame->unmaskedLen) {
+        unsigned char* start = payload + wsFrame->unmaskedLen;
+        size_t count = available - wsFrame->unmaskedLen;
+        if(validate) {
+            if(!utf8ValidateUnmask(utf8, start, count, wsFrame->mask, wsFrame->unmaskedLen)) {
+                goto invalidPayload;
             }
+        } else {
+            wsUnmask(start, count, wsFrame->mask, wsFrame->unmaskedLen);
+        }
+        wsFrame->unmaskedLen = available;
+    }
 
-            uint8_t payloadLen = wsFrame->buff[1] & 0X7F;
+    if(available < wsFrame->payloadLen) {
+        return 0;
+    }
 
-            // frame-payload-length-7
-            if(payloadLen < 126) {
-                wsFrame->payloadLen = payloadLen;
-                wsFrame->state = frameState_7bitLength;
-            } else if (payloadLen == 126) {
-                wsFrame->state = frameState_16bitLengthWait;
-            } else if (payloadLen == 127) {
-                wsFrame->state = frameState_63bitLengthWait;
-            }
+    // 消息结束时不能留有未完整的多字节序列
+    if(validate && wsFrame->FIN) {
+        if(!utf8Finish(utf8)) {
+            goto invalidPayload;
+        }
+        utf8->active = false;
+    }
 
-            consumed += 1;
-            wsFrame->headerLen += 1;
-            wsFrame->handledLen += 1;
+    wsFrame->payload = payload;
+    wsFrame->state = frameState_success;
 
-        break;
+    return wsFrame->headerLen + wsFrame->payloadLen;
 
-        case frameState_7bitLength:
+invalidPayload:
+    wsFrame->state = frameState_failure;
+    wsFrame->failureCode = WS_CLOSE_INVALID_PAYLOAD;
+    return 0;
+}
 
-            // 2字节共有字段 + 0字节附加长度字段 + 4字节掩码
-            
-            if(wsFrame->buffSize < 6) {
-                return consumed;
-            }
+// 请求目标中查询参数之前的部分与配置的路径比较，路径不以'/'开头时补上
+// 注：路径部分不区分大小写比较
+static bool targetMatchesPath(const char* request, HttpSpan target, const char* path) {
 
-            for(int i = 0; i < 4; i++) {
-                wsFrame->mask[i] = wsFrame->buff[i + 2];
-            }
+    const char* p = request + target.offset;
+    const char* query = memchr(p, '?', target.len);
+    size_t len = query ? (size_t)(query - p) : target.len;
 
-            consumed += 4;
-            wsFrame->headerLen += 4;
-            wsFrame->handledLen += 4;
+    if(path[0] != '/') {
+        if(len == 0 || p[0] != '/') {
+            return false;
+        }
+        p++;
+        len--;
+    }
 
-            wsFrame->state = frameState_maskingKey;
+    if(strlen(path) != len) {
+        return false;
+    }
 
-        break;
+    for(size_t i = 0; i < len; i++) {
+        if(tolower((unsigned char)p[i]) != tolower((unsigned char)path[i])) {
+            return false;
+        }
+    }
 
-        case frameState_16bitLengthWait:
+    return true;
+}
 
-            if(wsFrame->buffSize < 4) {
-                return consumed;
-            }
+// 支持的子协议，按名称完全匹配（区分大小写）
+static const struct {
+    const char* name;
+    size_t len;
+    WsEncoding encoding;
+} subprotocols[] = {
+    { "qlws.json.v1",       12, wsEncoding_json },
+    { "qlws.msgpack.v1",    15, wsEncoding_msgpack },
+    { "qlws.json+gbk.v1",   16, wsEncoding_jsonGbk },
+};
+
+#define SUBPROTOCOL_COUNT (int)(sizeof(subprotocols) / sizeof(subprotocols[0]))
+
+FrameType wsEncodingFrameType(WsEncoding encoding) {
+    return encoding == wsEncoding_json ? frameType_text : frameType_binary;
+}
 
-            wsFrame->payloadLen = ((uint16_t)wsFrame->buff[2] << 8) + (uint16_t)wsFrame->buff[3];
+// 按客户端列出的顺序选择第一个支持的子协议，返回在subprotocols中的下标，都不支持时返回-1
+static int selectSubprotocol(const char* request, HttpSpan span) {
 
-            consumed += 2;
-            wsFrame->headerLen += 2;
-            wsFrame->handledLen += 2;
+    const char* p = request + span.offset;
+    const char* end = p + span.len;
 
-            wsFrame->state = frameState_16bitLength;
+    while(p < end) {
 
-        break;
+        const char* comma = memchr(p, ',', end - p);
+        const char* itemEnd = comma ? comma : end;
 
-        case frameState_63bitLengthWait:
+        while(p < itemEnd && (*p == ' ' || *p == '\t')) p++;
+        const char* e = itemEnd;
+        while(e > p && (e[-1] == ' ' || e[-1] == '\t')) e--;
 
-            if(wsFrame->buffSize < 10) {
-                return consumed;
+        for(int i = 0; i < SUBPROTOCOL_COUNT; i++) {
+            if((size_t)(e - p) == subprotocols[i].len && memcmp(p, subprotocols[i].name, subprotocols[i].len) == 0) {
+                return i;
             }
+        }
 
-            unsigned char* recvBuff = wsFrame->buff;
+        p = itemEnd + 1;
+    }
 
-            // 注：标准规定64位时最高bit必须为0，这里未作处理                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                         
-            wsFrame->payloadLen = 
-                ((uint64_t)recvBuff[2] << (8 * 7)) +
-                ((uint64_t)recvBuff[3] << (8 * 6)) +
-                ((uint64_t)recvBuff[4] << (8 * 5)) +
-                ((uint64_t)recvBuff[5] << (8 * 4)) +
-                ((uint64_t)recvBuff[6] << (8 * 3)) +
-                ((uint64_t)recvBuff[7] << (8 * 2)) +
-                ((uint64_t)recvBuff[8] << (8 * 1)) +
-                ((uint64_t)recvBuff[9] << (8 * 0));
+    return -1;
+}
 
-            consumed += 8;
-            wsFrame->headerLen += 8;
-            wsFrame->handledLen += 8;
+static int hexValue(char c) {
+    if(c >= '0' && c <= '9') return c - '0';
+    c = tolower((unsigned char)c);
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
 
-            wsFrame->state = frameState_63bitLength;
+// 百分号解码查询参数的值，'+'解码为空格，解码后超过size - 1字节或编码错误时返回-1
+static int decodeQueryValue(const char* p, size_t len, char* out, size_t size) {
 
-        break;
+    size_t n = 0;
 
-        case frameState_16bitLength:
+    for(size_t i = 0; i < len; i++) {
 
-            // 2字节共有字段 + 2字节附加长度字段 + 4字节掩码
+        if(n + 1 >= size) {
+            return -1;
+        }
 
-            if(wsFrame->buffSize < 8) {
-                return consumed;
+        if(p[i] == '%') {
+            if(i + 2 >= len) {
+                return -1;
             }
-
-            for(int i = 0; i < 4; i++) {
-                wsFrame->mask[i] = wsFrame->buff[i + 4];
+            int hi = hexValue(p[i + 1]);
+            int lo = hexValue(p[i + 2]);
+            if(hi < 0 || lo < 0) {
+                return -1;
             }
+            out[n++] = (char)(hi << 4 | lo);
+            i += 2;
+        } else {
+            out[n++] = p[i] == '+' ? ' ' : p[i];
+        }
+    }
 
-            consumed += 4;
-            wsFrame->headerLen += 4;
-            wsFrame->handledLen += 4;
-
-            wsFrame->state = frameState_maskingKey;
+    out[n] = '\0';
+    return (int)n;
+}
 
-        break;
+// 将逗号分隔的事件名列表转换为位掩码，出现未知的事件名时返回false
+static bool parseEventList(const char* list, const char* const* eventNames, uint32_t* events) {
 
-        case frameState_63bitLength:
+    *events = 0;
 
-            // 2字节共有字段 + 8字节附加长度字段 + 4字节掩码
+    for(const char* p = list; *p; ) {
 
-            if(wsFrame->buffSize < 14) {
-                return consumed;
-            }
+        const char* comma = strchr(p, ',');
+        size_t len = comma ? (size_t)(comma - p) : strlen(p);
+        int i;
 
-            for(int i = 0; i < 4; i++) {
-                wsFrame->mask[i] = wsFrame->buff[i + 10];
+        for(i = 0; eventNames && eventNames[i] && i < WS_MAX_EVENTS; i++) {
+            if(strlen(eventNames[i]) == len && memcmp(eventNames[i], p, len) == 0) {
+                break;
             }
+        }
 
-            consumed += 4;
-            wsFrame->headerLen += 4;
-            wsFrame->handledLen += 4;
-
-            wsFrame->state = frameState_maskingKey;
-
-        break;
-
-        case frameState_maskingKey:
-
-            wsFrame->state = frameState_readingData;
-    
-        break;
-
-        case frameState_readingData:
-        
-            ;    // case第一个语句不能是变量声明
-            uint64_t total = wsFrame->payloadLen + wsFrame->headerLen;
-
-            // 注意 buff的长度可能大于帧总长度
-            // 因为TCP是面向字节流的，buff中有可能包含下一帧的数据
-            // 所以读取时要根据帧头和载荷长度来判断最多读多少数据
-            if(wsFrame->buffSize >= total) {
-                consumed += total - wsFrame->handledLen;
-                wsFrame->handledLen = total;
-                wsFrame->state = frameState_success;
-            } else {
-                consumed += wsFrame->buffSize - wsFrame->handledLen;
-                wsFrame->handledLen = wsFrame->buffSize;
-                return consumed;
+        if(len > 0) {
+            if(eventNames == NULL || i == WS_MAX_EVENTS || eventNames[i] == NULL) {
+                pluginLog("wsShakeHands", 1, "Unknown event '%.*s' in query parameter 'events'", (int)len, p);
+                return false;
             }
+            *events |= (uint32_t)1 << i;
+        }
 
-        break;
-
-        case frameState_success:
-
-            return consumed;
-
-        break;
-
-        case frameState_failure:
-
-            return consumed;
-
-        break;
+        p += len + (comma ? 1 : 0);
     }
 
-    goto stateTransitionBegin;
-
-    return consumed;
+    return true;
 }
 
-// 调用readWebSocketFrameStream后通过该函数释放申请内存
-// 同时会重置帧结构及确保wsFrame.buff指向NULL
-void freeWebSocketFrame(WsFrame* wsFrame) {
-    if(wsFrame->buff) {
-        free(wsFrame->buff);
-    }
-    initWsFrameStruct(wsFrame);
-}
-
-int getSecWebSocketAcceptKey(const char* key, char* b64buff, int len) {
-
-    SHA1_CTX ctx;
-    unsigned char hash[20], buff[512];
-
-    if(strlen(key) > 256) {
-        return -1;
-    }
-
-    sprintf(buff, "%s%s", key, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+// 解析请求目标中'?'之后的查询参数，未知的参数被忽略，以便客户端兼容之后的版本
+// 参数值不合法时返回false
+static bool parseQuery(const char* query, size_t len, const char* const* eventNames, WsSession* session) {
 
-    SHA1Init(&ctx);
-    SHA1Update(&ctx, buff, strlen(buff));
-    SHA1Final(hash, &ctx);
+    const char* p = query;
+    const char* end = query + len;
 
-    const char* base64 = b64_encode(hash, sizeof(hash));
-    strncpy(b64buff, base64, len - 1);
-    b64buff[len - 1] = '\0';
-    free((void*)base64);
+    while(p < end) {
 
-    return 0;
-}
-
-// 校验WebSocket握手的HTTP头，失败返回NULL，校验成功顺带返回Sec-WebSocket-Key，记得free
-char* verifyHandshakeHeaders(const char* str, size_t len) {
+        const char* amp = memchr(p, '&', end - p);
+        const char* itemEnd = amp ? amp : end;
+        const char* eq = memchr(p, '=', itemEnd - p);
+        const char* name = p;
+        size_t nameLen = (eq ? eq : itemEnd) - p;
 
-    char* secKey = NULL;
-    char a[len + 1], b[len + 1];
-    bool connection, upgrade, version, key;
-    connection = upgrade = version = key = false;
-
-    if(strcmp(str + len - 4, "\r\n\r\n") != 0) {
-        pluginLog("verifyHandshakeHeaders", 1, "HTTP header does not end with '\\r\\n\\r\\n'");
-        return NULL;
-    }
-    
-    const char* cur1 = strstr(str, "\r\n") + 2;
-    const char* cur2;
+        char value[256];
+        if(decodeQueryValue(eq ? eq + 1 : itemEnd, eq ? (size_t)(itemEnd - eq - 1) : 0, value, sizeof(value)) < 0) {
+            pluginLog("wsShakeHands", 1, "Malformed query parameter '%.*s'", (int)nameLen, name);
+            return false;
+        }
 
-    while((cur2 = strstr(cur1, "\r\n")) != cur1) {
+        p = itemEnd + 1;
 
-        cur2 += 2;  // 跳过\r\n
+        bool valid = true;
 
-        const char* colon = strchr(cur1, ':');
-        if(colon == NULL || colon >= cur2) {
-            pluginLog("verifyHandshakeHeaders", 1, "Unexpected HTTP header");
-            break;
+        if(nameLen == 7 && memcmp(name, "deflate", 7) == 0) {
+            valid = strcmp(value, "0") == 0 || strcmp(value, "1") == 0;
+            session->deflate = value[0] == '1';
+        } else if(nameLen == 6 && memcmp(name, "events", 6) == 0) {
+            valid = parseEventList(value, eventNames, &session->events);
+        } else if(nameLen == 5 && memcmp(name, "batch", 5) == 0) {
+            char* valueEnd;
+            long delay = strtol(value, &valueEnd, 10);
+            valid = value[0] >= '0' && value[0] <= '9' && *valueEnd == '\0' && delay <= MAX_BATCH_DELAY;
+            session->batchDelay = (int)delay;
         }
 
-        if(sscanf(cur1, "%[^:]:%s", a, b) != 2) {
-            pluginLog("verifyHandshakeHeaders", 1, "HTTP header parsing failed");
-            break;
+        if(!valid) {
+            pluginLog("wsShakeHands", 1, "Invalid value '%s' of query parameter '%.*s'", value, (int)nameLen, name);
+            return false;
         }
+    }
 
-        if(stricasecmp(a, "connection")) {
-
-            connection = true;
-
-        } else if (stricasecmp(a, "upgrade")) {
-
-            if(!stricasecmp(b, "websocket")) {
-                pluginLog("verifyHandshakeHeaders", 1, "Unexpected value '%s' of Upgrade filed", b);
-                break;
-            }
+    return true;
+}
 
-            upgrade = true;
+// 处理已由httpParseRequest解析完的握手请求，request指向请求开头
+// 握手成功返回0，请求格式错误、查询参数不合法或不是合法的WebSocket握手时回复400并返回-1
+// allowDeflate为true时接受客户端的permessage-deflate请求，协商结果写入deflate
+// 子协议及查询参数确定的连接选项写入session，eventNames为以NULL结尾的事件名表，用于解析查询参数events
+int wsShakeHands(const char* request, const HttpRequest* req, SOCKET socket, const char* path, bool allowDeflate,
+    const char* const* eventNames, WsSession* session, WsDeflateParams* deflate) {
 
-        } else if (stricasecmp(a, "Sec-WebSocket-Version")) {
+    #define HTTP_400 "HTTP/1.1 400 Bad Request\r\n\r\n"
 
-            if(!stricasecmp(b, "13")) {
-                pluginLog("verifyHandshakeHeaders", 1, "Unexpected value '%s' of Sec-WebSocket-Version filed", b);
-                break;
-            }
+    const HttpSpan* headers = req->headers;
+    HttpSpan key = headers[httpHeader_secWebSocketKey];
 
-            version = true;
+    session->encoding = wsEncoding_json;
+    session->deflate = true;
+    session->events = 0XFFFFFFFF;
+    session->batchDelay = -1;
 
-        } else if (stricasecmp(a, "Sec-WebSocket-Key")) {
+    if(req->state != httpParse_done) {
+        pluginLog("wsShakeHands", 1, "Malformed request: %s", req->error);
+        goto wsShakeHandsError;
+    }
 
-            if(!key) {
-                key = true;
-                secKey = malloc(strlen(b) + 1);
-                strcpy(secKey, b);
-            }
-        }
+    if(!httpSpanEquals(request, req->method, "get", 3) || !httpSpanEquals(request, req->version, "http/1.1", 8)
+        || !targetMatchesPath(request, req->target, path)) {
+        pluginLog("wsShakeHands", 1, "Unexpected request line: %.*s %.*s", req->method.len, request + req->method.offset,
+            req->target.len, request + req->target.offset);
+        goto wsShakeHandsError;
+    }
 
-        cur1 = cur2;
+    if(!httpSpanHasToken(request, headers[httpHeader_connection], "upgrade", 7)) {
+        pluginLog("wsShakeHands", 1, "Missing 'Upgrade' in Connection field");
+        goto wsShakeHandsError;
     }
 
-    if(!(connection && upgrade && version && key)) {
-        pluginLog("verifyHandshakeHeaders", 1, "Missing necessary fields");
-        if(key) free((void*)secKey);       // 释放申请的内存
-        return NULL;
+    if(!httpSpanEquals(request, headers[httpHeader_upgrade], "websocket", 9)) {
+        pluginLog("wsShakeHands", 1, "Unexpected value '%.*s' of Upgrade field",
+            headers[httpHeader_upgrade].len, request + headers[httpHeader_upgrade].offset);
+        goto wsShakeHandsError;
     }
 
-    return secKey;
-}
+    if(!httpSpanEquals(request, headers[httpHeader_secWebSocketVersion], "13", 2)) {
+        pluginLog("wsShakeHands", 1, "Unexpected value '%.*s' of Sec-WebSocket-Version field",
+            headers[httpHeader_secWebSocketVersion].len, request + headers[httpHeader_secWebSocketVersion].offset);
+        goto wsShakeHandsError;
+    }
 
-// 处理HTTP协议升级为WebSocket协议的握手请求，握手成功返回0，失败返回-1
-int wsShakeHands(const char* recvBuff, int recvLen, SOCKET socket, const char* path) {
+    const char* target = request + req->target.offset;
+    const char* query = memchr(target, '?', req->target.len);
 
-    #define HTTP_MAXLEN 1536
-    #define HTTP_400 "HTTP/1.1 400 Bad Request\r\n\r\n"
+    if(query && !parseQuery(query + 1, target + req->target.len - query - 1, eventNames, session)) {
+        goto wsShakeHandsError;
+    }
 
-    // HTTP握手包太长，掐了
-    if(recvLen > HTTP_MAXLEN) {
-        send(socket, HTTP_400, strlen(HTTP_400), 0);
-        pluginLog("wsShakeHands", 1, "Request too long");
-        return -1;
+    // 客户端请求的子协议都不支持时不返回Sec-WebSocket-Protocol，按不使用子协议处理
+    int subprotocol = selectSubprotocol(request, headers[httpHeader_secWebSocketProtocol]);
+    if(subprotocol >= 0) {
+        session->encoding = subprotocols[subprotocol].encoding;
     }
 
-    // 注：recvBuff不以'\0'结尾
-    char resText[recvLen + 1];
-    memcpy(resText, recvBuff, recvLen);
-    resText[recvLen] = '\0';
+    // 协议升级，响应直接在resBuff中拼接，Sec-WebSocket-Accept由wsAcceptKey写在对应位置
 
-    char requestLine[512];
-    sprintf(requestLine, "GET %s%s HTTP/1.1\r\n", (strlen(path) == 0 || path[0] != '/') ? "/" : "", path);
+    // 注：当前的CORS设置可能会导致安全问题
+    static const char resPrefix[] =
+        "HTTP/1.1 101 ojbk\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: websocket\r\n"
+        "Sec-WebSocket-Accept: ";
+    static const char resSuffix[] =
+        "Access-Control-Allow-Origin: *\r\n"
+        "\r\n";
 
-    // 注：路径部分也被不区分大小写的比较
-    if(!strnicasecmp(resText, requestLine, strlen(requestLine))) {
-        send(socket, HTTP_400, strlen(HTTP_400), 0);
-        pluginLog("wsShakeHands", 1, "Unexpected request line");
-        pluginLog("wsShakeHands", 1, resText);
-        return -1;
-    }
+    char resBuff[384];
+    size_t resLen = sizeof(resPrefix) - 1;
 
-    const char *secKey = verifyHandshakeHeaders(resText, recvLen);
+    memcpy(resBuff, resPrefix, resLen);
 
-    if(!secKey) {
-        send(socket, HTTP_400, strlen(HTTP_400), 0);
-        return -1;
+    if(!wsAcceptKey(request + key.offset, key.len, resBuff + resLen)) {
+        pluginLog("wsShakeHands", 1, "Missing or invalid Sec-WebSocket-Key field");
+        goto wsShakeHandsError;
     }
 
-    // 获取Sec-WebSocket-Accept
-    char acptBuff[128];
-    getSecWebSocketAcceptKey(secKey, acptBuff, sizeof(acptBuff));
-    pluginLog("wsShakeHands", 0, "Sec-WebSocket-Key is '%s'", secKey);
-    pluginLog("wsShakeHands", 0, "Sec-WebSocket-Accept is '%s'", acptBuff);
-    free((void*)secKey);   // 释放secKey
+    pluginLog("wsShakeHands", 0, "Sec-WebSocket-Key is '%.*s'", key.len, request + key.offset);
+    pluginLog("wsShakeHands", 0, "Sec-WebSocket-Accept is '%.*s'", WS_ACCEPT_KEY_LEN, resBuff + resLen);
+
+    resLen += WS_ACCEPT_KEY_LEN;
+    memcpy(resBuff + resLen, "\r\n", 2);
+    resLen += 2;
+
+    // 扩展协商，只支持permessage-deflate，多个Sec-WebSocket-Extensions请求头的值以", "连接
+    char extensions[512];
+    char extValue[128];
+    size_t extLen = 0;
+
+    for(int i = 0; i < req->extensionCount; i++) {
+        HttpSpan ext = req->extensions[i];
+        size_t sep = extLen > 0 ? 2 : 0;
+        if(extLen + sep + ext.len < sizeof(extensions)) {
+            if(sep) memcpy(extensions + extLen, ", ", 2);
+            memcpy(extensions + extLen + sep, request + ext.offset, ext.len);
+            extLen += sep + ext.len;
+        }
+    }
+    extensions[extLen] = '\0';
 
-    // 协议升级
+    deflate->enabled = false;
+    if(allowDeflate && session->deflate && extLen > 0 && pmdNegotiate(extensions, deflate, extValue, sizeof(extValue))) {
+        resLen += sprintf(resBuff + resLen, "Sec-WebSocket-Extensions: %s\r\n", extValue);
+        pluginLog("wsShakeHands", 0, "Extension negotiated: '%s'", extValue);
+    }
 
-    char resBuff[256];
+    if(subprotocol >= 0) {
+        resLen += sprintf(resBuff + resLen, "Sec-WebSocket-Protocol: %s\r\n", subprotocols[subprotocol].name);
+        pluginLog("wsShakeHands", 0, "Subprotocol negotiated: '%s'", subprotocols[subprotocol].name);
+    }
 
-    // 注：当前的CORS设置可能会导致安全问题
-    // 注：响应中没有包含Sec-Websocket-Protocol头，代表不接受任何客户端请求的ws扩展
-    const char resHeader[] = 
-        "HTTP/1.1 101 ojbk\r\n"
-        "Connection: Upgrade\r\n"
-        "Upgrade: websocket\r\n"
-        "Sec-WebSocket-Accept: %s\r\n"
-        "Access-Control-Allow-Origin: *\r\n"
-        "\r\n"
-    ;
-    
-    int resLen = sprintf(resBuff, resHeader, acptBuff);
+    memcpy(resBuff + resLen, resSuffix, sizeof(resSuffix) - 1);
+    resLen += sizeof(resSuffix) - 1;
 
     // Send data to the client
-    int iSendResult = send(socket, resBuff, resLen, 0);
+    int iSendResult = socketSend(socket, resBuff, resLen);
     
     if(iSendResult == SOCKET_ERROR) {
         return -1;
@@ -541,4 +541,8 @@ int wsShakeHands(const char* recvBuff, int recvLen, SOCKET socket, const char* p
     pluginLog("wsShakeHands", 1, "WebSocket handshake succeeded");
 
     return 0;
+
+wsShakeHandsError:
+    socketSend(socket, HTTP_400, strlen(HTTP_400));
+    return -1;
 }
@@ -1,5 +1,7 @@
 #include <stdint.h>
 #include <stdbool.h>
+#include "utf8.h"
+#include "http.h"
 
 #ifndef QLWS_WS_H
 
@@ -15,37 +17,73 @@ typedef enum FrameType {
 } FrameType;
 
 typedef enum FrameState {
-    frameState_init,            // 未读取任何字节
-    frameState_firstByte,       // 已读取首字节FIN、RSV、opcode
-    frameState_mask,            // 已读取掩码
-    frameState_7bitLength,      // 已读取7bit长度
-    frameState_16bitLengthWait, // 等待读取16bit长度
-    frameState_63bitLengthWait, // 等待读取63bit长度
-    frameState_16bitLength,     // 已读取16bit长度
-    frameState_63bitLength,    	// 已读取63bit长度
-    frameState_maskingKey,      // 已读取Masking-key
-    frameState_readingData,     // 正在读取载荷数据
+    frameState_init,            // 帧头尚未接收完
+    frameState_readingData,     // 帧头已解析，正在接收载荷数据
     frameState_success,         // 读取完毕
     frameState_failure          // 读取错误
 } FrameState;
 
+// permessage-deflate扩展协商的结果
+typedef struct WsDeflateParams {
+    bool enabled;                   // 是否协商了permessage-deflate
+    bool serverNoContextTakeover;   // 服务器每条消息都重置压缩上下文
+    bool clientNoContextTakeover;   // 客户端每条消息都重置压缩上下文，服务器可以在消息之间重置解压上下文
+    int serverWindowBits;           // 服务器压缩使用的窗口大小
+    int clientWindowBits;           // 客户端压缩使用的窗口大小，解压时总使用最大窗口
+} WsDeflateParams;
+
+// 握手时通过子协议选择的消息编码，两个方向的数据消息都使用该编码
+typedef enum WsEncoding {
+    wsEncoding_json,        // qlws.json.v1，或客户端没有请求受支持的子协议，UTF-8 JSON文本帧
+    wsEncoding_msgpack,     // qlws.msgpack.v1，MessagePack二进制帧
+    wsEncoding_jsonGbk,     // qlws.json+gbk.v1，GBK编码的JSON二进制帧
+    wsEncoding_count
+} WsEncoding;
+
+// 最多可订阅的事件种类数
+#define WS_MAX_EVENTS 32
+
+// 握手时由子协议及请求路径中的查询参数确定的连接选项，之后的消息处理及广播直接按这些选项进行
+typedef struct WsSession {
+    WsEncoding encoding;
+    bool deflate;           // 查询参数deflate=0时即使客户端请求也不协商permessage-deflate
+    uint32_t events;        // 查询参数events，订阅的事件，第i位对应事件名表中的第i个事件，未给出时订阅全部事件
+    int batchDelay;         // 查询参数batch，合并发送的最长延迟（微秒），为-1时使用服务器的配置
+} WsSession;
+
+// 帧头最大长度：2字节共有字段 + 8字节附加长度字段 + 4字节掩码
+#define WS_MAX_HEADER_LEN 14
+
+// 服务器发出的帧不带掩码，帧头最多10字节
+#define WS_MAX_SERVER_HEADER_LEN 10
+
+// 关闭帧的状态码
+#define WS_CLOSE_PROTOCOL_ERROR     1002
+#define WS_CLOSE_UNSUPPORTED_DATA   1003
+#define WS_CLOSE_INVALID_PAYLOAD    1007
+#define WS_CLOSE_MESSAGE_TOO_BIG    1009
+
 typedef struct WsFrame {
     FrameState state;
     bool FIN;
+    bool compressed;        // RSV1位，协商了permessage-deflate时代表消息经过压缩
     FrameType frameType;
     uint8_t  mask[4];
-    unsigned char*  buff;   // 数据存放的空间
-    uint64_t buffSize;      // 当前申请的buff大小
-    uint64_t handledLen;    // 已处理的帧长度
-    uint64_t headerLen;     // 帧头长度 只有在state为'已读取掩码'及之后才有意义
-    uint64_t payloadLen;    // 载荷长度 只有在state为'已读取xbit长度'后才有意义
-    struct WsFrame* next;   // 下一帧的指针
+    unsigned char* buff;    // 指向调用者接收缓冲区中的帧首
+    unsigned char* payload; // 指向调用者接收缓冲区中已解码的载荷，只有在state为读取完毕时才有意义
+    uint64_t headerLen;     // 帧头长度 只有在state为'正在接收载荷数据'及之后才有意义
+    uint64_t payloadLen;    // 载荷长度 只有在state为'正在接收载荷数据'及之后才有意义
+    uint64_t unmaskedLen;   // 已在接收缓冲区中原地解码的载荷长度
+    uint16_t failureCode;   // state为读取错误时应使用的关闭状态码
 } WsFrame;
 
 void initWsFrameStruct(WsFrame* wsFrame);
-char* convertToWebSocketFrame(const char* data, FrameType type, size_t len, size_t* newLen);
-int readWebSocketFrameStream(WsFrame* wsFrame, const char* buff, int len);
-void freeWebSocketFrame(WsFrame* wsFrame);
-int wsShakeHands(const char* recvBuff, int recvLen, SOCKET socket, const char* path);
+size_t encodeFrameHeader(unsigned char* header, FrameType type, bool fin, bool compressed, uint64_t len);
+size_t readWebSocketFrameStream(WsFrame* wsFrame, char* buff, size_t len, Utf8State* utf8);
+int wsShakeHands(const char* request, const HttpRequest* req, SOCKET socket, const char* path, bool allowDeflate,
+    const char* const* eventNames, WsSession* session, WsDeflateParams* deflate);
+
+// 编码对应的数据帧类型，收到其它类型的数据帧时以1003关闭连接
+FrameType wsEncodingFrameType(WsEncoding encoding);
 
 #endif